@@ -0,0 +1,87 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+/* helpers shared by the microbenchmarks in this directory. Results are
+ * printed as one JSON object per line, with the same "tool", "requests",
+ * "seconds", "rps" and "latency_us" fields that htstress reports, so that
+ * all benchmark output can be collected and compared the same way.
+ */
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* latency samples in nanoseconds */
+struct samples {
+    uint64_t *v;
+    size_t n, size;
+};
+
+static inline void samples_init(struct samples *s, size_t size)
+{
+    s->v = malloc(sizeof(uint64_t) * size);
+    if (!s->v) {
+        fprintf(stderr, "samples_init: malloc failed\n");
+        exit(1);
+    }
+    s->n = 0;
+    s->size = size;
+}
+
+static inline void samples_add(struct samples *s, uint64_t ns)
+{
+    if (s->n < s->size)
+        s->v[s->n++] = ns;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+/* nearest-rank percentile, the samples must be sorted */
+static inline double samples_percentile(const struct samples *s, double p)
+{
+    if (!s->n)
+        return 0;
+    size_t rank = (size_t)(p / 100.0 * s->n + 0.5);
+    if (rank < 1)
+        rank = 1;
+    if (rank > s->n)
+        rank = s->n;
+    return s->v[rank - 1] / 1e3;
+}
+
+/* print the "latency_us" member of a result, sorting the samples */
+static inline void print_latency_json(FILE *fp, struct samples *s)
+{
+    static const struct {
+        const char *name;
+        double p;
+    } percentiles[] = {
+        {"p50", 50.0}, {"p90", 90.0}, {"p99", 99.0}, {"p99.9", 99.9}};
+    uint64_t sum = 0;
+
+    qsort(s->v, s->n, sizeof(uint64_t), cmp_u64);
+    for (size_t i = 0; i < s->n; i++)
+        sum += s->v[i];
+
+    fprintf(fp, "\"latency_us\": {\"min\": %.3f, \"mean\": %.3f",
+            s->n ? s->v[0] / 1e3 : 0.0, s->n ? sum / 1e3 / s->n : 0.0);
+    for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++)
+        fprintf(fp, ", \"%s\": %.3f", percentiles[i].name,
+                samples_percentile(s, percentiles[i].p));
+    fprintf(fp, ", \"max\": %.3f}", s->n ? s->v[s->n - 1] / 1e3 : 0.0);
+}
+
+#endif
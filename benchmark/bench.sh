@@ -1,3 +1,29 @@
+#!/usr/bin/env bash
+# Sweep concurrency against a running sehttpd and plot the results.
+# Usage: benchmark/bench.sh <name>
+#   results are appended to benchmark/<name>.csv, and if gnuplot is
+#   available, throughput and latency are plotted to benchmark/<name>.png
+
+OUT=./benchmark/${1:-result}
+
 for i in {1..100}; do
-    ./htstress -n 10000 -c $i -t 1 -f ./benchmark/$1 http://localhost:8081/
-done
\ No newline at end of file
+    ./htstress -n 10000 -c $i -t 1 -o csv -f $OUT.csv http://localhost:8081/ \
+        > /dev/null
+done
+
+if which gnuplot > /dev/null 2>&1; then
+    gnuplot <<EOT
+set datafile separator ","
+set terminal png size 1024,768
+set output "$OUT.png"
+set key autotitle columnhead
+set xlabel "concurrency"
+set ylabel "requests/sec"
+set y2label "latency (ms)"
+set y2tics
+plot "$OUT.csv" using 1:8 with lines title "requests/sec", \
+     "" using 1:(\$11 / 1000) axes x1y2 with lines title "p50", \
+     "" using 1:(\$13 / 1000) axes x1y2 with lines title "p99", \
+     "" using 1:(\$14 / 1000) axes x1y2 with lines title "p99.9"
+EOT
+fi
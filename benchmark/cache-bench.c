@@ -0,0 +1,245 @@
+/*
+ * cache-bench - count the cache misses of a running sehttpd per request
+ *
+ * Hardware counters are attached to every thread of the server, and of its
+ * worker processes in master mode, while a load generator runs. Only user
+ * space is counted: the layout of the server's own data is what is being
+ * measured, not the kernel's socket and file code. The number of requests
+ * is taken from the output of the load generator, either htstress text or
+ * JSON output.
+ *
+ *   cache-bench $(pidof sehttpd) ./htstress -n 200000 -c 4096 -k URL
+ *
+ * Counters the CPU or a virtual machine does not provide are reported as
+ * null.
+ */
+
+#include <dirent.h>
+#include <linux/perf_event.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+#define MAX_TASKS 256
+#define OUTPUT_SIZE 65536
+
+#define CACHE_EVENT(cache, op, result) \
+    ((cache) | ((op) << 8) | ((result) << 16))
+
+static const struct {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+} counters[] = {
+    {"l1d_misses", PERF_TYPE_HW_CACHE,
+     CACHE_EVENT(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_OP_READ,
+                 PERF_COUNT_HW_CACHE_RESULT_MISS)},
+    {"llc_misses", PERF_TYPE_HW_CACHE,
+     CACHE_EVENT(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_OP_READ,
+                 PERF_COUNT_HW_CACHE_RESULT_MISS)},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"task_clock_ns", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+};
+#define NCOUNTERS (sizeof(counters) / sizeof(counters[0]))
+
+static int fds[NCOUNTERS][MAX_TASKS];
+static int ntasks;
+
+static pid_t parent_of(pid_t pid)
+{
+    char path[64], line[256];
+    int ppid = 0;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return 0;
+    while (fgets(line, sizeof(line), fp))
+        if (sscanf(line, "PPid: %d", &ppid) == 1)
+            break;
+    fclose(fp);
+    return ppid;
+}
+
+static void attach_threads(pid_t pid)
+{
+    char path[64];
+    struct dirent *e;
+
+    snprintf(path, sizeof(path), "/proc/%d/task", pid);
+    DIR *dir = opendir(path);
+    while (dir && (e = readdir(dir)) && ntasks < MAX_TASKS) {
+        pid_t tid = atoi(e->d_name);
+        if (tid <= 0)
+            continue;
+        for (size_t c = 0; c < NCOUNTERS; c++) {
+            struct perf_event_attr attr = {
+                .size = sizeof(attr),
+                .type = counters[c].type,
+                .config = counters[c].config,
+                .disabled = 1,
+                .exclude_kernel = 1,
+                .exclude_hv = 1,
+            };
+            fds[c][ntasks] = syscall(SYS_perf_event_open, &attr, tid, -1, -1,
+                                     0);
+        }
+        ntasks++;
+    }
+    if (dir)
+        closedir(dir);
+}
+
+/* the server and its worker processes */
+static void attach(pid_t server)
+{
+    DIR *dir = opendir("/proc");
+    struct dirent *e;
+
+    attach_threads(server);
+    while (dir && (e = readdir(dir))) {
+        pid_t pid = atoi(e->d_name);
+        if (pid > 0 && pid != server && parent_of(pid) == server)
+            attach_threads(pid);
+    }
+    if (dir)
+        closedir(dir);
+}
+
+static void enable(bool on)
+{
+    for (size_t c = 0; c < NCOUNTERS; c++)
+        for (int t = 0; t < ntasks; t++)
+            if (fds[c][t] >= 0)
+                ioctl(fds[c][t], on ? PERF_EVENT_IOC_ENABLE
+                                    : PERF_EVENT_IOC_DISABLE);
+}
+
+/* sum of a counter over all threads, -1 if no thread supports it */
+static int64_t total(size_t c)
+{
+    int64_t sum = -1;
+
+    for (int t = 0; t < ntasks; t++) {
+        uint64_t v;
+        if (fds[c][t] < 0 || read(fds[c][t], &v, sizeof(v)) != sizeof(v))
+            continue;
+        sum = (sum < 0 ? 0 : sum) + v;
+    }
+    return sum;
+}
+
+/* run the load generator, echoing its output to stderr */
+static int run(char *argv[], char *out, size_t size)
+{
+    int pipefd[2], status;
+    size_t len = 0;
+    ssize_t n;
+
+    if (pipe(pipefd) < 0) {
+        perror("pipe");
+        exit(1);
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(pipefd[1], STDOUT_FILENO);
+        close(pipefd[0]);
+        execvp(argv[0], argv);
+        perror(argv[0]);
+        _exit(127);
+    }
+    close(pipefd[1]);
+    while ((n = read(pipefd[0], out + len, size - 1 - len)) > 0) {
+        fwrite(out + len, 1, n, stderr);
+        len += n;
+        if (len == size - 1) {
+            /* the result is printed last, keep the end of the output */
+            memmove(out, out + size / 2, len - size / 2);
+            len -= size / 2;
+        }
+    }
+    out[len] = '\0';
+    close(pipefd[0]);
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
+
+/* good requests as reported by htstress */
+static uint64_t requests_of(const char *out)
+{
+    const char *p;
+    uint64_t n = 0;
+
+    if ((p = strstr(out, "\"good\": ")))
+        sscanf(p, "\"good\": %" SCNu64, &n);
+    else if ((p = strstr(out, "good requests: ")))
+        sscanf(p, "good requests: %" SCNu64, &n);
+    return n;
+}
+
+int main(int argc, char *argv[])
+{
+    static char out[OUTPUT_SIZE];
+    bool json = false;
+    int first = 1;
+
+    if (argc > 1 && !strcmp(argv[1], "-j")) {
+        json = true;
+        first++;
+    }
+    if (argc - first < 2 || atoi(argv[first]) <= 0) {
+        fprintf(stderr,
+                "Usage: %s [-j] pid command [args...]\n"
+                "  -j       print a JSON line instead of a table\n"
+                "  pid      process id of the running sehttpd\n"
+                "  command  load generator, e.g. ./htstress ...\n",
+                argv[0]);
+        return 1;
+    }
+
+    attach(atoi(argv[first]));
+    if (!ntasks) {
+        fprintf(stderr, "no process %s\n", argv[first]);
+        return 1;
+    }
+
+    uint64_t start = now_ns();
+    enable(true);
+    int rc = run(argv + first + 1, out, sizeof(out));
+    enable(false);
+    double seconds = (now_ns() - start) / 1e9;
+
+    uint64_t requests = requests_of(out);
+    if (rc || !requests) {
+        fprintf(stderr, "the load generator failed or served no requests\n");
+        return 1;
+    }
+
+    if (json)
+        printf("{\"tool\": \"cache-bench\", \"threads\": %d, "
+               "\"requests\": %" PRIu64 ", \"seconds\": %.3f",
+               ntasks, requests, seconds);
+    else
+        printf("  %-14s %16s %14s\n", "counter", "total", "per request");
+    for (size_t c = 0; c < NCOUNTERS; c++) {
+        int64_t v = total(c);
+        if (json && v < 0)
+            printf(", \"%s\": null", counters[c].name);
+        else if (json)
+            printf(", \"%s\": %.3f", counters[c].name, (double) v / requests);
+        else if (v < 0)
+            printf("  %-14s %16s %14s\n", counters[c].name, "n/a", "n/a");
+        else
+            printf("  %-14s %16" PRId64 " %14.3f\n", counters[c].name, v,
+                   (double) v / requests);
+    }
+    if (json)
+        printf("}\n");
+
+    return 0;
+}
@@ -0,0 +1,84 @@
+#!/usr/bin/env python3
+#
+# Compare two result files of benchmark/suite.sh and flag regressions.
+#
+# Results are matched by (mode, class, keepalive, concurrency). Throughput
+# regresses when it drops, latency percentiles when they grow, by more than
+# the threshold (in percent). A run that is in the baseline but has no result
+# (it failed or timed out) counts as a regression, too. Exits with 1 if
+# anything regressed.
+
+import argparse
+import json
+import sys
+
+# metric name, how to read it from a result, True if higher is better
+METRICS = [
+    ("rps", lambda r: r["rps"], True),
+    ("p50", lambda r: r["latency_us"]["p50"], False),
+    ("p99", lambda r: r["latency_us"]["p99"], False),
+]
+
+
+def key(r):
+    return (r["mode"], r["class"], r["keepalive"], r["concurrency"])
+
+
+def describe(k):
+    return "%-10s %-5s %-10s c=%-4d" % (
+        k[0],
+        k[1],
+        "keepalive" if k[2] else "close",
+        k[3],
+    )
+
+
+def main():
+    parser = argparse.ArgumentParser(description="compare suite.sh results")
+    parser.add_argument("baseline")
+    parser.add_argument("results")
+    parser.add_argument("--threshold", type=float, default=10.0)
+    args = parser.parse_args()
+
+    with open(args.baseline) as f:
+        baseline = {key(r): r for r in json.load(f)}
+    with open(args.results) as f:
+        results = json.load(f)
+
+    regressions = 0
+    missing = set(baseline) - set(key(r) for r in results)
+    for k in sorted(missing):
+        print("%s  missing, the run failed" % describe(k))
+        regressions += 1
+
+    for r in results:
+        k = key(r)
+        if k not in baseline:
+            print("%s  new, no baseline" % describe(k))
+            continue
+
+        changes = []
+        for name, get, higher_is_better in METRICS:
+            old, new = get(baseline[k]), get(r)
+            if not old:
+                continue
+            delta = (new - old) * 100.0 / old
+            worse = -delta if higher_is_better else delta
+            mark = ""
+            if worse > args.threshold:
+                mark = " REGRESSION"
+                regressions += 1
+            changes.append("%s %+.1f%%%s" % (name, delta, mark))
+        print("%s  %s" % (describe(k), ", ".join(changes)))
+
+    if regressions:
+        print(
+            "\n%d regression(s) beyond %.1f%%" % (regressions, args.threshold)
+        )
+        return 1
+    print("\nno regressions beyond %.1f%%" % args.threshold)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,235 @@
+/*
+ * idle-bench - measure the memory a running sehttpd spends per idle
+ * connection
+ *
+ * The resident set size of the server, and of its worker processes in
+ * master mode, is sampled before opening connections and then twice:
+ *   accepted  the connections have not sent anything yet
+ *   served    the same connections are idle after one request each
+ * The connections have to be opened within the keep-alive timeout, and
+ * stay below MAX_CONNECTIONS / 2, beyond which the server shortens it.
+ */
+
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+#define DEFAULT_CONNS 4000
+
+/* time for the server to catch up with the last connections */
+#define SETTLE_US 200000
+
+static bool json;
+
+static long rss_of(pid_t pid)
+{
+    char path[64], line[256];
+    long kb = 0;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return 0;
+    while (fgets(line, sizeof(line), fp))
+        if (sscanf(line, "VmRSS: %ld kB", &kb) == 1)
+            break;
+    fclose(fp);
+    return kb * 1024;
+}
+
+static pid_t parent_of(pid_t pid)
+{
+    char path[64], line[256];
+    int ppid = 0;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return 0;
+    while (fgets(line, sizeof(line), fp))
+        if (sscanf(line, "PPid: %d", &ppid) == 1)
+            break;
+    fclose(fp);
+    return ppid;
+}
+
+/* resident bytes of the server and its worker processes */
+static long server_rss(pid_t server)
+{
+    long rss = rss_of(server);
+    DIR *dir = opendir("/proc");
+    struct dirent *e;
+
+    while (dir && (e = readdir(dir))) {
+        pid_t pid = atoi(e->d_name);
+        if (pid > 0 && pid != server && parent_of(pid) == server)
+            rss += rss_of(pid);
+    }
+    if (dir)
+        closedir(dir);
+    return rss;
+}
+
+static void report(const char *phase, size_t conns, long before, long after)
+{
+    if (json) {
+        printf("{\"tool\": \"idle-bench\", \"phase\": \"%s\", "
+               "\"connections\": %zu, \"rss_before\": %ld, "
+               "\"rss_after\": %ld, \"bytes_per_connection\": %.1f}\n",
+               phase, conns, before, after, (double) (after - before) / conns);
+        return;
+    }
+    printf("  %-9s %11zu %12ld %12ld %12.1f\n", phase, conns, before / 1024,
+           after / 1024, (double) (after - before) / conns);
+}
+
+/* accepts "http://host:port/path" or "host:port" */
+static int parse_url(const char *url, struct sockaddr_in *addr, char *path)
+{
+    char host[64];
+    int port = 80;
+
+    if (!strncmp(url, "http://", 7))
+        url += 7;
+    const char *slash = strchr(url, '/');
+    strcpy(path, slash ? slash : "/");
+
+    size_t len = slash ? (size_t)(slash - url) : strlen(url);
+    if (len >= sizeof(host))
+        return -1;
+    memcpy(host, url, len);
+    host[len] = '\0';
+
+    char *colon = strchr(host, ':');
+    if (colon) {
+        *colon = '\0';
+        port = atoi(colon + 1);
+    }
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(port);
+    return inet_pton(AF_INET, host, &addr->sin_addr) == 1 ? 0 : -1;
+}
+
+static int *open_conns(const struct sockaddr_in *addr, size_t conns)
+{
+    int *fds = malloc(sizeof(int) * conns);
+
+    for (size_t i = 0; fds && i < conns; i++) {
+        fds[i] = socket(AF_INET, SOCK_STREAM, 0);
+        if (fds[i] < 0 ||
+            connect(fds[i], (struct sockaddr *) addr, sizeof(*addr)) < 0) {
+            perror("connect");
+            exit(1);
+        }
+    }
+    return fds;
+}
+
+static void close_conns(int *fds, size_t conns)
+{
+    for (size_t i = 0; i < conns; i++)
+        close(fds[i]);
+    free(fds);
+}
+
+/* send one request on every connection, then read all the responses */
+static void serve_conns(int *fds, size_t conns, const char *path)
+{
+    char req[512], buf[65536];
+    int len = snprintf(req, sizeof(req),
+                       "GET %s HTTP/1.1\r\nHost: idle-bench\r\n\r\n", path);
+
+    for (size_t i = 0; i < conns; i++) {
+        if (write(fds[i], req, len) != len) {
+            perror("write");
+            exit(1);
+        }
+    }
+    for (size_t i = 0; i < conns; i++) {
+        /* the response ends with the file, which has to fit in one read */
+        if (read(fds[i], buf, sizeof(buf)) <= 0) {
+            fprintf(stderr, "connection %zu got no response\n", i);
+            exit(1);
+        }
+    }
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-n conns] [-j] pid url\n"
+            "  -n conns  connections to open (%d)\n"
+            "  -j        print JSON lines instead of a table\n"
+            "  pid       process id of the running sehttpd\n"
+            "  url       a small file served by it, http://127.0.0.1:8081/\n",
+            prog, DEFAULT_CONNS);
+}
+
+int main(int argc, char *argv[])
+{
+    long conns = DEFAULT_CONNS;
+    struct sockaddr_in addr;
+    char path[256];
+    int c;
+
+    while ((c = getopt(argc, argv, "n:jh")) != -1) {
+        switch (c) {
+        case 'n':
+            conns = atol(optarg);
+            break;
+        case 'j':
+            json = true;
+            break;
+        default:
+            usage(argv[0]);
+            return c == 'h' ? 0 : 1;
+        }
+    }
+    if (conns <= 0 || argc - optind != 2 || strlen(argv[optind + 1]) > 200 ||
+        parse_url(argv[optind + 1], &addr, path) < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    pid_t server = atoi(argv[optind]);
+    if (!server_rss(server)) {
+        fprintf(stderr, "no process %d\n", server);
+        return 1;
+    }
+
+    struct rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    if (rl.rlim_cur < (rlim_t) conns + 16) {
+        fprintf(stderr, "at most %ld descriptors\n", (long) rl.rlim_cur);
+        return 1;
+    }
+
+    if (!json)
+        printf("  %-9s %11s %12s %12s %12s\n", "phase", "connections",
+               "before KiB", "after KiB", "bytes/conn");
+
+    /* both phases use the same connections: memory freed by the server
+     * stays resident, it would hide what a second set costs
+     */
+    long before = server_rss(server);
+    int *fds = open_conns(&addr, conns);
+    usleep(SETTLE_US);
+    report("accepted", conns, before, server_rss(server));
+
+    serve_conns(fds, conns, path);
+    usleep(SETTLE_US);
+    report("served", conns, before, server_rss(server));
+    close_conns(fds, conns);
+
+    return 0;
+}
@@ -0,0 +1,675 @@
+/*
+ * parser-bench - measure the HTTP request parser without any socket I/O
+ *
+ * Every request of the corpus is fed to http_parse_request_line() and
+ * http_parse_request_body() the same way do_request() does: first in one
+ * piece, then split at every byte boundary as if it arrived in two reads.
+ * Both runs must produce exactly the same parse result, otherwise the
+ * benchmark fails. The built-in corpus can be extended with files holding
+ * one raw request each (CRLF line endings).
+ */
+
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC 1
+#endif
+
+#include "bench.h"
+#include "http.h"
+
+#define DEFAULT_ROUNDS 20000
+#define MAX_CORPUS 64
+#define MAX_REQUEST 16384
+
+struct sample {
+    const char *name;
+    char *data;
+    size_t len;
+};
+
+/* request headers as sent by common clients */
+static const char *builtin[][2] = {
+    {"curl",
+     "GET /index.html HTTP/1.1\r\n"
+     "Host: 127.0.0.1:8081\r\n"
+     "User-Agent: curl/7.88.1\r\n"
+     "Accept: */*\r\n"
+     "\r\n"},
+    {"wget",
+     "GET /index.html HTTP/1.1\r\n"
+     "Host: 127.0.0.1:8081\r\n"
+     "User-Agent: Wget/1.21.3\r\n"
+     "Accept: */*\r\n"
+     "Accept-Encoding: identity\r\n"
+     "Connection: Keep-Alive\r\n"
+     "\r\n"},
+    {"ab",
+     "GET / HTTP/1.0\r\n"
+     "Host: localhost\r\n"
+     "User-Agent: ApacheBench/2.3\r\n"
+     "Accept: */*\r\n"
+     "\r\n"},
+    {"firefox",
+     "GET /static/css/main.css?v=20200301 HTTP/1.1\r\n"
+     "Host: www.example.com\r\n"
+     "User-Agent: Mozilla/5.0 (X11; Ubuntu; Linux x86_64; rv:109.0) "
+     "Gecko/20100101 Firefox/115.0\r\n"
+     "Accept: text/css,*/*;q=0.1\r\n"
+     "Accept-Language: en-US,en;q=0.5\r\n"
+     "Accept-Encoding: gzip, deflate, br\r\n"
+     "Referer: https://www.example.com/\r\n"
+     "Connection: keep-alive\r\n"
+     "Sec-Fetch-Dest: style\r\n"
+     "Sec-Fetch-Mode: no-cors\r\n"
+     "Sec-Fetch-Site: same-origin\r\n"
+     "If-Modified-Since: Sun, 01 Mar 2020 10:00:00 GMT\r\n"
+     "\r\n"},
+    {"chrome",
+     "GET /news/article/2020/03/some-long-article-title.html HTTP/1.1\r\n"
+     "Host: www.example.com\r\n"
+     "Connection: keep-alive\r\n"
+     "Cache-Control: max-age=0\r\n"
+     "sec-ch-ua: \"Chromium\";v=\"116\", \"Not)A;Brand\";v=\"24\", "
+     "\"Google Chrome\";v=\"116\"\r\n"
+     "sec-ch-ua-mobile: ?0\r\n"
+     "sec-ch-ua-platform: \"Linux\"\r\n"
+     "Upgrade-Insecure-Requests: 1\r\n"
+     "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+     "(KHTML, like Gecko) Chrome/116.0.0.0 Safari/537.36\r\n"
+     "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+     "image/avif,image/webp,image/apng,*/*;q=0.8,"
+     "application/signed-exchange;v=b3;q=0.7\r\n"
+     "Sec-Fetch-Site: none\r\n"
+     "Sec-Fetch-Mode: navigate\r\n"
+     "Sec-Fetch-User: ?1\r\n"
+     "Sec-Fetch-Dest: document\r\n"
+     "Accept-Encoding: gzip, deflate, br\r\n"
+     "Accept-Language: en-US,en;q=0.9,zh-TW;q=0.8,zh;q=0.7\r\n"
+     "\r\n"},
+    {"safari",
+     "GET /images/logo.png HTTP/1.1\r\n"
+     "Host: www.example.com\r\n"
+     "Accept: image/webp,image/png,image/svg+xml,image/*;q=0.8,*/*;q=0.5\r\n"
+     "Accept-Language: en-US,en;q=0.9\r\n"
+     "Connection: keep-alive\r\n"
+     "Accept-Encoding: gzip, deflate\r\n"
+     "User-Agent: Mozilla/5.0 (iPhone; CPU iPhone OS 16_6 like Mac OS X) "
+     "AppleWebKit/605.1.15 (KHTML, like Gecko) Version/16.6 "
+     "Mobile/15E148 Safari/604.1\r\n"
+     "Referer: https://www.example.com/\r\n"
+     "\r\n"},
+    {"googlebot",
+     "GET /robots.txt HTTP/1.1\r\n"
+     "Host: www.example.com\r\n"
+     "Connection: keep-alive\r\n"
+     "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+     "*/*;q=0.8\r\n"
+     "From: googlebot(at)googlebot.com\r\n"
+     "User-Agent: Mozilla/5.0 (compatible; Googlebot/2.1; "
+     "+http://www.google.com/bot.html)\r\n"
+     "Accept-Encoding: gzip, deflate, br\r\n"
+     "\r\n"},
+    {"bingbot",
+     "HEAD /sitemap.xml HTTP/1.1\r\n"
+     "Host: www.example.com\r\n"
+     "User-Agent: Mozilla/5.0 (compatible; bingbot/2.0; "
+     "+http://www.bing.com/bingbot.htm)\r\n"
+     "Accept: */*\r\n"
+     "Pragma: no-cache\r\n"
+     "\r\n"},
+    {"cookie",
+     "GET /account/settings HTTP/1.1\r\n"
+     "Host: www.example.com\r\n"
+     "User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) "
+     "AppleWebKit/537.36 (KHTML, like Gecko) Chrome/116.0.0.0 "
+     "Safari/537.36\r\n"
+     "Accept: text/html,application/xhtml+xml\r\n"
+     "Cookie: _ga=GA1.2.1234567890.1583020800; _gid=GA1.2.987654321."
+     "1583020800; session=eyJhbGciOiJIUzI1NiIsInR5cCI6IkpXVCJ9.eyJzdWIiOiIx"
+     "MjM0NTY3ODkwIiwibmFtZSI6IkpvaG4gRG9lIiwiaWF0IjoxNTE2MjM5MDIyLCJyb2xl"
+     "cyI6WyJhZG1pbiIsImVkaXRvciIsInZpZXdlciJdLCJwcmVmcyI6eyJ0aGVtZSI6ImRh"
+     "cmsiLCJsYW5nIjoiZW4tVVMiLCJ0eiI6IkFzaWEvVGFpcGVpIn19.SflKxwRJSMeKKF2"
+     "QT4fwpMeJf36POk6yJV_adQssw5c; csrftoken=Xy7Kq2LmN9pR4sT6vW8zA1bC3dE5f"
+     "G7hJ9kL0mN2oP4qR6sT8uV0wX2yZ4; consent=analytics%3Dtrue%26ads%3Dfalse"
+     "%26functional%3Dtrue; _fbp=fb.1.1583020800000.1234567890; recent=%5B"
+     "%22%2Fproducts%2F123%22%2C%22%2Fproducts%2F456%22%2C%22%2Fproducts%2F"
+     "789%22%2C%22%2Fcart%22%5D; ab_test=variant-b; locale=en_US\r\n"
+     "Connection: keep-alive\r\n"
+     "\r\n"},
+    {"http10",
+     "GET /cgi-bin/status HTTP/1.0\r\n"
+     "\r\n"},
+};
+
+/* everything the parser leaves behind, as offsets into the request */
+struct parse_result {
+    int rc_line, rc_body;
+    int method;
+    long uri_start, uri_end;
+    int http_major, http_minor;
+    size_t pos;
+    int nheaders;
+    uint32_t headers_hash; /* FNV-1a over all header offsets */
+};
+
+static struct sample corpus[MAX_CORPUS];
+static int ncorpus;
+
+static void add_sample(const char *name, const char *data, size_t len)
+{
+    if (ncorpus == MAX_CORPUS) {
+        fprintf(stderr, "too many corpus entries, max %d\n", MAX_CORPUS);
+        exit(1);
+    }
+
+    /* the parser may read 4 bytes past the method, like the server buffer */
+    char *buf = malloc(len + 4);
+    memcpy(buf, data, len);
+    memset(buf + len, 0, 4);
+
+    corpus[ncorpus].name = name;
+    corpus[ncorpus].data = buf;
+    corpus[ncorpus].len = len;
+    ncorpus++;
+}
+
+static void load_sample(const char *path)
+{
+    static char buf[MAX_REQUEST];
+
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        perror(path);
+        exit(1);
+    }
+    size_t len = fread(buf, 1, sizeof(buf), fp);
+    if (!feof(fp)) {
+        fprintf(stderr, "%s: larger than %d bytes\n", path, MAX_REQUEST);
+        exit(1);
+    }
+    fclose(fp);
+
+    const char *name = strrchr(path, '/');
+    add_sample(name ? name + 1 : path, buf, len);
+}
+
+static inline uint32_t fnv1a(uint32_t h, long v)
+{
+    for (int i = 0; i < (int) sizeof(v); i++) {
+        h ^= (v >> (i * 8)) & 0xff;
+        h *= 16777619;
+    }
+    return h;
+}
+
+static inline void reset_request(http_request_t *r, char *buf, size_t len)
+{
+    memset(r, 0, sizeof(*r));
+    INIT_LIST_HEAD(&(r->list));
+    r->buf = buf;
+    r->buf_size = len + 4;
+}
+
+/* drive the parser like do_request() does after every read */
+static inline int parse(http_request_t *r, size_t last)
+{
+    int rc;
+
+    r->last = last;
+    if (!r->request_line_done) {
+        rc = http_parse_request_line(r);
+        if (rc != 0)
+            return rc;
+        r->request_line_done = true;
+    }
+    return http_parse_request_body(r);
+}
+
+/* turn the parser state into a parse_result, releasing the header list */
+static void collect(http_request_t *r,
+                    int rc,
+                    struct parse_result *res,
+                    bool keep)
+{
+    char *base = r->buf;
+    list_head *pos;
+
+    if (keep) {
+        memset(res, 0, sizeof(*res));
+        res->rc_line = r->request_line_done ? 0 : rc;
+        res->rc_body = r->request_line_done ? rc : -1;
+        res->method = r->method;
+        res->uri_start = (char *) r->uri_start - base;
+        res->uri_end = (char *) r->uri_end - base;
+        res->http_major = r->http_major;
+        res->http_minor = r->http_minor;
+        res->pos = r->pos;
+        res->headers_hash = 2166136261u;
+    }
+
+    while (!list_empty(&(r->list))) {
+        pos = r->list.next;
+        http_header_t *hd = list_entry(pos, http_header_t, list);
+        if (keep) {
+            res->nheaders++;
+            res->headers_hash =
+                fnv1a(res->headers_hash, (char *) hd->key_start - base);
+            res->headers_hash =
+                fnv1a(res->headers_hash, (char *) hd->key_end - base);
+            res->headers_hash =
+                fnv1a(res->headers_hash, (char *) hd->value_start - base);
+            res->headers_hash =
+                fnv1a(res->headers_hash, (char *) hd->value_end - base);
+        }
+        list_del(pos);
+        free(hd);
+    }
+}
+
+/* parse a request in one read, or in two reads split at byte 'split' */
+static int parse_once(struct sample *s,
+                      size_t split,
+                      struct parse_result *res)
+{
+    http_request_t r;
+    int rc;
+
+    reset_request(&r, s->data, s->len);
+    if (split) {
+        rc = parse(&r, split);
+        if (rc == EAGAIN)
+            rc = parse(&r, s->len);
+    } else {
+        rc = parse(&r, s->len);
+    }
+    collect(&r, rc, res, res != NULL);
+    return rc;
+}
+
+static bool same_result(const struct parse_result *a,
+                        const struct parse_result *b)
+{
+    return a->rc_line == b->rc_line && a->rc_body == b->rc_body &&
+           a->method == b->method && a->uri_start == b->uri_start &&
+           a->uri_end == b->uri_end && a->http_major == b->http_major &&
+           a->http_minor == b->http_minor && a->pos == b->pos &&
+           a->nheaders == b->nheaders && a->headers_hash == b->headers_hash;
+}
+
+static int verify(void)
+{
+    int failed = 0;
+
+    for (int i = 0; i < ncorpus; i++) {
+        struct sample *s = &corpus[i];
+        struct parse_result whole, part;
+
+        int rc = parse_once(s, 0, &whole);
+        if (rc != 0) {
+            fprintf(stderr, "%s: parse error %d\n", s->name, rc);
+            failed++;
+            continue;
+        }
+        for (size_t split = 1; split < s->len; split++) {
+            parse_once(s, split, &part);
+            if (!same_result(&whole, &part)) {
+                fprintf(stderr,
+                        "%s: result differs when split at byte %zu of %zu\n",
+                        s->name, split, s->len);
+                failed++;
+                break;
+            }
+        }
+    }
+    return failed;
+}
+
+/* chunked request bodies, with what they decode to or the error they
+ * make. rest is what follows the body, the next request.
+ */
+static const struct {
+    const char *name, *in, *out;
+    int rc;
+    size_t rest;
+} chunked[] = {
+    {"one chunk", "5\r\nhello\r\n0\r\n\r\n", "hello", 0, 0},
+    {"chunks", "A\r\n0123456789\r\n1\r\nx\r\n0\r\n\r\n", "0123456789x", 0, 0},
+    {"extensions", "5;a=b ;c\r\nhello\r\n0;last\r\n\r\n", "hello", 0, 0},
+    {"trailer", "5\r\nhello\r\n0\r\nX-Sum: 1\r\nY: 2\r\n\r\n", "hello", 0, 0},
+    {"pipelined", "2\r\nhi\r\n0\r\n\r\nGET / HTTP/1.1\r\n", "hi", 0, 16},
+    {"truncated", "5\r\nhel", "hel", EAGAIN, 0},
+    {"no size", "\r\n", "", HTTP_PARSER_INVALID_CHUNK, 0},
+    {"bad size", "5g\r\nhello\r\n0\r\n\r\n", "", HTTP_PARSER_INVALID_CHUNK, 0},
+    {"size overflow", "10000000000000000\r\n", "", HTTP_PARSER_INVALID_CHUNK,
+     0},
+    {"LF after size", "5\nhello\r\n0\r\n\r\n", "", HTTP_PARSER_INVALID_CHUNK,
+     0},
+    {"LF after extension", "5;a\nhello\r\n0\r\n\r\n", "",
+     HTTP_PARSER_INVALID_CHUNK, 0},
+    {"CR alone after size", "5\rhello\r\n0\r\n\r\n", "",
+     HTTP_PARSER_INVALID_CHUNK, 0},
+    {"LF after data", "5\r\nhello\n0\r\n\r\n", "hello",
+     HTTP_PARSER_INVALID_CHUNK, 0},
+    {"data too long", "5\r\nhelloX\r\n0\r\n\r\n", "hello",
+     HTTP_PARSER_INVALID_CHUNK, 0},
+    {"LF in trailer", "0\r\nX: 1\n\r\n", "", HTTP_PARSER_INVALID_CHUNK, 0},
+    {"LF at the end", "0\r\n\n", "", HTTP_PARSER_INVALID_CHUNK, 0},
+};
+
+/* decode a chunked body which arrives in two reads, split at byte split,
+ * taking the data the way http_read_body() does
+ */
+static int decode_chunked(const char *in,
+                          size_t len,
+                          size_t split,
+                          char *out,
+                          size_t *out_len,
+                          size_t *rest)
+{
+    http_request_t r;
+
+    reset_request(&r, (char *) in, len);
+    r.last = split ? split : len;
+    *out_len = 0;
+
+    for (;;) {
+        int rc = http_parse_chunked(&r);
+        if (rc != 0 && rc != EAGAIN)
+            return rc;
+        if (rc == 0 && !r.body_left) {
+            *rest = len - r.pos;
+            return 0;
+        }
+
+        size_t n = rc ? 0 : r.last - r.pos;
+        if (n > r.body_left)
+            n = r.body_left;
+        memcpy(out + *out_len, in + r.pos, n);
+        *out_len += n;
+        r.pos += n;
+        r.body_left -= n;
+        if (!n) {
+            if (r.last == len)
+                return EAGAIN;
+            r.last = len;
+        }
+    }
+}
+
+static int verify_chunked(void)
+{
+    int failed = 0;
+
+    for (size_t i = 0; i < sizeof(chunked) / sizeof(chunked[0]); i++) {
+        size_t len = strlen(chunked[i].in);
+
+        for (size_t split = 0; split < len; split++) {
+            char out[64];
+            size_t out_len, rest = 0;
+            int rc = decode_chunked(chunked[i].in, len, split, out, &out_len,
+                                    &rest);
+            /* data before an error may or may not have been taken */
+            bool data_ok =
+                (rc != 0 && rc != EAGAIN) ||
+                (out_len == strlen(chunked[i].out) &&
+                 !memcmp(out, chunked[i].out, out_len));
+            if (rc != chunked[i].rc || !data_ok || rest != chunked[i].rest) {
+                fprintf(stderr, "chunked %s: wrong result, split at %zu\n",
+                        chunked[i].name, split);
+                failed++;
+                break;
+            }
+        }
+    }
+    return failed;
+}
+
+/* request targets and the file each stands for, NULL if it is refused.
+ * size is the room given for the path, 0 for plenty.
+ */
+static const struct {
+    const char *uri, *path;
+    size_t size;
+} uris[] = {
+    {"/", "/index.html", 0},
+    {"/a//b/../c/", "/a/c/index.html", 0},
+    {"/%63", "/c/index.html", 0},
+    {"/style.css?v=2", "/style.css", 0},
+    {"/a%2Fb.txt", "/a/b.txt", 0},
+    {"/a/%2E%2E/b.txt", "/b.txt", 0},
+    {"/./a/./b.txt", "/a/b.txt", 0},
+    {"/a%00.txt", NULL, 0},
+    {"/a%2", NULL, 0},
+    {"/a%zz", NULL, 0},
+    {"/..", NULL, 0},
+    {"/a/../../b.txt", NULL, 0},
+    {"/a/%2E%2E%2F%2E%2E/b.txt", NULL, 0},
+    {"a.txt", NULL, 0},
+    {"", NULL, 0},
+    {"/abcdef.txt", "/abcdef.txt", sizeof("/abcdef.txt")},
+    {"/abcdefg.txt", NULL, sizeof("/abcdef.txt")},
+    {"/abcdef", NULL, sizeof("/abcdef/index.html") - 1},
+};
+
+static int verify_uri(void)
+{
+    int failed = 0;
+
+    for (size_t i = 0; i < sizeof(uris) / sizeof(uris[0]); i++) {
+        char path[256];
+        size_t size = uris[i].size ? uris[i].size : sizeof(path);
+        ssize_t n = http_normalize_uri(uris[i].uri, strlen(uris[i].uri), path,
+                                       size);
+        bool ok = uris[i].path ? n == (ssize_t) strlen(uris[i].path) &&
+                                     !strcmp(path, uris[i].path)
+                               : n < 0;
+        if (!ok) {
+            fprintf(stderr, "uri %s: wrong path\n", uris[i].uri);
+            failed++;
+        }
+    }
+    return failed;
+}
+
+/* dates of requests and the time each is, -1 if it is not a date */
+static const struct {
+    const char *in;
+    time_t t;
+} dates[] = {
+    {"Sun, 06 Nov 1994 08:49:37 GMT", 784111777},
+    {"Sunday, 06-Nov-94 08:49:37 GMT", 784111777},
+    {"Sun Nov  6 08:49:37 1994", 784111777},
+    {" Sun, 06 Nov 1994 08:49:37 GMT\t", 784111777},
+    {"Wednesday, 29-Feb-12 23:59:60 GMT", 1330560000},
+    {"Thu, 01 Jan 1970 00:00:00 GMT", 0},
+    {"Tue, 29 Feb 2000 12:00:00 GMT", 951825600},
+    {"Mon, 01 Jan 2024 00:00:00 GMT", 1704067200},
+    {"Thu Feb 29 12:00:00 2024", 1709208000},
+    {"Sun, 06 Nov 1994 08:49:37 UTC", -1},
+    {"Sun, 06 Nov 1994 08:49:37", -1},
+    {"Sun, 06 Foo 1994 08:49:37 GMT", -1},
+    {"Sun, 06 Nov 1994 24:49:37 GMT", -1},
+    {"Sun, 06 Nov 1969 08:49:37 GMT", -1},
+    {"Sunday, 06-Nov-1994 08:49:37 GMT", -1},
+    {"Sun Nov 6 08:49:37 1994", -1},
+    {"1994-11-06T08:49:37Z", -1},
+    {"", -1},
+};
+
+static int verify_date(void)
+{
+    int failed = 0;
+
+    for (size_t i = 0; i < sizeof(dates) / sizeof(dates[0]); i++) {
+        if (http_parse_date(dates[i].in, strlen(dates[i].in)) != dates[i].t) {
+            fprintf(stderr, "date \"%s\": wrong time\n", dates[i].in);
+            failed++;
+        }
+    }
+    return failed;
+}
+
+static inline uint64_t cycles(void)
+{
+#ifdef HAVE_RDTSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+struct measurement {
+    uint64_t requests, bytes, ns, cycles;
+};
+
+static void run(struct sample *s,
+                int rounds,
+                bool split,
+                struct measurement *m)
+{
+    uint64_t t0 = now_ns(), c0 = cycles();
+
+    for (int n = 0; n < rounds; n++) {
+        if (!split) {
+            parse_once(s, 0, NULL);
+            m->requests++;
+            m->bytes += s->len;
+            continue;
+        }
+        for (size_t at = 1; at < s->len; at++) {
+            parse_once(s, at, NULL);
+            m->requests++;
+            m->bytes += s->len;
+        }
+    }
+
+    m->cycles += cycles() - c0;
+    m->ns += now_ns() - t0;
+}
+
+static void report(FILE *fp,
+                   const char *name,
+                   size_t len,
+                   const struct measurement *m,
+                   bool json)
+{
+    double ns_req = (double) m->ns / m->requests;
+    double bytes_cycle = m->cycles ? (double) m->bytes / m->cycles : 0;
+
+    if (json) {
+        fprintf(fp,
+                "{\"name\": \"%s\", \"bytes\": %zu, \"requests\": %" PRIu64
+                ", \"ns_per_request\": %.1f, \"bytes_per_cycle\": %.3f}",
+                name, len, m->requests, ns_req, bytes_cycle);
+        return;
+    }
+    fprintf(fp, "  %-12s %6zu %12" PRIu64 " %12.1f", name, len, m->requests,
+            ns_req);
+    if (m->cycles)
+        fprintf(fp, " %12.3f", bytes_cycle);
+    fprintf(fp, "\n");
+}
+
+static void report_mode(const char *mode,
+                        int rounds,
+                        bool split,
+                        bool json,
+                        bool last)
+{
+    struct measurement total = {0};
+
+    if (json)
+        printf("\"%s\": [", mode);
+    else
+        printf("%s:\n  %-12s %6s %12s %12s %12s\n", mode, "request", "bytes",
+               "parses", "ns/request", "bytes/cycle");
+
+    for (int i = 0; i < ncorpus; i++) {
+        struct measurement m = {0};
+        /* split runs parse each request len - 1 times per round */
+        int n = split ? rounds / 64 + 1 : rounds;
+
+        run(&corpus[i], n, split, &m);
+        report(stdout, corpus[i].name, corpus[i].len, &m, json);
+        if (json)
+            printf(", ");
+
+        total.requests += m.requests;
+        total.bytes += m.bytes;
+        total.ns += m.ns;
+        total.cycles += m.cycles;
+    }
+    report(stdout, "total", total.bytes / total.requests, &total, json);
+    if (json)
+        printf("]%s", last ? "" : ", ");
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-n rounds] [-j] [request files...]\n"
+            "  -n rounds  whole-request parses per corpus entry (%d)\n"
+            "  -j         print one JSON object instead of a table\n",
+            prog, DEFAULT_ROUNDS);
+}
+
+int main(int argc, char *argv[])
+{
+    int rounds = DEFAULT_ROUNDS;
+    bool json = false;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:jh")) != -1) {
+        switch (c) {
+        case 'n':
+            rounds = atoi(optarg);
+            break;
+        case 'j':
+            json = true;
+            break;
+        default:
+            usage(argv[0]);
+            return c == 'h' ? 0 : 1;
+        }
+    }
+    if (rounds <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    for (size_t i = 0; i < sizeof(builtin) / sizeof(builtin[0]); i++)
+        add_sample(builtin[i][0], builtin[i][1], strlen(builtin[i][1]));
+    for (int i = optind; i < argc; i++)
+        load_sample(argv[i]);
+
+    int failed = verify();
+    if (failed) {
+        fprintf(stderr, "%d corpus entries parse differently when split\n",
+                failed);
+        return 1;
+    }
+    failed = verify_chunked();
+    if (failed) {
+        fprintf(stderr, "%d chunked bodies decode wrongly\n", failed);
+        return 1;
+    }
+    failed = verify_uri() + verify_date();
+    if (failed) {
+        fprintf(stderr, "%d paths or dates come out wrong\n", failed);
+        return 1;
+    }
+
+    if (json)
+        printf("{\"tool\": \"parser-bench\", \"rounds\": %d, ", rounds);
+    report_mode("whole", rounds, false, json, false);
+    report_mode("split", rounds, true, json, true);
+    if (json)
+        printf("}\n");
+    else if (!cycles())
+        printf("(no cycle counter on this CPU, bytes/cycle not reported)\n");
+
+    return 0;
+}
@@ -0,0 +1,95 @@
+#!/usr/bin/env bash
+# CPU time sehttpd spends per GB of file data with each way of sending it.
+#
+# Usage: benchmark/send-bench.sh [-j]
+#
+# The server is built once per SEND_BACKEND and serves one large file over
+# keep-alive connections. The user and system time of the server process
+# (all of its threads) is read from /proc before and after. -j prints JSON
+# lines instead of a table.
+#
+# Over loopback the kernel copies MSG_ZEROCOPY data anyway, so SEND_ZEROCOPY
+# only pays off against a real network interface: set BENCH_URL to a
+# non-loopback address of this machine to measure that.
+#
+# Environment:
+#   BENCH_BACKENDS  backends to measure (SEND_SENDFILE SEND_SPLICE
+#                   SEND_ZEROCOPY SEND_WRITE)
+#   BENCH_SIZE      file size in MB (64)
+#   BENCH_GB        data to serve per backend in GB (4)
+#   BENCH_URL       base URL of the server (http://127.0.0.1:8081)
+
+BACKENDS=${BENCH_BACKENDS:-"SEND_SENDFILE SEND_SPLICE SEND_ZEROCOPY SEND_WRITE"}
+SIZE=${BENCH_SIZE:-64}
+GB=${BENCH_GB:-4}
+URL=${BENCH_URL:-http://127.0.0.1:8081}
+LOCAL_PORT="8081"
+
+json=0
+[ "$1" = "-j" ] && json=1
+
+WORK=$(mktemp -d)
+server_pid=
+cleanup() {
+    [ -n "$server_pid" ] && kill $server_pid 2>/dev/null
+    rm -rf $WORK
+}
+trap cleanup EXIT
+
+wait_server() {
+    for i in {1..50}; do
+        sleep 0.1
+        (exec 3<>/dev/tcp/127.0.0.1/$LOCAL_PORT) 2>/dev/null && return 0
+    done
+    echo "sehttpd did not start" >&2
+    return 1
+}
+
+# user + system time of a process in clock ticks
+cpu_ticks() {
+    local stat
+    read -a stat < /proc/$1/stat
+    echo $((stat[13] + stat[14]))
+}
+
+mkdir -p $WORK/www
+head -c $((SIZE << 20)) /dev/urandom > $WORK/www/big.bin
+requests=$((GB * 1024 / SIZE))
+hz=$(getconf CLK_TCK)
+
+[ $json = 1 ] || printf "  %-14s %10s %10s %12s\n" backend GB/s "CPU s/GB" "CPU %"
+for backend in $BACKENDS; do
+    make -s clean
+    make -s SEND_BACKEND=$backend sehttpd htstress > /dev/null || exit 1
+    cp sehttpd $WORK/sehttpd-$backend
+
+    (cd $WORK && exec ./sehttpd-$backend > /dev/null 2>&1) &
+    server_pid=$!
+    wait_server || exit 1
+
+    before=$(cpu_ticks $server_pid)
+    start=$(date +%s.%N)
+    ./htstress -n $requests -c 4 -t 2 -k $URL/big.bin > /dev/null || exit 1
+    end=$(date +%s.%N)
+    after=$(cpu_ticks $server_pid)
+
+    kill $server_pid
+    wait $server_pid 2>/dev/null
+    server_pid=
+
+    read gbps cpu_per_gb cpu_pct <<< $(awk -v t0=$start -v t1=$end \
+        -v c=$((after - before)) -v hz=$hz -v gb=$GB 'BEGIN {
+            s = t1 - t0; cpu = c / hz
+            printf "%.3f %.3f %.1f", gb / s, cpu / gb, 100 * cpu / s }')
+    if [ $json = 1 ]; then
+        echo "{\"tool\": \"send-bench\", \"backend\": \"$backend\"," \
+             "\"file_mb\": $SIZE, \"gb\": $GB, \"gb_per_s\": $gbps," \
+             "\"cpu_s_per_gb\": $cpu_per_gb, \"cpu_percent\": $cpu_pct}"
+    else
+        printf "  %-14s %10s %10s %12s\n" $backend $gbps $cpu_per_gb $cpu_pct
+    fi
+done
+
+# leave the default build behind
+make -s clean
+make -s > /dev/null
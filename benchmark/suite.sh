@@ -0,0 +1,148 @@
+#!/usr/bin/env bash
+# Benchmark matrix: every concurrency mode of sehttpd, every file size class
+# of a synthetic webroot, a sweep over client concurrency and keep-alive.
+#
+# Usage: benchmark/suite.sh [--update-baseline]
+#
+# Results go to benchmark/results/<date>.json and are compared against
+# benchmark/baseline.json; the run fails when a result regressed by more
+# than BENCH_THRESHOLD percent. --update-baseline stores the results as the
+# new baseline instead.
+#
+# Environment:
+#   BENCH_MODES        sehttpd builds to measure (single thpool lf_thpool)
+#   BENCH_CONCURRENCY  client connections to sweep (1 16 64 256)
+#   BENCH_REQUESTS     requests per run for the smallest class (20000)
+#   BENCH_THREADS      htstress threads (2)
+#   BENCH_THRESHOLD    tolerated regression in percent (10)
+#   BENCH_TIMEOUT      seconds before a run counts as failed (60)
+
+source scripts/util.sh
+
+MODES=${BENCH_MODES:-"single thpool lf_thpool"}
+CONCURRENCY=${BENCH_CONCURRENCY:-"1 16 64 256"}
+REQUESTS=${BENCH_REQUESTS:-20000}
+THREADS=${BENCH_THREADS:-2}
+THRESHOLD=${BENCH_THRESHOLD:-10}
+TIMEOUT=${BENCH_TIMEOUT:-60}
+
+LOCAL_PORT="8081"
+BASELINE=benchmark/baseline.json
+RESULTS=benchmark/results/$(date +%Y%m%d-%H%M%S).json
+
+# size class, file size, number of files, share of BENCH_REQUESTS
+CLASSES=(
+    "1k 1024 1000 1"
+    "16k 16384 1000 1"
+    "256k 262144 100 10"
+    "4m 4194304 10 100"
+)
+
+declare -A MODE_FLAGS=(
+    [single]=""
+    [thpool]="ENABLE_THPOOL=1 THPOOLFLAG=THPOOL"
+    [lf_thpool]="ENABLE_THPOOL=1 THPOOLFLAG=LF_THPOOL"
+)
+
+WORK=$(mktemp -d)
+server_pid=
+cleanup() {
+    [ -n "$server_pid" ] && kill $server_pid 2>/dev/null
+    rm -rf $WORK
+}
+trap cleanup EXIT
+
+wait_server() {
+    for i in {1..50}; do
+        sleep 0.1
+        (exec 3<>/dev/tcp/127.0.0.1/$LOCAL_PORT) 2>/dev/null && return 0
+    done
+    echo "sehttpd did not start" >&2
+    return 1
+}
+
+gen_webroot() {
+    local cls size files
+    mkdir -p $WORK/www
+    for c in "${CLASSES[@]}"; do
+        read cls size files _ <<< "$c"
+        mkdir -p $WORK/www/$cls
+        head -c $size /dev/urandom > $WORK/www/$cls/0.txt
+        for ((i = 1; i < files; i++)); do
+            cp $WORK/www/$cls/0.txt $WORK/www/$cls/$i.txt
+        done
+    done
+}
+
+build_modes() {
+    for mode in $MODES; do
+        if [ -z "${MODE_FLAGS[$mode]+x}" ]; then
+            echo "unknown mode: $mode" >&2
+            exit 1
+        fi
+        make -s clean
+        make -s ${MODE_FLAGS[$mode]} sehttpd > /dev/null || exit 1
+        cp sehttpd $WORK/sehttpd-$mode
+    done
+    # leave the default build behind
+    make -s clean
+    make -s > /dev/null || exit 1
+}
+
+run_matrix() {
+    local cls size files share n keepalive first=1 total runs=0
+    total=$(($(wc -w <<< "$MODES") * ${#CLASSES[@]} * 2 *
+             $(wc -w <<< "$CONCURRENCY")))
+
+    echo "[" > $RESULTS
+    for mode in $MODES; do
+        (cd $WORK && exec ./sehttpd-$mode > $WORK/sehttpd-$mode.log 2>&1) &
+        server_pid=$!
+        wait_server || exit 1
+
+        for c in "${CLASSES[@]}"; do
+            read cls size files share <<< "$c"
+            n=$((REQUESTS / share))
+            for keepalive in false true; do
+                for conc in $CONCURRENCY; do
+                    opts="-n $n -c $conc -t $THREADS -o json -z $files"
+                    [ $keepalive = true ] && opts="$opts -k"
+                    runs=$((runs + 1))
+                    ProgressBar $runs $total
+                    if ! line=$(timeout $TIMEOUT ./htstress $opts \
+                                http://127.0.0.1:$LOCAL_PORT/$cls/%d.txt); then
+                        printf "\n[!] $mode $cls c=$conc keepalive=$keepalive" >&2
+                        printf " did not finish within ${TIMEOUT}s\n" >&2
+                        continue
+                    fi
+                    [ $first = 1 ] || echo "," >> $RESULTS
+                    first=0
+                    echo -n "  {\"mode\": \"$mode\", \"class\": \"$cls\"," \
+                            "${line#\{}" >> $RESULTS
+                done
+            done
+        done
+
+        kill $server_pid 2>/dev/null || echo "[!] sehttpd-$mode exited early" >&2
+        wait $server_pid 2>/dev/null || true
+        server_pid=
+    done
+    printf "\n]\n" >> $RESULTS
+    printf "\n"
+}
+
+mkdir -p benchmark/results
+gen_webroot
+build_modes
+run_matrix
+echo "results written to $RESULTS"
+
+if [ "$1" = "--update-baseline" ]; then
+    cp $RESULTS $BASELINE
+    echo "baseline updated"
+elif [ -f $BASELINE ]; then
+    python3 benchmark/compare.py --threshold $THRESHOLD $BASELINE $RESULTS ||
+        exit 1
+else
+    echo "no $BASELINE to compare with, run 'make bench-baseline' to store one"
+fi
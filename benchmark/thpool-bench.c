@@ -0,0 +1,181 @@
+/*
+ * thpool-bench - measure the task queues of src/thpool.c and src/lf_thpool.c
+ *
+ * The same source is built against either pool (BENCH_LF_THPOOL selects
+ * the lock-free one). For every thread count two workloads are run:
+ *   burst   the main thread enqueues tasks as fast as it can, which gives
+ *           the enqueue throughput and the latency including queueing
+ *   wakeup  one task at a time on an idle pool, which gives the latency of
+ *           handing a task to a sleeping worker
+ * Latency is measured from thpool_enq() to the start of the task.
+ */
+
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+#if (BENCH_LF_THPOOL)
+#include "lf_thpool.h"
+#define POOL_NAME "lf_thpool"
+#else
+#include "thpool.h"
+#define POOL_NAME "thpool"
+#endif
+
+#define DEFAULT_TASKS (1 << 18)
+#define WAKEUP_TASKS 5000
+#define WAKEUP_GAP_US 50
+#define MAX_THREADS 32
+
+/* large enough that neither pool ever sees a full queue, thpool_enq()
+ * would refuse the task
+ */
+#define QUEUE_SIZE (1 << 20)
+
+struct task {
+    uint64_t enqueued, latency;
+};
+
+static atomic_size_t done;
+
+static void run_task(void *arg)
+{
+    struct task *t = arg;
+    t->latency = now_ns() - t->enqueued;
+    atomic_fetch_add_explicit(&done, 1, memory_order_release);
+}
+
+static void wait_done(size_t n)
+{
+    while (atomic_load_explicit(&done, memory_order_acquire) < n)
+        sched_yield();
+}
+
+static bool json;
+
+static void report(const char *workload,
+                   int threads,
+                   size_t tasks,
+                   uint64_t ns,
+                   uint64_t enq_ns,
+                   struct task *t)
+{
+    struct samples lat;
+    double seconds = ns / 1e9;
+
+    samples_init(&lat, tasks);
+    for (size_t i = 0; i < tasks; i++)
+        samples_add(&lat, t[i].latency);
+
+    if (json) {
+        printf("{\"tool\": \"thpool-bench\", \"pool\": \"%s\", "
+               "\"workload\": \"%s\", \"threads\": %d, \"requests\": %zu, "
+               "\"seconds\": %.3f, \"rps\": %.3f, \"enqueue_ns\": %.1f, ",
+               POOL_NAME, workload, threads, tasks, seconds, tasks / seconds,
+               (double) enq_ns / tasks);
+        print_latency_json(stdout, &lat);
+        printf("}\n");
+    } else {
+        qsort(lat.v, lat.n, sizeof(uint64_t), cmp_u64);
+        printf("  %-10s %-7s %7d %12.0f %10.1f %9.3f %9.3f %9.3f\n",
+               POOL_NAME, workload, threads, tasks / seconds,
+               (double) enq_ns / tasks, samples_percentile(&lat, 50),
+               samples_percentile(&lat, 99), samples_percentile(&lat, 99.9));
+    }
+    free(lat.v);
+}
+
+static void run(int threads, size_t tasks)
+{
+    /* the pools have no way to stop their workers, so every pool created
+     * here stays around, idle, until the benchmark exits
+     */
+    thpool_t *pool = thpool_create(threads, QUEUE_SIZE);
+    struct task *t = calloc(tasks, sizeof(struct task));
+    uint64_t start, enq_ns = 0;
+
+    if (!t) {
+        fprintf(stderr, "cannot allocate %zu tasks\n", tasks);
+        exit(1);
+    }
+
+    atomic_store(&done, 0);
+    start = now_ns();
+    for (size_t i = 0; i < tasks; i++) {
+        t[i].enqueued = now_ns();
+        thpool_enq(pool, run_task, &t[i]);
+        enq_ns += now_ns() - t[i].enqueued;
+    }
+    wait_done(tasks);
+    report("burst", threads, tasks, now_ns() - start, enq_ns, t);
+
+    atomic_store(&done, 0);
+    enq_ns = 0;
+    start = now_ns();
+    for (size_t i = 0; i < WAKEUP_TASKS; i++) {
+        usleep(WAKEUP_GAP_US);
+        t[i].enqueued = now_ns();
+        thpool_enq(pool, run_task, &t[i]);
+        enq_ns += now_ns() - t[i].enqueued;
+        wait_done(i + 1);
+    }
+    report("wakeup", threads, WAKEUP_TASKS, now_ns() - start, enq_ns, t);
+
+    free(t);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-n tasks] [-t max_threads] [-j]\n"
+            "  -n tasks        tasks per burst run (%d)\n"
+            "  -t max_threads  sweep 1, 2, 4, ... up to this many workers (%d)\n"
+            "  -j              print JSON lines instead of a table\n",
+            prog, DEFAULT_TASKS, MAX_THREADS);
+}
+
+int main(int argc, char *argv[])
+{
+    long tasks = DEFAULT_TASKS;
+    int max_threads = MAX_THREADS;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:t:jh")) != -1) {
+        switch (c) {
+        case 'n':
+            tasks = atol(optarg);
+            break;
+        case 't':
+            max_threads = atoi(optarg);
+            break;
+        case 'j':
+            json = true;
+            break;
+        default:
+            usage(argv[0]);
+            return c == 'h' ? 0 : 1;
+        }
+    }
+    /* each lock-free worker owns QUEUE_SIZE / threads slots and gets
+     * tasks / threads of the burst, so stay well below QUEUE_SIZE
+     */
+    if (tasks < WAKEUP_TASKS || tasks > QUEUE_SIZE / 2 ||
+        max_threads < 1 || max_threads > MAX_THREADS) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (!json)
+        printf("  %-10s %-7s %7s %12s %10s %9s %9s %9s\n", "pool", "workload",
+               "threads", "tasks/sec", "enq ns", "p50 us", "p99 us",
+               "p99.9 us");
+    /* the lock-free pool needs a power of 2 number of threads */
+    for (int threads = 1; threads <= max_threads; threads <<= 1)
+        run(threads, tasks);
+
+    return 0;
+}
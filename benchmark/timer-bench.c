@@ -0,0 +1,181 @@
+/*
+ * timer-bench - measure the connection timers of src/timer.c
+ *
+ * For every number of live timers, the heap is first filled with one timer
+ * per connection. Then keep-alive churn is simulated: a random connection
+ * serves a request, which removes its timer and arms a new one, or just
+ * pushes its deadline back as do_request() does. Finally all timers
+ * expire at once and are reaped by handle_expired_timers().
+ */
+
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "http.h"
+#include "timer.h"
+
+#define DEFAULT_OPS 200000
+#define MAX_SIZES 16
+
+/* far enough in the future that nothing expires during the churn phase */
+#define CHURN_TIMEOUT (3600 * 1000)
+
+static bool json;
+static struct samples expire_lat;
+static uint64_t last_expired;
+
+static int on_expire(http_request_t *req UNUSED)
+{
+    uint64_t now = now_ns();
+    samples_add(&expire_lat, now - last_expired);
+    last_expired = now;
+    return 0;
+}
+
+static void report(const char *phase,
+                   size_t timers,
+                   size_t ops,
+                   uint64_t ns,
+                   struct samples *lat)
+{
+    double seconds = ns / 1e9;
+
+    if (json) {
+        printf("{\"tool\": \"timer-bench\", \"phase\": \"%s\", "
+               "\"timers\": %zu, \"requests\": %zu, \"seconds\": %.3f, "
+               "\"rps\": %.3f, ",
+               phase, timers, ops, seconds, ops / seconds);
+        print_latency_json(stdout, lat);
+        printf("}\n");
+        return;
+    }
+
+    qsort(lat->v, lat->n, sizeof(uint64_t), cmp_u64);
+    printf("  %-7s %8zu %10zu %12.0f %9.3f %9.3f %9.3f\n", phase, timers, ops,
+           ops / seconds, samples_percentile(lat, 50),
+           samples_percentile(lat, 99), samples_percentile(lat, 99.9));
+}
+
+static void run(size_t timers, size_t ops)
+{
+    http_request_t *reqs;
+    struct samples lat;
+    uint64_t start, t;
+    unsigned short xsubi[3] = {0x1234, 0xabcd, (unsigned short) timers};
+
+    if (posix_memalign((void **) &reqs, CACHE_LINE_SIZE,
+                       timers * sizeof(http_request_t))) {
+        fprintf(stderr, "cannot allocate %zu connections\n", timers);
+        exit(1);
+    }
+    memset(reqs, 0, timers * sizeof(http_request_t));
+
+    /* every connection arms its timer on accept, spread over the timeout
+     * as if the connections had arrived one after another
+     */
+    samples_init(&lat, timers);
+    start = now_ns();
+    for (size_t i = 0; i < timers; i++) {
+        t = now_ns();
+        add_timer(&reqs[i], CHURN_TIMEOUT + i % TIMEOUT_DEFAULT, NULL);
+        samples_add(&lat, now_ns() - t);
+    }
+    report("fill", timers, timers, now_ns() - start, &lat);
+    free(lat.v);
+
+    /* a request on a keep-alive connection re-arms its timer */
+    samples_init(&lat, ops);
+    start = now_ns();
+    for (size_t n = 0; n < ops; n++) {
+        http_request_t *r = &reqs[nrand48(xsubi) % timers];
+        t = now_ns();
+        del_timer(r);
+        add_timer(r, CHURN_TIMEOUT + TIMEOUT_DEFAULT, NULL);
+        samples_add(&lat, now_ns() - t);
+    }
+    report("churn", timers, ops, now_ns() - start, &lat);
+    free(lat.v);
+
+    /* the same, but leaving the timer in place as do_request() does */
+    samples_init(&lat, ops);
+    start = now_ns();
+    for (size_t n = 0; n < ops; n++) {
+        http_request_t *r = &reqs[nrand48(xsubi) % timers];
+        t = now_ns();
+        timer_set_deadline(r, time_msec() + CHURN_TIMEOUT + TIMEOUT_DEFAULT);
+        samples_add(&lat, now_ns() - t);
+    }
+    report("refresh", timers, ops, now_ns() - start, &lat);
+    free(lat.v);
+
+    /* all connections time out together */
+    for (size_t i = 0; i < timers; i++) {
+        del_timer(&reqs[i]);
+        add_timer(&reqs[i], 0, on_expire);
+        reqs[i].deadline = 0;
+    }
+    time_update();
+    samples_init(&expire_lat, timers);
+    start = last_expired = now_ns();
+    handle_expired_timers();
+    report("expire", timers, expire_lat.n, now_ns() - start, &expire_lat);
+    free(expire_lat.v);
+
+    if (expire_lat.n != timers || find_timer() != -1) {
+        fprintf(stderr, "%zu of %zu timers expired\n", expire_lat.n, timers);
+        exit(1);
+    }
+    free(reqs);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-n ops] [-j] [timers...]\n"
+            "  -n ops  keep-alive requests per run (%d)\n"
+            "  -j      print JSON lines instead of a table\n"
+            "  timers  numbers of live timers (1000 10000 100000 1000000)\n",
+            prog, DEFAULT_OPS);
+}
+
+int main(int argc, char *argv[])
+{
+    size_t sizes[MAX_SIZES] = {1000, 10000, 100000, 1000000};
+    int nsizes = 4;
+    long ops = DEFAULT_OPS;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:jh")) != -1) {
+        switch (c) {
+        case 'n':
+            ops = atol(optarg);
+            break;
+        case 'j':
+            json = true;
+            break;
+        default:
+            usage(argv[0]);
+            return c == 'h' ? 0 : 1;
+        }
+    }
+    if (optind < argc) {
+        nsizes = 0;
+        for (int i = optind; i < argc && nsizes < MAX_SIZES; i++)
+            if ((sizes[nsizes++] = atol(argv[i])) == 0)
+                ops = 0;
+    }
+    if (ops <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    timer_init();
+    if (!json)
+        printf("  %-7s %8s %10s %12s %9s %9s %9s\n", "phase", "timers", "ops",
+               "ops/sec", "p50 us", "p99 us", "p99.9 us");
+    for (int i = 0; i < nsizes; i++)
+        run(sizes[i], ops);
+
+    return 0;
+}
@@ -28,7 +28,7 @@ import random
 
 # args
 def usage():
-    print("USAGE: %s [-i <if_name>]" % argv[0])
+    print("USAGE: %s [-i <if_name>] [-w <trace_file>]" % argv[0])
     print("")
     print("Try '%s -h' for more options." % argv[0])
     exit()
@@ -36,35 +36,68 @@ def usage():
 
 # help
 def help():
-    print("USAGE: %s [-i <if_name>]" % argv[0])
+    print("USAGE: %s [-i <if_name>] [-w <trace_file>]" % argv[0])
     print("")
     print("optional arguments:")
     print("   -h                       print this help")
     print("   -i if_name               select interface if_name. Default is eth0")
+    print("   -w trace_file            record request URLs and inter-arrival")
+    print("                            times to trace_file for htstress --replay")
     print("")
     print("examples:")
     print("    http-parse              # bind socket to eth0")
     print("    http-parse -i wlan0     # bind socket to wlan0")
+    print("    http-parse -w today.trace  # also record a replayable trace")
     exit()
 
 
 # arguments
 interface = "eth0"
+trace_file = None
 
-if len(argv) == 2:
-    if str(argv[1]) == "-h":
+args = argv[1:]
+while args:
+    if args[0] == "-h":
         help()
+    elif args[0] == "-i" and len(args) > 1:
+        interface = args[1]
+    elif args[0] == "-w" and len(args) > 1:
+        trace_file = args[1]
     else:
         usage()
+    args = args[2:]
 
-if len(argv) == 3:
-    if str(argv[1]) == "-i":
-        interface = argv[2]
-    else:
-        usage()
 
-if len(argv) > 3:
-    usage()
+# Trace file format (little endian), read by htstress --replay:
+#   header: magic "HTTR", u32 version (1)
+#   record: u32 microseconds since the previous request, u16 URL length,
+#           followed by the URL bytes
+TRACE_MAGIC = b"HTTR"
+TRACE_VERSION = 1
+TRACE_METHODS = (b"GET ", b"HEAD ")
+
+trace = None
+trace_last = None
+if trace_file:
+    trace = open(trace_file, "wb")
+    trace.write(TRACE_MAGIC + struct.pack("<I", TRACE_VERSION))
+
+
+def record_request(line):
+    global trace_last
+    if not line.startswith(TRACE_METHODS):
+        return
+    fields = line.split(b" ")
+    if len(fields) < 2:
+        return
+    url = fields[1][:0xFFFF]
+
+    now = time.time()
+    delta = 0 if trace_last is None else int((now - trace_last) * 1e6)
+    trace_last = now
+    trace.write(struct.pack("<IH", min(delta, 0xFFFFFFFF), len(url)) + url)
+    trace.flush()
+
 
 print("binding socket to '%s'" % interface)
 
@@ -171,3 +204,9 @@ while 1:
                 break
         print("%c" % chr(packet_bytearray[i]), end="")
     print("")
+
+    if trace:
+        line_end = packet_bytearray.find(b"\r\n", payload_offset)
+        if line_end < 0:
+            line_end = len(packet_bytearray)
+        record_request(bytes(packet_bytearray[payload_offset:line_end]))
@@ -29,24 +29,32 @@
  * htstress - Fast HTTP Benchmarking tool
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* for the sake of strcasestr(3) */
+#endif
+
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <inttypes.h>
 #include <malloc.h>
+#include <math.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
 #include <netinet/tcp.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
 #include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
 typedef void (*sighandler_t)(int);
@@ -54,6 +62,8 @@ typedef void (*sighandler_t)(int);
 #define HTTP_REQUEST_PREFIX "http://"
 
 #define HTTP_REQUEST_FMT "GET %s HTTP/1.0\r\nHost: %s\r\n\r\n"
+#define HTTP_KEEPALIVE_FMT \
+    "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: keep-alive\r\n\r\n"
 
 #define HTTP_REQUEST_DEBUG 0x01
 #define HTTP_RESPONSE_DEBUG 0x02
@@ -61,17 +71,88 @@ typedef void (*sighandler_t)(int);
 #define INBUFSIZE 1024
 
 #define BAD_REQUEST 0x1
+#define CLOSE_AFTER 0x2 /* the server announced Connection: close */
 
 #define MAX_EVENTS 256
 
+/* how often an idle worker re-checks whether the run is over */
+#define WAIT_TIMEOUT_MS 100
+
+/* HDR-style log-linear histogram: each power-of-two range of latencies is
+ * split into HIST_SUB_HALF linear sub-buckets, which keeps three significant
+ * digits for every value from 1 us up to HIST_MAX us (about 35 minutes).
+ */
+#define HIST_SUB_BITS 10
+#define HIST_SUB_HALF (1 << HIST_SUB_BITS)
+#define HIST_SUB_MASK ((HIST_SUB_HALF << 1) - 1)
+#define HIST_MAX ((UINT64_C(1) << 31) - 1)
+#define HIST_COUNTS (22 << HIST_SUB_BITS)
+
+struct hist {
+    uint64_t counts[HIST_COUNTS];
+    uint64_t total;
+    uint64_t sum;
+    uint64_t min, max;
+};
+
+struct econn;
+
+/* per-thread statistics, merged by the main thread once all workers exit */
+struct wstat {
+    pthread_t tid;
+    struct hist lat;
+    uint64_t *timeline; /* completed requests per second of the run */
+    size_t ntimeline;
+
+    /* open-loop schedule */
+    int id;
+    size_t cursor;        /* next trace record replayed by this thread */
+    int tfd;              /* timerfd firing when the next request is due */
+    double next_send;     /* us, intended start of the next request */
+    struct econn **idle;  /* connections free to carry a request */
+    int nidle;
+    unsigned short xsubi[3];
+};
+
+enum output_format { OUTPUT_TEXT = 0, OUTPUT_JSON, OUTPUT_CSV };
+
+/* keep-alive response framing */
+enum { RS_STATUS = 0, RS_HEADER, RS_BODY };
+
 struct econn {
     int fd;
     size_t offs;
     int flags;
+    uint64_t start; /* us, when the request was started */
+
+    const char *out; /* the request(s) being sent */
+    size_t outlen;
+    char *batch;  /* buffer for a pipelined batch of requests */
+    int pending;  /* responses still expected on this connection */
+
+    int rstate;
+    uint64_t body_left;
+    char line[64]; /* start of the current response line */
+    size_t linelen;
 };
 
-static char *outbuf;
-static size_t outbufsize;
+/* the workload: one prepared request per URL, picked by weight */
+struct request {
+    char *buf;
+    size_t len;
+};
+
+static struct request *requests;
+static double *request_cdf; /* cumulative weights */
+static int num_urls;
+static size_t max_request_len;
+
+static bool keep_alive = false;
+static int pipeline = 1;
+
+static char *urls = "";
+static int zipf_n = 0;
+static double zipf_s = 1.0;
 
 static struct sockaddr_storage sss;
 static socklen_t sssln = 0;
@@ -83,6 +164,7 @@ static char *udaddr = "";
 static char *filename = "";
 
 static volatile uint64_t num_requests = 0;
+static volatile uint64_t issued_requests = 0;
 static volatile uint64_t max_requests = 0;
 static volatile uint64_t good_requests = 0;
 static volatile uint64_t bad_requests = 0;
@@ -94,17 +176,36 @@ static uint64_t ticks;
 
 static int debug = 0;
 static int exit_i = 0;
+static int output_format = OUTPUT_TEXT;
+
+/* open-loop mode: requests per second over all threads, 0 for closed-loop */
+static double rate = 0;
+static bool poisson = false;
+
+/* replay mode: the requests of a recorded trace, at their recorded times */
+static char *replay = "";
+static double speed = 1.0;
+static uint64_t *trace_at; /* us since the first request of the trace */
+static int *trace_req;     /* index into requests[] */
+static size_t trace_len;
+
+static bool open_loop = false;
 
 static struct timeval tv, tve;
+static uint64_t start_us;
 
-static const char short_options[] = "n:c:t:f:u:h:d46";
+static const char short_options[] = "n:c:t:f:o:r:PR:S:kp:l:z:u:h:d46";
 
 static const struct option long_options[] = {
     {"number", 1, NULL, 'n'},  {"concurrency", 1, NULL, 'c'},
-    {"threads", 0, NULL, 't'}, {"udaddr", 1, NULL, 'u'},
+    {"threads", 1, NULL, 't'}, {"udaddr", 1, NULL, 'u'},
     {"host", 1, NULL, 'h'},    {"debug", 0, NULL, 'd'},
     {"help", 0, NULL, '%'},    {"filename", 1, NULL, 'f'},
-    {NULL, 0, NULL, 0}};
+    {"output", 1, NULL, 'o'},  {"rate", 1, NULL, 'r'},
+    {"poisson", 0, NULL, 'P'}, {"keepalive", 0, NULL, 'k'},
+    {"pipeline", 1, NULL, 'p'}, {"urls", 1, NULL, 'l'},
+    {"zipf", 1, NULL, 'z'},    {"replay", 1, NULL, 'R'},
+    {"speed", 1, NULL, 'S'},   {NULL, 0, NULL, 0}};
 
 static void sigint_handler(int arg)
 {
@@ -112,12 +213,23 @@ static void sigint_handler(int arg)
     max_requests = num_requests;
 }
 
+static uint64_t now_us()
+{
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts)) {
+        perror("clock_gettime");
+        exit(1);
+    }
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 static void start_time()
 {
     if (gettimeofday(&tv, NULL)) {
         perror("gettimeofday");
         exit(1);
     }
+    start_us = now_us();
 }
 
 static void end_time()
@@ -128,13 +240,346 @@ static void end_time()
     }
 }
 
-static void init_conn(int efd, struct econn *ec)
+static inline int hist_index(uint64_t v)
+{
+    if (v > HIST_MAX)
+        v = HIST_MAX;
+    int bucket = 63 - __builtin_clzll(v | HIST_SUB_MASK) - HIST_SUB_BITS;
+    int sub = (int) (v >> bucket);
+    return ((bucket + 1) << HIST_SUB_BITS) + sub - HIST_SUB_HALF;
+}
+
+/* highest value that is recorded into counts[idx] */
+static uint64_t hist_value(int idx)
+{
+    int bucket = (idx >> HIST_SUB_BITS) - 1;
+    int sub = (idx & (HIST_SUB_HALF - 1)) + HIST_SUB_HALF;
+    if (bucket < 0) {
+        sub -= HIST_SUB_HALF;
+        bucket = 0;
+    }
+    return ((uint64_t) sub << bucket) + (UINT64_C(1) << bucket) - 1;
+}
+
+static void hist_record(struct hist *h, uint64_t v)
+{
+    h->counts[hist_index(v)]++;
+    if (!h->total || v < h->min)
+        h->min = v;
+    if (v > h->max)
+        h->max = v;
+    h->total++;
+    h->sum += v;
+}
+
+static void hist_merge(struct hist *dst, const struct hist *src)
+{
+    if (!src->total)
+        return;
+    for (int i = 0; i < HIST_COUNTS; i++)
+        dst->counts[i] += src->counts[i];
+    if (!dst->total || src->min < dst->min)
+        dst->min = src->min;
+    if (src->max > dst->max)
+        dst->max = src->max;
+    dst->total += src->total;
+    dst->sum += src->sum;
+}
+
+static uint64_t hist_percentile(const struct hist *h, double p)
+{
+    if (!h->total)
+        return 0;
+
+    uint64_t want = (uint64_t) (p / 100.0 * h->total + 0.5), seen = 0;
+    if (want < 1)
+        want = 1;
+    for (int i = 0; i < HIST_COUNTS; i++) {
+        seen += h->counts[i];
+        if (seen >= want) {
+            uint64_t v = hist_value(i);
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+static void record_request(struct wstat *ws, uint64_t start)
+{
+    uint64_t now = now_us();
+    hist_record(&ws->lat, now - start);
+
+    size_t sec = (now - start_us) / 1000000;
+    if (sec >= ws->ntimeline) {
+        size_t n = ws->ntimeline ? ws->ntimeline : 16;
+        while (n <= sec)
+            n *= 2;
+        uint64_t *tl = realloc(ws->timeline, n * sizeof(uint64_t));
+        if (!tl) {
+            perror("realloc");
+            exit(1);
+        }
+        memset(tl + ws->ntimeline, 0, (n - ws->ntimeline) * sizeof(uint64_t));
+        ws->timeline = tl;
+        ws->ntimeline = n;
+    }
+    ws->timeline[sec]++;
+}
+
+static void add_request(const char *path, const char *host, double weight)
+{
+    static int nalloc;
+
+    if (num_urls == nalloc) {
+        nalloc = nalloc ? nalloc * 2 : 16;
+        requests = realloc(requests, nalloc * sizeof(struct request));
+        request_cdf = realloc(request_cdf, nalloc * sizeof(double));
+        if (!requests || !request_cdf) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+
+    const char *fmt = keep_alive ? HTTP_KEEPALIVE_FMT : HTTP_REQUEST_FMT;
+    struct request *r = requests + num_urls;
+    size_t size = strlen(fmt) + strlen(path) + strlen(host);
+    r->buf = malloc(size);
+    if (!r->buf) {
+        perror("malloc");
+        exit(1);
+    }
+    r->len = snprintf(r->buf, size, fmt, path, host);
+    if (r->len > max_request_len)
+        max_request_len = r->len;
+
+    request_cdf[num_urls] = (num_urls ? request_cdf[num_urls - 1] : 0) + weight;
+    num_urls++;
+}
+
+/* read "path [weight]" lines, '#' starts a comment */
+static void load_urls(const char *file, const char *host)
+{
+    FILE *fp = fopen(file, "r");
+    if (!fp) {
+        perror(file);
+        exit(1);
+    }
+
+    char line[4096];
+    while (fgets(line, sizeof(line), fp)) {
+        char *hash = strchr(line, '#');
+        if (hash)
+            *hash = '\0';
+
+        char *path = strtok(line, " \t\r\n");
+        if (!path)
+            continue;
+        if (!strncmp(path, HTTP_REQUEST_PREFIX,
+                     sizeof(HTTP_REQUEST_PREFIX) - 1)) {
+            path = strchr(path + sizeof(HTTP_REQUEST_PREFIX) - 1, '/');
+            if (!path)
+                path = "/";
+        }
+
+        char *w = strtok(NULL, " \t\r\n");
+        double weight = w ? strtod(w, NULL) : 1.0;
+        if (weight <= 0) {
+            fprintf(stderr, "%s: invalid weight for %s\n", file, path);
+            exit(1);
+        }
+        add_request(path, host, weight);
+    }
+    fclose(fp);
+
+    if (!num_urls) {
+        fprintf(stderr, "%s: no URLs\n", file);
+        exit(1);
+    }
+}
+
+/* Zipf popularity over n generated paths: path_fmt contains one "%d", which
+ * is replaced by the rank (0 is the most popular), weighted 1 / (rank+1)^s.
+ */
+static void zipf_urls(const char *path_fmt, int n, double s, const char *host)
+{
+    const char *d = strstr(path_fmt, "%d");
+    if (!d || strchr(d + 2, '%') || strchr(path_fmt, '%') != d) {
+        fprintf(stderr, "--zipf needs exactly one %%d in the URL path\n");
+        exit(1);
+    }
+
+    char path[4096];
+    for (int k = 0; k < n; k++) {
+        snprintf(path, sizeof(path), path_fmt, k);
+        add_request(path, host, 1.0 / pow(k + 1, s));
+    }
+}
+
+#define TRACE_MAGIC "HTTR"
+#define TRACE_VERSION 1
+
+static inline uint32_t le32(const uint8_t *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+/* open addressing table from URL to request index */
+struct url_slot {
+    char *url;
+    int idx;
+};
+
+static struct url_slot *url_slot(struct url_slot *slots,
+                                 size_t nslots,
+                                 const char *url)
+{
+    uint32_t h = 2166136261u; /* FNV-1a */
+    for (const char *c = url; *c; c++)
+        h = (h ^ (uint8_t) *c) * 16777619u;
+
+    size_t i = h & (nslots - 1);
+    while (slots[i].url && strcmp(slots[i].url, url))
+        i = (i + 1) & (nslots - 1);
+    return slots + i;
+}
+
+/* Load a trace recorded by ebpf/http-parse-sample.py -w: a header ("HTTR",
+ * u32 version) and records of u32 us since the previous request, u16 URL
+ * length and the URL, all little endian. Repeated URLs share one request.
+ */
+static void load_trace(const char *file, const char *host)
+{
+    FILE *fp = fopen(file, "rb");
+    if (!fp) {
+        perror(file);
+        exit(1);
+    }
+
+    uint8_t hdr[8];
+    if (fread(hdr, 1, sizeof(hdr), fp) != sizeof(hdr) ||
+        memcmp(hdr, TRACE_MAGIC, 4) || le32(hdr + 4) != TRACE_VERSION) {
+        fprintf(stderr, "%s: not a version %d trace\n", file, TRACE_VERSION);
+        exit(1);
+    }
+
+    size_t nslots = 1024, nalloc = 0;
+    struct url_slot *slots = calloc(nslots, sizeof(struct url_slot));
+    uint64_t at = 0;
+    uint8_t rec[6];
+    char url[0x10000];
+
+    while (fread(rec, 1, sizeof(rec), fp) == sizeof(rec)) {
+        uint16_t len = rec[4] | rec[5] << 8;
+        if (fread(url, 1, len, fp) != len) {
+            fprintf(stderr, "%s: truncated record\n", file);
+            break;
+        }
+        url[len] = '\0';
+
+        if (trace_len == nalloc) {
+            nalloc = nalloc ? nalloc * 2 : 1024;
+            trace_at = realloc(trace_at, nalloc * sizeof(uint64_t));
+            trace_req = realloc(trace_req, nalloc * sizeof(int));
+            if (!trace_at || !trace_req) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+
+        /* keep the URL table at most half full */
+        if ((size_t) num_urls * 2 >= nslots) {
+            struct url_slot *grown = calloc(nslots * 2, sizeof(*grown));
+            if (!grown) {
+                perror("calloc");
+                exit(1);
+            }
+            for (size_t i = 0; i < nslots; i++) {
+                if (slots[i].url)
+                    *url_slot(grown, nslots * 2, slots[i].url) = slots[i];
+            }
+            free(slots);
+            slots = grown;
+            nslots *= 2;
+        }
+
+        struct url_slot *slot = url_slot(slots, nslots, url);
+        if (!slot->url) {
+            slot->url = strdup(url);
+            slot->idx = num_urls;
+            add_request(url, host, 1.0);
+        }
+
+        at += trace_len ? le32(rec) : 0;
+        trace_at[trace_len] = at;
+        trace_req[trace_len] = slot->idx;
+        trace_len++;
+    }
+    fclose(fp);
+
+    for (size_t i = 0; i < nslots; i++)
+        free(slots[i].url);
+    free(slots);
+
+    if (!trace_len) {
+        fprintf(stderr, "%s: empty trace\n", file);
+        exit(1);
+    }
+}
+
+static const struct request *pick_request(struct wstat *ws)
+{
+    if (trace_len)
+        return requests + trace_req[ws->cursor];
+
+    if (num_urls == 1)
+        return requests;
+
+    double u = erand48(ws->xsubi) * request_cdf[num_urls - 1];
+    int lo = 0, hi = num_urls - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (request_cdf[mid] > u)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return requests + lo;
+}
+
+/* pick the next request, or the next batch of pipelined requests */
+static void prepare_batch(struct econn *ec, struct wstat *ws)
+{
+    ec->offs = 0;
+    ec->flags &= ~BAD_REQUEST;
+    ec->pending = pipeline;
+    ec->rstate = RS_STATUS;
+    ec->linelen = 0;
+    ec->start = now_us();
+
+    if (pipeline == 1) {
+        const struct request *r = pick_request(ws);
+        ec->out = r->buf;
+        ec->outlen = r->len;
+        return;
+    }
+
+    size_t len = 0;
+    for (int i = 0; i < pipeline; i++) {
+        const struct request *r = pick_request(ws);
+        memcpy(ec->batch + len, r->buf, r->len);
+        len += r->len;
+    }
+    ec->out = ec->batch;
+    ec->outlen = len;
+}
+
+static void init_conn(int efd, struct econn *ec, struct wstat *ws)
 {
     int ret;
 
     ec->fd = socket(sss.ss_family, SOCK_STREAM, 0);
-    ec->offs = 0;
     ec->flags = 0;
+    prepare_batch(ec, ws);
 
     if (ec->fd == -1) {
         perror("socket() failed");
@@ -163,14 +608,207 @@ static void init_conn(int efd, struct econn *ec)
     }
 }
 
+/* send the next batch on an established keep-alive connection */
+static void reuse_conn(int efd, struct econn *ec, struct wstat *ws)
+{
+    prepare_batch(ec, ws);
+
+    struct epoll_event evt = {
+        .events = EPOLLOUT,
+        .data.ptr = ec,
+    };
+
+    if (epoll_ctl(efd, EPOLL_CTL_MOD, ec->fd, &evt)) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+}
+
+static void start_conn(int efd, struct econn *ec, struct wstat *ws)
+{
+    if (ec->fd >= 0)
+        reuse_conn(efd, ec, ws);
+    else
+        init_conn(efd, ec, ws);
+}
+
+static void close_conn(struct econn *ec)
+{
+    close(ec->fd);
+    ec->fd = -1;
+}
+
+/* advance the open-loop schedule by one inter-arrival gap */
+static void schedule_next(struct wstat *ws)
+{
+    if (trace_len) {
+        /* threads take turns on the records of the trace */
+        ws->cursor += num_threads;
+        ws->next_send = ws->cursor < trace_len
+                            ? start_us + trace_at[ws->cursor] / speed
+                            : HUGE_VAL;
+        return;
+    }
+
+    double mean = 1e6 * num_threads * pipeline / rate;
+    if (poisson)
+        ws->next_send += -log(1.0 - erand48(ws->xsubi)) * mean;
+    else
+        ws->next_send += mean;
+}
+
+/* Open-loop mode: start every request that is due by now on an idle
+ * connection. The latency clock of a request starts at its intended send
+ * time, so time spent waiting for a free connection is counted as well.
+ * The timerfd is armed for the next due request, since the millisecond
+ * resolution of the epoll_wait timeout would skew the schedule.
+ */
+static void issue_due(int efd, struct wstat *ws)
+{
+    uint64_t now = now_us();
+
+    while (ws->nidle && ws->next_send <= now) {
+        if (max_requests && __sync_fetch_and_add(&issued_requests, pipeline) >=
+                                max_requests)
+            return;
+
+        struct econn *ec = ws->idle[--ws->nidle];
+        start_conn(efd, ec, ws);
+        ec->start = (uint64_t) ws->next_send;
+        schedule_next(ws);
+    }
+
+    /* with no idle connection, the next completion triggers issuing */
+    if (!ws->nidle || isinf(ws->next_send))
+        return;
+
+    uint64_t due = (uint64_t) ws->next_send;
+    struct itimerspec its = {
+        .it_value.tv_sec = due / 1000000,
+        .it_value.tv_nsec = (due % 1000000) * 1000,
+    };
+    if (timerfd_settime(ws->tfd, TFD_TIMER_ABSTIME, &its, NULL)) {
+        perror("timerfd_settime");
+        exit(1);
+    }
+}
+
+/* the connection finished its requests: start over, or park it until the
+ * schedule has the next request due
+ */
+static void next_conn(int efd, struct econn *ec, struct wstat *ws)
+{
+    if (open_loop)
+        ws->idle[ws->nidle++] = ec;
+    else
+        start_conn(efd, ec, ws);
+}
+
+/* requests that will never be answered, e.g. the connection broke */
+static void lost_requests(struct econn *ec)
+{
+    if (!ec->pending)
+        return;
+    __sync_fetch_and_add(&socket_errors, 1);
+    /* a trace is replayed once, so its lost requests shorten the run */
+    if (trace_len)
+        __sync_fetch_and_sub(&max_requests, ec->pending);
+    else if (open_loop)
+        __sync_fetch_and_sub(&issued_requests, ec->pending);
+    ec->pending = 0;
+}
+
+/* account for one finished request, returns true once the run is over */
+static bool count_request(struct econn *ec, struct wstat *ws)
+{
+    uint64_t m = __sync_fetch_and_add(&num_requests, 1);
+
+    if (max_requests && (m + 1 > max_requests))
+        __sync_fetch_and_sub(&num_requests, 1);
+    else {
+        if (ec->flags & BAD_REQUEST)
+            __sync_fetch_and_add(&bad_requests, 1);
+        else
+            __sync_fetch_and_add(&good_requests, 1);
+        record_request(ws, ec->start);
+    }
+
+    if (max_requests && (m + 1 >= max_requests)) {
+        end_time();
+        return true;
+    }
+
+    if (ticks && m % ticks == 0)
+        printf("%" PRIu64 " requests\n", m);
+
+    return false;
+}
+
+/* Split the keep-alive byte stream into responses, which are framed by
+ * Content-Length. Returns -1 once the run is over.
+ */
+static int parse_responses(struct econn *ec,
+                           struct wstat *ws,
+                           const char *p,
+                           size_t n)
+{
+    while (n) {
+        if (ec->rstate == RS_BODY) {
+            size_t k = n < ec->body_left ? n : ec->body_left;
+            ec->body_left -= k;
+            p += k;
+            n -= k;
+            if (!ec->body_left) {
+                ec->rstate = RS_STATUS;
+                ec->pending--;
+                if (count_request(ec, ws))
+                    return -1;
+            }
+            continue;
+        }
+
+        char c = *p++;
+        n--;
+        if (c != '\n') {
+            if (c != '\r' && ec->linelen < sizeof(ec->line) - 1)
+                ec->line[ec->linelen++] = c;
+            continue;
+        }
+
+        ec->line[ec->linelen] = '\0';
+        if (ec->rstate == RS_STATUS) {
+            ec->flags &= ~BAD_REQUEST;
+            if (ec->linelen > 9 && (ec->line[9] == '4' || ec->line[9] == '5'))
+                ec->flags |= BAD_REQUEST;
+            ec->body_left = 0;
+            ec->rstate = RS_HEADER;
+        } else if (ec->linelen == 0) { /* end of header */
+            if (ec->body_left)
+                ec->rstate = RS_BODY;
+            else {
+                ec->rstate = RS_STATUS;
+                ec->pending--;
+                if (count_request(ec, ws))
+                    return -1;
+            }
+        } else if (!strncasecmp(ec->line, "Content-Length:", 15)) {
+            ec->body_left = strtoull(ec->line + 15, NULL, 10);
+        } else if (!strncasecmp(ec->line, "Connection:", 11) &&
+                   strcasestr(ec->line + 11, "close")) {
+            ec->flags |= CLOSE_AFTER;
+        }
+        ec->linelen = 0;
+    }
+    return 0;
+}
+
 static void *worker(void *arg)
 {
     int ret, nevts;
     struct epoll_event evts[MAX_EVENTS];
     char inbuf[INBUFSIZE];
     struct econn ecs[concurrency], *ec;
-
-    (void) arg;
+    struct wstat *ws = arg;
 
     int efd = epoll_create(concurrency);
     if (efd == -1) {
@@ -178,12 +816,64 @@ static void *worker(void *arg)
         exit(1);
     }
 
-    for (int n = 0; n < concurrency; ++n)
-        init_conn(efd, ecs + n);
+    ws->xsubi[0] = (unsigned short) (uintptr_t) ws;
+    ws->xsubi[1] = (unsigned short) start_us;
+    ws->xsubi[2] = (unsigned short) (start_us >> 16);
+
+    for (int n = 0; n < concurrency; ++n) {
+        ecs[n].fd = -1;
+        ecs[n].batch = NULL;
+        if (pipeline > 1 &&
+            !(ecs[n].batch = malloc(pipeline * max_request_len))) {
+            perror("malloc");
+            exit(1);
+        }
+    }
+
+    if (open_loop) {
+        ws->idle = malloc(concurrency * sizeof(struct econn *));
+        if (!ws->idle) {
+            perror("malloc");
+            exit(1);
+        }
+        for (int n = 0; n < concurrency; ++n)
+            ws->idle[ws->nidle++] = ecs + n;
+        ws->next_send = start_us;
+        if (trace_len) {
+            ws->cursor = ws->id;
+            ws->next_send = ws->cursor < trace_len
+                                ? start_us + trace_at[ws->cursor] / speed
+                                : HUGE_VAL;
+        }
+
+        ws->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+        if (ws->tfd == -1) {
+            perror("timerfd_create");
+            exit(1);
+        }
+        struct epoll_event evt = {
+            .events = EPOLLIN,
+            .data.ptr = ws,
+        };
+        if (epoll_ctl(efd, EPOLL_CTL_ADD, ws->tfd, &evt)) {
+            perror("epoll_ctl");
+            exit(1);
+        }
+    } else {
+        for (int n = 0; n < concurrency; ++n)
+            init_conn(efd, ecs + n, ws);
+    }
 
     for (;;) {
+        if (max_requests && num_requests >= max_requests)
+            return NULL;
+
+        if (open_loop)
+            issue_due(efd, ws);
+
         do {
-            nevts = epoll_wait(efd, evts, sizeof(evts) / sizeof(evts[0]), -1);
+            nevts = epoll_wait(efd, evts, sizeof(evts) / sizeof(evts[0]),
+                               WAIT_TIMEOUT_MS);
         } while (!exit_i && nevts < 0 && errno == EINTR);
 
         if (exit_i != 0) {
@@ -196,6 +886,16 @@ static void *worker(void *arg)
         }
 
         for (int n = 0; n < nevts; ++n) {
+            if (evts[n].data.ptr == ws) {
+                uint64_t expirations;
+                if (read(ws->tfd, &expirations, sizeof(expirations)) < 0 &&
+                    errno != EAGAIN) {
+                    perror("read timerfd");
+                    exit(1);
+                }
+                continue;
+            }
+
             ec = (struct econn *) evts[n].data.ptr;
 
             if (!ec) {
@@ -216,11 +916,14 @@ static void *worker(void *arg)
                 if (number_of_errors_logged % 100 == 0) {
                     fprintf(stderr, "EPOLLERR caused by unknown error\n");
                 }
-                __sync_fetch_and_add(&socket_errors, 1);
-                close(ec->fd);
-                if (num_requests > max_requests)
+                close_conn(ec);
+                /* a parked keep-alive connection is already idle */
+                if (!ec->pending)
+                    continue;
+                lost_requests(ec);
+                if (max_requests && num_requests >= max_requests)
                     continue;
-                init_conn(efd, ec);
+                next_conn(efd, ec, ws);
                 continue;
             }
 
@@ -231,7 +934,8 @@ static void *worker(void *arg)
             }
 
             if (evts[n].events & EPOLLOUT) {
-                ret = send(ec->fd, outbuf + ec->offs, outbufsize - ec->offs, 0);
+                ret = send(ec->fd, ec->out + ec->offs, ec->outlen - ec->offs,
+                           0);
 
                 if (ret == -1 && errno != EAGAIN) {
                     /* TODO: something better than this */
@@ -241,12 +945,12 @@ static void *worker(void *arg)
 
                 if (ret > 0) {
                     if (debug & HTTP_REQUEST_DEBUG)
-                        write(2, outbuf + ec->offs, outbufsize - ec->offs);
+                        write(2, ec->out + ec->offs, ec->outlen - ec->offs);
 
                     ec->offs += ret;
 
                     /* write done? schedule read */
-                    if (ec->offs == outbufsize) {
+                    if (ec->offs == ec->outlen) {
                         evts[n].events = EPOLLIN;
                         evts[n].data.ptr = ec;
 
@@ -260,6 +964,7 @@ static void *worker(void *arg)
                 }
 
             } else if (evts[n].events & EPOLLIN) {
+                int parked = !ec->pending;
                 for (;;) {
                     ret = recv(ec->fd, inbuf, sizeof(inbuf), 0);
 
@@ -271,43 +976,171 @@ static void *worker(void *arg)
                     if (ret <= 0)
                         break;
 
+                    if (debug & HTTP_RESPONSE_DEBUG)
+                        write(2, inbuf, ret);
+
+                    if (keep_alive) {
+                        if (parse_responses(ec, ws, inbuf, ret) < 0)
+                            return NULL;
+                        continue;
+                    }
+
                     if (ec->offs <= 9 && ec->offs + ret > 10) {
                         char c = inbuf[9 - ec->offs];
                         if (c == '4' || c == '5')
                             ec->flags |= BAD_REQUEST;
                     }
 
-                    if (debug & HTTP_RESPONSE_DEBUG)
-                        write(2, inbuf, ret);
-
                     ec->offs += ret;
                 }
 
+                if (keep_alive) {
+                    if (!ret || (!ec->pending && (ec->flags & CLOSE_AFTER)))
+                        close_conn(ec);
+                    if (parked) /* closed while idle, stays idle */
+                        continue;
+                    if (ec->fd < 0 || !ec->pending) {
+                        lost_requests(ec);
+                        next_conn(efd, ec, ws);
+                    }
+                    continue;
+                }
+
                 if (!ret) {
-                    close(ec->fd);
+                    close_conn(ec);
+                    ec->pending = 0;
+                    if (count_request(ec, ws))
+                        return NULL;
+                    next_conn(efd, ec, ws);
+                }
+            }
+        }
+    }
+}
 
-                    int m = __sync_fetch_and_add(&num_requests, 1);
+struct result {
+    const char *rq, *host;
+    double seconds;
+    struct hist lat;
+    uint64_t *timeline;
+    size_t ntimeline;
+};
 
-                    if (max_requests && (m + 1 > (int) max_requests))
-                        __sync_fetch_and_sub(&num_requests, 1);
-                    else if (ec->flags & BAD_REQUEST)
-                        __sync_fetch_and_add(&bad_requests, 1);
-                    else
-                        __sync_fetch_and_add(&good_requests, 1);
+static const struct {
+    const char *name;
+    double p;
+} percentiles[] = {
+    {"p50", 50.0}, {"p90", 90.0}, {"p99", 99.0}, {"p99.9", 99.9}};
 
-                    if (max_requests && (m + 1 >= (int) max_requests)) {
-                        end_time();
-                        return NULL;
-                    }
+#define N_PERCENTILES (sizeof(percentiles) / sizeof(percentiles[0]))
 
-                    if (ticks && m % ticks == 0)
-                        printf("%d requests\n", m);
+static double result_rps(const struct result *res)
+{
+    return res->seconds > 0 ? num_requests / res->seconds : 0;
+}
 
-                    init_conn(efd, ec);
-                }
-            }
-        }
+static void report_text(const struct result *res)
+{
+    printf(
+        "\n"
+        "requests:      %" PRIu64
+        "\n"
+        "good requests: %" PRIu64
+        " [%d%%]\n"
+        "bad requests:  %" PRIu64
+        " [%d%%]\n"
+        "socker errors: %" PRIu64
+        " [%d%%]\n"
+        "seconds:       %.3f\n"
+        "requests/sec:  %.3f\n"
+        "\n",
+        num_requests, good_requests,
+        (int) (num_requests ? good_requests * 100 / num_requests : 0),
+        bad_requests,
+        (int) (num_requests ? bad_requests * 100 / num_requests : 0),
+        socket_errors,
+        (int) (num_requests ? socket_errors * 100 / num_requests : 0),
+        res->seconds, result_rps(res));
+
+    if (trace_len)
+        printf("replayed:      %s at %.2fx speed\n\n", replay, speed);
+    else if (rate > 0)
+        printf("target rate:   %.3f (%s arrivals)\n\n", rate,
+               poisson ? "poisson" : "uniform");
+
+    if (!res->lat.total)
+        return;
+
+    printf("latency (ms):  min %.3f, mean %.3f",
+           res->lat.min / 1e3, (double) res->lat.sum / res->lat.total / 1e3);
+    for (size_t i = 0; i < N_PERCENTILES; i++)
+        printf(", %s %.3f", percentiles[i].name,
+               hist_percentile(&res->lat, percentiles[i].p) / 1e3);
+    printf(", max %.3f\n", res->lat.max / 1e3);
+
+    if (res->ntimeline > 1) {
+        printf("\nthroughput over time (requests/sec):\n");
+        for (size_t i = 0; i < res->ntimeline; i++)
+            printf("  %4zus  %" PRIu64 "\n", i + 1, res->timeline[i]);
     }
+    printf("\n");
+}
+
+/* one JSON object per run, on a single line, so that result files can be
+ * appended to and read back as JSON Lines.
+ */
+static void report_json(FILE *fp, const struct result *res)
+{
+    fprintf(fp,
+            "{\"tool\": \"htstress\", \"host\": \"%s\", \"path\": \"%s\", "
+            "\"concurrency\": %d, \"threads\": %d, "
+            "\"requests\": %" PRIu64 ", \"good\": %" PRIu64
+            ", \"bad\": %" PRIu64 ", \"socket_errors\": %" PRIu64
+            ", \"seconds\": %.3f, \"rps\": %.3f, \"rate\": %.3f, "
+            "\"arrivals\": \"%s\", \"keepalive\": %s, \"pipeline\": %d, "
+            "\"urls\": %d, ",
+            res->host, res->rq, concurrency, num_threads, num_requests,
+            good_requests, bad_requests, socket_errors, res->seconds,
+            result_rps(res), rate,
+            trace_len ? "replay"
+                      : rate > 0 ? (poisson ? "poisson" : "uniform")
+                                 : "closed",
+            keep_alive ? "true" : "false", pipeline, num_urls);
+
+    fprintf(fp, "\"latency_us\": {\"min\": %" PRIu64 ", \"mean\": %.1f",
+            res->lat.min,
+            res->lat.total ? (double) res->lat.sum / res->lat.total : 0.0);
+    for (size_t i = 0; i < N_PERCENTILES; i++)
+        fprintf(fp, ", \"%s\": %" PRIu64, percentiles[i].name,
+                hist_percentile(&res->lat, percentiles[i].p));
+    fprintf(fp, ", \"max\": %" PRIu64 "}, \"timeline\": [", res->lat.max);
+
+    for (size_t i = 0; i < res->ntimeline; i++)
+        fprintf(fp, "%s%" PRIu64, i ? ", " : "", res->timeline[i]);
+    fprintf(fp, "]}\n");
+}
+
+static void report_csv(FILE *fp, const struct result *res, bool header)
+{
+    if (header) {
+        fprintf(fp,
+                "concurrency,threads,requests,good,bad,socket_errors,"
+                "seconds,rps,min_us,mean_us");
+        for (size_t i = 0; i < N_PERCENTILES; i++)
+            fprintf(fp, ",%s_us", percentiles[i].name);
+        fprintf(fp, ",max_us\n");
+    }
+
+    fprintf(fp,
+            "%d,%d,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64
+            ",%.3f,%.3f,%" PRIu64 ",%.1f",
+            concurrency, num_threads, num_requests, good_requests,
+            bad_requests, socket_errors, res->seconds, result_rps(res),
+            res->lat.min,
+            res->lat.total ? (double) res->lat.sum / res->lat.total : 0.0);
+    for (size_t i = 0; i < N_PERCENTILES; i++)
+        fprintf(fp, ",%" PRIu64, hist_percentile(&res->lat, percentiles[i].p));
+    fprintf(fp, ",%" PRIu64 "\n", res->lat.max);
 }
 
 static void signal_exit(int signal)
@@ -328,6 +1161,29 @@ static void print_usage()
         "CPU cores)\n"
         "   -u, --udaddr       path to unix domain socket\n"
         "   -h, --host         host to use for http request\n"
+        "   -r, --rate         open-loop mode: start N requests per second "
+        "(N or N/s)\n"
+        "                      on a fixed schedule, at most -c outstanding "
+        "per thread;\n"
+        "                      latency is measured from the intended send "
+        "time\n"
+        "   -P, --poisson      with --rate, use Poisson (exponential) "
+        "inter-arrival times\n"
+        "   -R, --replay       open-loop mode: replay the URLs and timing of "
+        "a trace\n"
+        "                      recorded by ebpf/http-parse-sample.py -w\n"
+        "   -S, --speed        replay speed factor (default 1.0)\n"
+        "   -k, --keepalive    reuse connections (HTTP/1.1 keep-alive)\n"
+        "   -p, --pipeline     send N requests per write on keep-alive "
+        "connections\n"
+        "   -l, --urls         file of \"path [weight]\" lines, picked per "
+        "request by weight\n"
+        "   -z, --zipf         N[:s], pick among N paths with Zipf popularity "
+        "(s = 1);\n"
+        "                      the URL path holds a %%d replaced by the rank "
+        "0..N-1\n"
+        "   -o, --output       result format: text (default), json or csv\n"
+        "   -f, --filename     append the result to this file\n"
         "   -d, --debug        debug HTTP response\n"
         "   --help             display this message\n");
     exit(0);
@@ -335,7 +1191,6 @@ static void print_usage()
 
 int main(int argc, char *argv[])
 {
-    pthread_t useless_thread;
     char *host = NULL;
     char *node = NULL;
     char *port = "http";
@@ -385,6 +1240,62 @@ int main(int argc, char *argv[])
         case 'f':
             filename = optarg;
             break;
+        case 'r':
+            rate = strtod(optarg, NULL);
+            if (rate <= 0) {
+                printf("Invalid rate: '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 'P':
+            poisson = true;
+            break;
+        case 'R':
+            replay = optarg;
+            break;
+        case 'S':
+            speed = strtod(optarg, NULL);
+            if (speed <= 0) {
+                printf("Invalid speed: '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 'k':
+            keep_alive = true;
+            break;
+        case 'p':
+            pipeline = atoi(optarg);
+            if (pipeline < 1) {
+                printf("Invalid pipeline depth: '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        case 'l':
+            urls = optarg;
+            break;
+        case 'z': {
+            char *end;
+            zipf_n = (int) strtol(optarg, &end, 10);
+            if (*end == ':')
+                zipf_s = strtod(end + 1, NULL);
+            if (zipf_n < 1 || zipf_s <= 0) {
+                printf("Invalid zipf distribution: '%s'\n", optarg);
+                return 1;
+            }
+            break;
+        }
+        case 'o':
+            if (!strcmp(optarg, "text"))
+                output_format = OUTPUT_TEXT;
+            else if (!strcmp(optarg, "json"))
+                output_format = OUTPUT_JSON;
+            else if (!strcmp(optarg, "csv"))
+                output_format = OUTPUT_CSV;
+            else {
+                printf("Unknown output format: '%s'\n", optarg);
+                return 1;
+            }
+            break;
         case 'u':
             udaddr = optarg;
             break;
@@ -410,6 +1321,11 @@ int main(int argc, char *argv[])
         }
     } while (next_option != -1);
 
+    if (poisson && rate <= 0) {
+        printf("--poisson needs --rate\n");
+        return 1;
+    }
+
     if (optind >= argc) {
         printf("Missing URL\n");
         return 1;
@@ -488,12 +1404,25 @@ int main(int argc, char *argv[])
         sssln = sizeof(struct sockaddr_un);
     }
 
-    /* prepare request buffer */
+    /* prepare request buffers */
     if (!host)
         host = node;
-    outbufsize = strlen(rq) + sizeof(HTTP_REQUEST_FMT) + strlen(host);
-    outbuf = malloc(outbufsize);
-    outbufsize = snprintf(outbuf, outbufsize, HTTP_REQUEST_FMT, rq, host);
+    if (pipeline > 1)
+        keep_alive = true;
+    if (strlen(replay) > 0) {
+        if (pipeline > 1) {
+            printf("--replay does not combine with --pipeline\n");
+            return 1;
+        }
+        load_trace(replay, host);
+        if (!max_requests || max_requests > trace_len)
+            max_requests = trace_len;
+    } else if (strlen(urls) > 0)
+        load_urls(urls, host);
+    else if (zipf_n > 0)
+        zipf_urls(rq, zipf_n, zipf_s, host);
+    else
+        add_request(rq, host, 1.0);
 
     ticks = max_requests / 10;
 
@@ -504,43 +1433,82 @@ int main(int argc, char *argv[])
         printf("[Press Ctrl-C to finish]\n");
     }
 
+    /* keep machine-readable output free of progress lines */
+    if (output_format != OUTPUT_TEXT)
+        ticks = 0;
+
+    struct wstat *stats = calloc(num_threads, sizeof(struct wstat));
+    if (!stats) {
+        perror("calloc");
+        exit(1);
+    }
+    for (int n = 0; n < num_threads; ++n)
+        stats[n].id = n;
+    open_loop = rate > 0 || trace_len;
+
     start_time();
 
     /* run test */
-    for (int n = 0; n < num_threads - 1; ++n)
-        pthread_create(&useless_thread, 0, &worker, 0);
+    for (int n = 1; n < num_threads; ++n)
+        pthread_create(&stats[n].tid, 0, &worker, stats + n);
 
-    worker(0);
+    worker(stats);
 
-    /* output result */
-    double delta =
+    for (int n = 1; n < num_threads; ++n)
+        pthread_join(stats[n].tid, NULL);
+
+    if (!tve.tv_sec)
+        end_time();
+
+    /* merge per-thread statistics */
+    struct result res = {.rq = rq, .host = host};
+    res.seconds =
         tve.tv_sec - tv.tv_sec + ((double) (tve.tv_usec - tv.tv_usec)) / 1e6;
+    for (int n = 0; n < num_threads; ++n) {
+        hist_merge(&res.lat, &stats[n].lat);
+        if (stats[n].ntimeline > res.ntimeline)
+            res.ntimeline = stats[n].ntimeline;
+    }
+    res.timeline = calloc(res.ntimeline ? res.ntimeline : 1, sizeof(uint64_t));
+    for (int n = 0; n < num_threads; ++n) {
+        for (size_t i = 0; i < stats[n].ntimeline; i++)
+            res.timeline[i] += stats[n].timeline[i];
+    }
+    /* drop the trailing seconds in which nothing completed */
+    while (res.ntimeline && !res.timeline[res.ntimeline - 1])
+        res.ntimeline--;
 
-    printf(
-        "\n"
-        "requests:      %" PRIu64
-        "\n"
-        "good requests: %" PRIu64
-        " [%d%%]\n"
-        "bad requests:  %" PRIu64
-        " [%d%%]\n"
-        "socker errors: %" PRIu64
-        " [%d%%]\n"
-        "seconds:       %.3f\n"
-        "requests/sec:  %.3f\n"
-        "\n",
-        num_requests, good_requests,
-        (int) (num_requests ? good_requests * 100 / num_requests : 0),
-        bad_requests,
-        (int) (num_requests ? bad_requests * 100 / num_requests : 0),
-        socket_errors,
-        (int) (num_requests ? socket_errors * 100 / num_requests : 0), delta,
-        delta > 0 ? max_requests / delta : 0);
+    /* output result */
+    switch (output_format) {
+    case OUTPUT_JSON:
+        report_json(stdout, &res);
+        break;
+    case OUTPUT_CSV:
+        report_csv(stdout, &res, true);
+        break;
+    default:
+        report_text(&res);
+    }
 
     if (strlen(filename) > 0) {
         FILE *fp = fopen(filename, "a+");
-        fprintf(fp, "%d %.3f\n", concurrency, max_requests / delta);
-        printf("written to %s\n", filename);
+        if (!fp) {
+            perror("fopen");
+            exit(1);
+        }
+        switch (output_format) {
+        case OUTPUT_JSON:
+            report_json(fp, &res);
+            break;
+        case OUTPUT_CSV:
+            fseek(fp, 0, SEEK_END);
+            report_csv(fp, &res, ftell(fp) == 0);
+            break;
+        default:
+            fprintf(fp, "%d %.3f\n", concurrency, max_requests / res.seconds);
+        }
+        if (output_format == OUTPUT_TEXT)
+            printf("written to %s\n", filename);
         fclose(fp);
     }
 
@@ -0,0 +1,100 @@
+/*
+ * logdump - print the binary access log of seHTTPd as text
+ *
+ * usage: logdump [access.log ...]
+ *
+ * Reads the log files given, or standard input, and prints one request per
+ * line:
+ *
+ *   2026-10-19T08:30:01.254Z fd 7 "GET /index.html HTTP/1.1" 200 446 0ms
+ */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "access_log.h"
+#include "http.h"
+
+static const char *method_name(int method)
+{
+    switch (method) {
+    case HTTP_GET:
+        return "GET";
+    case HTTP_HEAD:
+        return "HEAD";
+    case HTTP_POST:
+        return "POST";
+    default:
+        return "UNKNOWN";
+    }
+}
+
+static void print_record(const access_record_t *rec)
+{
+    char when[32];
+    time_t sec = rec->time / 1000;
+    struct tm tm;
+
+    gmtime_r(&sec, &tm);
+    strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", &tm);
+    printf("%s.%03uZ ", when, (unsigned) (rec->time % 1000));
+
+    if (!rec->status) {
+        printf("%llu requests not logged, the ring was full\n",
+               (unsigned long long) rec->bytes);
+        return;
+    }
+
+    printf("fd %d ", rec->fd);
+    int method = rec->method & ~ACCESS_URI_CUT;
+    if (!method)
+        printf("\"-\"");
+    else
+        printf("\"%s %.*s%s HTTP/%d.%d\"", method_name(method),
+               (int) sizeof(rec->uri), rec->uri,
+               rec->method & ACCESS_URI_CUT ? "..." : "", rec->version / 10,
+               rec->version % 10);
+    printf(" %u %llu %ums", rec->status, (unsigned long long) rec->bytes,
+           rec->duration);
+    if (rec->method & ACCESS_URI_CUT)
+        printf(" uri %08x", rec->uri_hash);
+    printf("\n");
+}
+
+static int dump(FILE *f, const char *name)
+{
+    access_record_t rec;
+    size_t n;
+
+    while ((n = fread(&rec, 1, sizeof(rec), f)) == sizeof(rec))
+        print_record(&rec);
+    if (ferror(f)) {
+        perror(name);
+        return 1;
+    }
+    if (n) {
+        fprintf(stderr, "%s: %zu bytes left over\n", name, n);
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int rc = 0;
+
+    if (argc < 2)
+        return dump(stdin, "stdin");
+
+    for (int i = 1; i < argc; i++) {
+        FILE *f = fopen(argv[i], "rb");
+        if (!f) {
+            perror(argv[i]);
+            rc = 1;
+            continue;
+        }
+        rc |= dump(f, argv[i]);
+        fclose(f);
+    }
+    return rc;
+}
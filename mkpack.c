@@ -0,0 +1,364 @@
+/*
+ * mkpack - pack the web root of seHTTPd into one file
+ *
+ * usage: mkpack [webroot [pack]]
+ *
+ * Packs the files under webroot, ./www by default, into pack, ./www.pack
+ * by default, which the server maps and serves them from. A file named
+ * <file>.gz next to <file> is also sent for it, to clients accepting gzip.
+ * The pack is written beside its final name and renamed to it once
+ * complete, so that a running server takes up either all of it or none.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* for nftw(3) */
+#endif
+
+#include <ftw.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "http.h"
+#include "pack.h"
+
+/* tries for the seed of one bucket, before giving up on the index */
+#define MAX_SEED (1U << 24)
+
+typedef struct {
+    char *path; /* below the web root, "/dir/index.html" */
+    char *full;
+    struct stat st;
+    int gzip; /* index of <path>.gz, or -1 */
+    uint64_t off, etag; /* of the body in the pack */
+} file_t;
+
+static file_t *files;
+static size_t nfiles, files_size;
+static size_t root_len;
+
+static int add_file(const char *full,
+                    const struct stat *st,
+                    int type,
+                    struct FTW *ftw UNUSED)
+{
+    if (type != FTW_F || !S_ISREG(st->st_mode))
+        return 0;
+
+    if (nfiles == files_size) {
+        files_size = files_size ? files_size * 2 : 64;
+        files = realloc(files, files_size * sizeof(file_t));
+        if (!files) {
+            perror("realloc");
+            return -1;
+        }
+    }
+    file_t *f = &files[nfiles++];
+    f->full = strdup(full);
+    f->path = f->full + root_len;
+    f->st = *st;
+    f->gzip = -1;
+    return f->full ? 0 : -1;
+}
+
+static int by_path(const void *a, const void *b)
+{
+    return strcmp(((const file_t *) a)->path, ((const file_t *) b)->path);
+}
+
+static file_t *find(const char *path, size_t len)
+{
+    size_t lo = 0, hi = nfiles;
+
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        int c = strncmp(files[mid].path, path, len);
+        if (!c && files[mid].path[len])
+            c = 1;
+        if (!c)
+            return &files[mid];
+        if (c < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return NULL;
+}
+
+/* <file>.gz becomes the gzip variant of <file>, if it is up to date and
+ * saves anything
+ */
+static void match_gzip()
+{
+    for (size_t i = 0; i < nfiles; i++) {
+        size_t len = strlen(files[i].path);
+        if (len < 4 || strcmp(files[i].path + len - 3, ".gz"))
+            continue;
+
+        file_t *plain = find(files[i].path, len - 3);
+        if (!plain)
+            continue;
+        if (files[i].st.st_mtime < plain->st.st_mtime) {
+            fprintf(stderr, "%s is older than %s, left out\n", files[i].full,
+                    plain->full);
+            continue;
+        }
+        if (files[i].st.st_size < plain->st.st_size)
+            plain->gzip = i;
+    }
+}
+
+/* append the contents of f to out, hashing them on the way */
+static int copy_body(FILE *out, file_t *f)
+{
+    char buf[1 << 16];
+    uint64_t h = 14695981039346656037ULL;
+    off_t left = f->st.st_size;
+
+    FILE *in = fopen(f->full, "rb");
+    if (!in) {
+        perror(f->full);
+        return -1;
+    }
+    f->off = ftello(out);
+    while (left > 0) {
+        size_t n = fread(buf, 1, sizeof(buf), in);
+        if (!n)
+            break;
+        for (size_t i = 0; i < n; i++)
+            h = (h ^ (unsigned char) buf[i]) * 1099511628211ULL;
+        if (fwrite(buf, 1, n, out) != n) {
+            fclose(in);
+            return -1;
+        }
+        left -= n;
+    }
+    fclose(in);
+    if (left) {
+        fprintf(stderr, "%s changed while being packed\n", f->full);
+        return -1;
+    }
+    f->etag = h;
+    return 0;
+}
+
+/* the header lines of one variant, appended to out */
+static int add_variant(FILE *out,
+                       pack_variant_t *v,
+                       const file_t *plain,
+                       const file_t *body,
+                       bool gzip)
+{
+    char lines[SHORTLINE];
+    struct tm tm;
+
+    v->off = body->off;
+    v->len = body->st.st_size;
+    v->etag = body->etag;
+    v->mtime = plain->st.st_mtime;
+    snprintf(v->etag_str, sizeof(v->etag_str), "\"%016" PRIx64 "\"", v->etag);
+    strftime(v->last_modified, sizeof(v->last_modified),
+             "%a, %d %b %Y %H:%M:%S GMT", gmtime_r(&plain->st.st_mtime, &tm));
+
+    int n = snprintf(lines, sizeof(lines), "ETag: %s\r\nLast-Modified: %s\r\n",
+                     v->etag_str, v->last_modified);
+    if (plain->gzip >= 0)
+        n += snprintf(lines + n, sizeof(lines) - n,
+                      "Vary: Accept-Encoding\r\n");
+    v->validators_len = n;
+    n += snprintf(lines + n, sizeof(lines) - n,
+                  "Content-type: %s\r\nContent-length: %" PRIu64 "\r\n",
+                  http_file_type(strrchr(plain->path, '.')), v->len);
+    if (gzip)
+        n += snprintf(lines + n, sizeof(lines) - n,
+                      "Content-Encoding: gzip\r\n");
+
+    v->header = ftello(out);
+    v->header_len = n;
+    return fwrite(lines, 1, n, out) == (size_t) n ? 0 : -1;
+}
+
+static uint64_t *hashes;
+static uint32_t *bucket_of, *bucket_size;
+
+static int by_bucket_size(const void *a, const void *b)
+{
+    uint32_t x = bucket_size[*(const uint32_t *) a];
+    uint32_t y = bucket_size[*(const uint32_t *) b];
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/* choose the seed of each bucket, the fullest first, so that its paths
+ * fall into slots nobody has taken. slot[i] is where files[i] goes.
+ */
+static int build_index(uint32_t *seeds, uint32_t nbuckets, uint32_t *slot)
+{
+    uint32_t n = nfiles;
+    uint32_t *order = malloc(nbuckets * sizeof(uint32_t));
+    uint32_t *members = malloc(n * sizeof(uint32_t));
+    uint32_t *start = calloc(nbuckets + 1, sizeof(uint32_t));
+    char *taken = calloc(n, 1);
+    int rc = -1;
+
+    hashes = malloc(n * sizeof(uint64_t));
+    bucket_of = malloc(n * sizeof(uint32_t));
+    bucket_size = calloc(nbuckets, sizeof(uint32_t));
+    if (!order || !members || !start || !taken || !hashes || !bucket_of ||
+        !bucket_size)
+        goto out;
+
+    for (uint32_t i = 0; i < n; i++) {
+        hashes[i] = pack_hash(files[i].path, strlen(files[i].path));
+        bucket_of[i] = pack_mix(hashes[i], 0) % nbuckets;
+        bucket_size[bucket_of[i]]++;
+    }
+    for (uint32_t b = 0; b < nbuckets; b++) {
+        start[b + 1] = start[b] + bucket_size[b];
+        order[b] = b;
+    }
+    for (uint32_t i = 0; i < n; i++)
+        members[start[bucket_of[i]]++] = i;
+    for (uint32_t b = 0; b < nbuckets; b++)
+        start[b] -= bucket_size[b];
+    qsort(order, nbuckets, sizeof(uint32_t), by_bucket_size);
+
+    for (uint32_t k = 0; k < nbuckets; k++) {
+        uint32_t b = order[k], size = bucket_size[b];
+        uint32_t *m = &members[start[b]];
+        uint32_t seed;
+
+        seeds[b] = 0;
+        if (!size)
+            continue;
+        for (seed = 1; seed < MAX_SEED; seed++) {
+            uint32_t j;
+            for (j = 0; j < size; j++) {
+                slot[m[j]] = pack_mix(hashes[m[j]], seed) % n;
+                if (taken[slot[m[j]]])
+                    break;
+                taken[slot[m[j]]] = 1;
+            }
+            if (j == size)
+                break;
+            while (j--) /* undo, and try the next seed */
+                taken[slot[m[j]]] = 0;
+        }
+        if (seed == MAX_SEED) {
+            fprintf(stderr, "no perfect hash for the paths, e.g. %s\n",
+                    files[m[0]].path);
+            goto out;
+        }
+        seeds[b] = seed;
+    }
+    rc = 0;
+
+out:
+    free(order);
+    free(members);
+    free(start);
+    free(taken);
+    free(hashes);
+    free(bucket_of);
+    free(bucket_size);
+    return rc;
+}
+
+static int write_pack(FILE *out)
+{
+    uint32_t n = nfiles, nbuckets = n / 2 + 1;
+    pack_header_t header = {
+        .nentries = n,
+        .nbuckets = nbuckets,
+        .seeds = sizeof(pack_header_t),
+    };
+    memcpy(header.magic, PACK_MAGIC, sizeof(header.magic));
+    header.index = (header.seeds + nbuckets * sizeof(uint32_t) + 7) & ~7ULL;
+
+    uint32_t *seeds = calloc(nbuckets, sizeof(uint32_t));
+    uint32_t *slot = calloc(n ? n : 1, sizeof(uint32_t));
+    pack_entry_t *index = calloc(n ? n : 1, sizeof(pack_entry_t));
+    int rc = -1;
+
+    if (!seeds || !slot || !index || (n && build_index(seeds, nbuckets, slot)))
+        goto out;
+
+    /* bodies, then paths and header lines, then what points at them */
+    if (fseeko(out, header.index + (off_t) n * sizeof(pack_entry_t),
+               SEEK_SET) < 0)
+        goto out;
+    for (uint32_t i = 0; i < n; i++) {
+        if (copy_body(out, &files[i]) < 0)
+            goto out;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        pack_entry_t *e = &index[slot[i]];
+        size_t len = strlen(files[i].path);
+
+        e->path = ftello(out);
+        e->path_len = len;
+        if (fwrite(files[i].path, 1, len + 1, out) != len + 1 ||
+            add_variant(out, &e->plain, &files[i], &files[i], false) < 0)
+            goto out;
+        if (files[i].gzip >= 0 &&
+            add_variant(out, &e->gzip, &files[i], &files[files[i].gzip],
+                        true) < 0)
+            goto out;
+    }
+    header.size = ftello(out);
+
+    if (fseeko(out, 0, SEEK_SET) < 0 ||
+        fwrite(&header, sizeof(header), 1, out) != 1 ||
+        fwrite(seeds, sizeof(uint32_t), nbuckets, out) != nbuckets ||
+        fseeko(out, header.index, SEEK_SET) < 0 ||
+        fwrite(index, sizeof(pack_entry_t), n, out) != n)
+        goto out;
+    rc = 0;
+
+out:
+    free(seeds);
+    free(slot);
+    free(index);
+    return rc;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *root = argc > 1 ? argv[1] : "./www";
+    const char *pack = argc > 2 ? argv[2] : PACK_FILE;
+    char tmp[PATH_MAX];
+
+    root_len = strlen(root);
+    while (root_len > 1 && root[root_len - 1] == '/')
+        root_len--;
+    if (nftw(root, add_file, 16, FTW_PHYS) < 0) {
+        perror(root);
+        return 1;
+    }
+    qsort(files, nfiles, sizeof(file_t), by_path);
+    match_gzip();
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", pack);
+    FILE *out = fopen(tmp, "wb");
+    if (!out) {
+        perror(tmp);
+        return 1;
+    }
+    if (write_pack(out) < 0 || fflush(out) || fsync(fileno(out)) < 0) {
+        fprintf(stderr, "cannot write %s\n", tmp);
+        fclose(out);
+        unlink(tmp);
+        return 1;
+    }
+    fclose(out);
+    if (rename(tmp, pack) < 0) {
+        perror(pack);
+        unlink(tmp);
+        return 1;
+    }
+    printf("%zu files packed into %s\n", nfiles, pack);
+    return 0;
+}
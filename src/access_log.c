@@ -0,0 +1,204 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "access_log.h"
+#include "http.h"
+#include "logger.h"
+
+/* records of one thread on their way to the file. The thread adds them at
+ * head and the flusher takes them from tail, without a lock: each end is
+ * only written by one side, on a cache line of its own.
+ */
+typedef struct {
+    size_t head;
+    size_t tail_seen; /* tail, as the thread last looked at it */
+    size_t dropped;   /* records which found the ring full */
+
+    size_t tail __attribute__((aligned(CACHE_LINE_SIZE)));
+    size_t dropped_seen; /* dropped, as last written out */
+
+    access_record_t records[ACCESS_LOG_RING]
+        __attribute__((aligned(CACHE_LINE_SIZE)));
+} log_ring_t;
+
+_Static_assert(!(ACCESS_LOG_RING & (ACCESS_LOG_RING - 1)),
+               "ACCESS_LOG_RING should be power of 2");
+
+static int log_fd = -1;
+
+/* the rings of the threads of this process, in the order they first
+ * logged a request
+ */
+static log_ring_t *rings[ACCESS_LOG_THREADS];
+static int nrings;
+
+static __thread log_ring_t *ring;
+static __thread bool no_ring;
+
+/* opened before worker processes fork, they all append to it */
+int access_log_init(const char *path)
+{
+    log_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    return log_fd < 0 ? -1 : 0;
+}
+
+static void *flush_cycle(void *arg UNUSED)
+{
+    struct iovec iov[ACCESS_LOG_THREADS * 3];
+    size_t taken[ACCESS_LOG_THREADS];
+    access_record_t drops[ACCESS_LOG_THREADS];
+
+    while (1) {
+        usleep(ACCESS_LOG_FLUSH * 1000);
+
+        int n = __atomic_load_n(&nrings, __ATOMIC_RELAXED);
+        if (n > ACCESS_LOG_THREADS)
+            n = ACCESS_LOG_THREADS;
+
+        /* everything the threads logged goes out in one writev(), which
+         * O_APPEND keeps whole between the worker processes
+         */
+        int niov = 0;
+        size_t len = 0;
+        for (int i = 0; i < n; i++) {
+            log_ring_t *q = __atomic_load_n(&rings[i], __ATOMIC_ACQUIRE);
+            taken[i] = 0;
+            if (!q)
+                continue;
+
+            size_t dropped = __atomic_load_n(&q->dropped, __ATOMIC_RELAXED);
+            if (dropped != q->dropped_seen) {
+                struct timespec ts;
+                clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+                drops[i] = (access_record_t){
+                    .time = ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000,
+                    .bytes = dropped - q->dropped_seen,
+                    .fd = -1,
+                };
+                q->dropped_seen = dropped;
+                iov[niov++] = (struct iovec){&drops[i], sizeof(drops[i])};
+                len += sizeof(drops[i]);
+            }
+
+            size_t tail = q->tail;
+            size_t count = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) - tail;
+            size_t from = tail & (ACCESS_LOG_RING - 1);
+            size_t first = ACCESS_LOG_RING - from;
+            if (first > count)
+                first = count;
+            if (first)
+                iov[niov++] = (struct iovec){&q->records[from],
+                                             first * sizeof(access_record_t)};
+            if (count > first)
+                iov[niov++] = (struct iovec){
+                    q->records, (count - first) * sizeof(access_record_t)};
+            len += count * sizeof(access_record_t);
+            taken[i] = count;
+        }
+
+        if (niov > 0) {
+            ssize_t rc = writev(log_fd, iov, niov);
+            if (rc < 0 || (size_t) rc != len)
+                log_err("access log: %zd of %zu bytes written", rc, len);
+        }
+
+        /* the slots are only given back once written */
+        for (int i = 0; i < n; i++) {
+            if (taken[i])
+                __atomic_store_n(&rings[i]->tail, rings[i]->tail + taken[i],
+                                 __ATOMIC_RELEASE);
+        }
+    }
+    return NULL;
+}
+
+/* start the flusher of the calling process, after fork() */
+int access_log_start()
+{
+    pthread_t thread;
+
+    if (log_fd < 0)
+        return 0;
+    if (pthread_create(&thread, NULL, flush_cycle, NULL)) {
+        log_err("pthread_create");
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+/* the ring of the calling thread, made when it first logs a request */
+static log_ring_t *get_ring()
+{
+    if (ring || no_ring)
+        return ring;
+
+    void *p;
+    int i = __atomic_fetch_add(&nrings, 1, __ATOMIC_RELAXED);
+    if (i >= ACCESS_LOG_THREADS ||
+        posix_memalign(&p, CACHE_LINE_SIZE, sizeof(log_ring_t))) {
+        log_err("thread %d of the process logs no requests", i);
+        no_ring = true;
+        return NULL;
+    }
+    memset(p, 0, sizeof(log_ring_t));
+    ring = p;
+    __atomic_store_n(&rings[i], ring, __ATOMIC_RELEASE);
+    return ring;
+}
+
+/* log a request. This only copies it into the ring of the calling thread,
+ * the flusher writes it.
+ */
+void access_log(int fd,
+                int method,
+                int version,
+                const char *uri,
+                size_t uri_len,
+                int status,
+                size_t bytes,
+                size_t duration)
+{
+    log_ring_t *q = log_fd >= 0 ? get_ring() : NULL;
+    if (!q)
+        return;
+
+    size_t head = q->head;
+    if (head - q->tail_seen == ACCESS_LOG_RING) {
+        q->tail_seen = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+        if (head - q->tail_seen == ACCESS_LOG_RING) {
+            __atomic_store_n(&q->dropped, q->dropped + 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+
+    access_record_t *rec = &q->records[head & (ACCESS_LOG_RING - 1)];
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    rec->time = ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+    rec->bytes = bytes;
+    rec->duration = duration;
+    rec->fd = fd;
+    rec->status = status;
+    rec->method = method;
+    rec->version = version;
+
+    uint32_t hash = 2166136261U;
+    for (size_t i = 0; i < uri_len; i++)
+        hash = (hash ^ (unsigned char) uri[i]) * 16777619U;
+    rec->uri_hash = hash;
+
+    size_t n = uri_len < sizeof(rec->uri) ? uri_len : sizeof(rec->uri) - 1;
+    memcpy(rec->uri, uri, n);
+    memset(rec->uri + n, 0, sizeof(rec->uri) - n);
+    if (n < uri_len)
+        rec->method |= ACCESS_URI_CUT;
+
+    __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,53 @@
+#ifndef ACCESS_LOG_H
+#define ACCESS_LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ACCESS_LOG "./access.log"
+
+/* records each thread may have waiting for the flusher, a power of 2.
+ * Requests finishing while its ring is full are counted, not logged.
+ */
+#define ACCESS_LOG_RING 4096
+
+/* threads of a worker process which may log requests */
+#define ACCESS_LOG_THREADS 64
+
+/* how often the flusher writes the records out */
+#define ACCESS_LOG_FLUSH 20 /* ms */
+
+/* the URI in a record is cut to its first 31 bytes */
+#define ACCESS_URI_CUT 0x80 /* in method */
+
+/* one request, as written to the log file. status 0 marks a record which
+ * only counts the records of one thread dropped since the last one, in
+ * bytes.
+ */
+typedef struct {
+    uint64_t time;     /* ms since the Epoch, when the response was done */
+    uint64_t bytes;    /* sent, header included */
+    uint32_t duration; /* ms, writing the response */
+    int32_t fd;
+    uint32_t uri_hash; /* FNV-1a of the whole URI */
+    uint16_t status;
+    uint8_t method;  /* enum http_method, with ACCESS_URI_CUT */
+    uint8_t version; /* 10, 11 or 20 */
+    char uri[32];    /* NUL terminated */
+} access_record_t;
+
+_Static_assert(sizeof(access_record_t) == 64,
+               "access_record_t fills one cache line");
+
+int access_log_init(const char *path);
+int access_log_start();
+void access_log(int fd,
+                int method,
+                int version,
+                const char *uri,
+                size_t uri_len,
+                int status,
+                size_t bytes,
+                size_t duration);
+
+#endif
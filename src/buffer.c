@@ -0,0 +1,82 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "buffer.h"
+#include "http.h"
+
+/* a free buffer starts with the link to the next one in its list */
+struct free_buf {
+    struct free_buf *next;
+};
+
+/* free lists of the calling thread, so that getting and putting back a
+ * buffer takes no lock. A buffer may be put back by another thread than
+ * the one which got it, it just moves to that thread's list.
+ */
+static __thread struct {
+    struct free_buf *head;
+    size_t count;
+} free_list[BUF_CLASSES];
+
+static inline int buf_class(size_t size)
+{
+    int c = __builtin_ctzl(size / BUF_SIZE);
+    assert(size == (size_t) BUF_SIZE << c && c < BUF_CLASSES &&
+           "buf_class: not a buffer size");
+    return c;
+}
+
+static char *buf_alloc(size_t size)
+{
+#if (ENABLE_HUGEPAGE)
+    if (size >= HUGEPAGE_SIZE) {
+        void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+            return NULL;
+        madvise(p, size, MADV_HUGEPAGE);
+        return p;
+    }
+#endif
+    return malloc(size);
+}
+
+static void buf_free(char *buf, size_t size UNUSED)
+{
+#if (ENABLE_HUGEPAGE)
+    if (size >= HUGEPAGE_SIZE) {
+        munmap(buf, size);
+        return;
+    }
+#endif
+    free(buf);
+}
+
+/* get a buffer of size bytes, which must be one of the size classes */
+char *buf_get(size_t size)
+{
+    int c = buf_class(size);
+    struct free_buf *b = free_list[c].head;
+
+    if (!b)
+        return buf_alloc(size);
+    free_list[c].head = b->next;
+    free_list[c].count--;
+    return (char *) b;
+}
+
+void buf_put(char *buf, size_t size)
+{
+    int c = buf_class(size);
+
+    if (free_list[c].count >= BUF_CACHE / size) {
+        buf_free(buf, size);
+        return;
+    }
+
+    struct free_buf *b = (struct free_buf *) buf;
+    b->next = free_list[c].head;
+    free_list[c].head = b;
+    free_list[c].count++;
+}
@@ -0,0 +1,24 @@
+#ifndef BUFFER_H
+#define BUFFER_H
+
+#include <stddef.h>
+
+/* request buffers come in size classes BUF_SIZE << 0 .. BUF_CLASSES - 1, the
+ * largest one being MAX_BUF
+ */
+#define BUF_CLASSES 11
+
+/* bytes of free buffers each thread keeps per size class. Larger buffers,
+ * only needed for unusually large headers, are freed right away.
+ */
+#define BUF_CACHE (1 << 20) /* 1MB */
+
+/* buffers this large are backed by transparent huge pages when the server
+ * is built with ENABLE_HUGEPAGE
+ */
+#define HUGEPAGE_SIZE (2 << 20) /* 2MB */
+
+char *buf_get(size_t size);
+void buf_put(char *buf, size_t size);
+
+#endif
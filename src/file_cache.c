@@ -0,0 +1,177 @@
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "file_cache.h"
+#include "timer.h"
+
+typedef struct {
+    size_t checked; /* ms, when the metadata was read */
+    int root;       /* the directory filename is below */
+    file_meta_t meta;
+    char name[FILE_CACHE_NAME]; /* empty while the slot is unused */
+} file_entry_t;
+
+_Static_assert(!(FILE_CACHE_SIZE & (FILE_CACHE_SIZE - 1)),
+               "FILE_CACHE_SIZE should be power of 2");
+
+/* each worker process fills its own as it serves files */
+static file_entry_t entries[FILE_CACHE_SIZE];
+
+#if (ENABLE_THPOOL)
+/* slots are guarded by one lock out of these, by slot number */
+#define FILE_CACHE_LOCKS 64
+static pthread_mutex_t locks[FILE_CACHE_LOCKS] = {
+    [0 ... FILE_CACHE_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER};
+#endif
+
+static inline void slot_lock_acquire(size_t i UNUSED)
+{
+#if (ENABLE_THPOOL)
+    pthread_mutex_lock(&locks[i % FILE_CACHE_LOCKS]);
+#endif
+}
+
+static inline void slot_lock_release(size_t i UNUSED)
+{
+#if (ENABLE_THPOOL)
+    pthread_mutex_unlock(&locks[i % FILE_CACHE_LOCKS]);
+#endif
+}
+
+static inline uint64_t fnv1a(uint64_t hash, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ p[i]) * 1099511628211ULL;
+    return hash;
+}
+
+#define FNV_OFFSET 14695981039346656037ULL
+
+/* the slot of filename below root, or -1 if its name is too long to be
+ * kept
+ */
+static ssize_t slot_of(int root, const char *filename)
+{
+    size_t len = strlen(filename);
+    if (len >= FILE_CACHE_NAME)
+        return -1;
+    uint64_t hash = fnv1a(FNV_OFFSET, &root, sizeof(root));
+    return fnv1a(hash, filename, len) & (FILE_CACHE_SIZE - 1);
+}
+
+/* the ETag changes whenever the file is replaced, resized or written to,
+ * as far as the file system's timestamps tell
+ */
+void file_meta_init(file_meta_t *m, const struct stat *st)
+{
+    uint64_t id[4] = {st->st_ino, st->st_size, st->st_mtim.tv_sec,
+                      st->st_mtim.tv_nsec};
+    struct tm tm;
+
+    m->size = st->st_size;
+    m->mtime = st->st_mtime;
+    m->etag = fnv1a(FNV_OFFSET, id, sizeof(id));
+    snprintf(m->etag_str, sizeof(m->etag_str), "\"%016" PRIx64 "\"", m->etag);
+    strftime(m->last_modified, sizeof(m->last_modified),
+             "%a, %d %b %Y %H:%M:%S GMT", gmtime_r(&m->mtime, &tm));
+}
+
+/* the metadata of filename below root, if read within FILE_CACHE_VALID */
+bool file_cache_get(int root, const char *filename, file_meta_t *m)
+{
+    ssize_t i = slot_of(root, filename);
+    bool hit = false;
+
+    if (i < 0)
+        return false;
+
+    file_entry_t *e = &entries[i];
+    slot_lock_acquire(i);
+    if (time_msec() - e->checked < FILE_CACHE_VALID && e->root == root &&
+        !strcmp(e->name, filename)) {
+        *m = e->meta;
+        hit = true;
+    }
+    slot_lock_release(i);
+    return hit;
+}
+
+/* keep the metadata of filename below root, just read from the file */
+void file_cache_put(int root, const char *filename, const file_meta_t *m)
+{
+    ssize_t i = slot_of(root, filename);
+
+    if (i < 0)
+        return;
+
+    file_entry_t *e = &entries[i];
+    slot_lock_acquire(i);
+    strcpy(e->name, filename);
+    e->root = root;
+    e->meta = *m;
+    e->checked = time_msec();
+    slot_lock_release(i);
+}
+
+static bool parse_hex64(const char *p, uint64_t *value)
+{
+    uint64_t v = 0;
+
+    for (int i = 0; i < 16; i++) {
+        char c = p[i] | 0x20;
+        if (c >= '0' && c <= '9')
+            v = v << 4 | (c - '0');
+        else if (c >= 'a' && c <= 'f')
+            v = v << 4 | (c - 'a' + 10);
+        else
+            return false;
+    }
+    *value = v;
+    return true;
+}
+
+/* whether a conditional GET or HEAD is answered with 304. If-None-Match
+ * decides if it is there, by the weak comparison: its entity tags, parsed
+ * back into hashes, are compared with the ETag of the file. Otherwise the
+ * file must not have changed after If-Modified-Since, if that is given
+ * and not in the future.
+ */
+bool file_not_modified(const file_meta_t *m,
+                       const char *if_none_match,
+                       size_t len,
+                       time_t if_modified_since)
+{
+    if (if_none_match) {
+        const char *p = if_none_match, *end = if_none_match + len;
+        uint64_t etag;
+
+        while (p < end) {
+            if (*p == ' ' || *p == '\t' || *p == ',') {
+                p++;
+                continue;
+            }
+            if (*p == '*')
+                return true;
+            if (end - p >= 2 && p[0] == 'W' && p[1] == '/')
+                p += 2;
+            if (p == end || *p != '"')
+                return false;
+
+            const char *tag = ++p;
+            while (p < end && *p != '"')
+                p++;
+            if (p == end)
+                return false;
+            if (p - tag == 16 && parse_hex64(tag, &etag) && etag == m->etag)
+                return true;
+            p++;
+        }
+        return false;
+    }
+
+    return if_modified_since >= 0 && m->mtime <= if_modified_since &&
+           if_modified_since <= time_sec();
+}
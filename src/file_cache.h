@@ -0,0 +1,40 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <time.h>
+
+/* files whose metadata is kept, a power of 2. Files sharing a slot take
+ * turns, the last one looked up stays.
+ */
+#define FILE_CACHE_SIZE 1024
+
+/* longer file names are looked up each time */
+#define FILE_CACHE_NAME 128
+
+/* how long metadata is trusted before the file is looked at again. A file
+ * changed within that time may still be reported as not modified.
+ */
+#define FILE_CACHE_VALID 1000 /* ms */
+
+/* what responses tell about a file, worked out once from its metadata */
+typedef struct {
+    off_t size;
+    time_t mtime;
+    uint64_t etag;          /* hash of inode, size and mtime */
+    char etag_str[19];      /* the ETag field value, etag in hex quoted */
+    char last_modified[30]; /* the Last-Modified field value */
+} file_meta_t;
+
+void file_meta_init(file_meta_t *m, const struct stat *st);
+bool file_cache_get(int root, const char *filename, file_meta_t *m);
+void file_cache_put(int root, const char *filename, const file_meta_t *m);
+bool file_not_modified(const file_meta_t *m,
+                       const char *if_none_match,
+                       size_t len,
+                       time_t if_modified_since);
+
+#endif
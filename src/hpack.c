@@ -0,0 +1,375 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hpack.h"
+
+/* bytes each entry of the dynamic table counts beyond its name and value */
+#define ENTRY_OVERHEAD 32
+
+#define DYNAMIC_ENTRIES (HPACK_TABLE_SIZE / ENTRY_OVERHEAD)
+
+static const struct {
+    const char *name, *value;
+} static_table[] = {
+    {NULL, NULL}, /* indices start at 1 */
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+#define STATIC_ENTRIES 61
+
+/* the Huffman code of RFC 7541 Appendix B is canonical: it is defined by
+ * the number of codes of each length, 5 to 30 bits, and the symbols in the
+ * order of their codes. 256 is EOS.
+ */
+#define HUFF_MAX_BITS 30
+
+static const uint8_t huff_count[HUFF_MAX_BITS + 1] = {
+    0, 0,  0,  0,  0,  10, 26, 32, 6,  0,  5, 3, 2,  6,  2, 3,
+    0, 0,  0,  3,  8,  13, 26, 29, 12, 4,  15, 19, 29, 0, 4,
+};
+
+static const uint16_t huff_sym[257] = {
+    48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37, 45, 46, 47, 51, 52,
+    53, 54, 55, 56, 57, 61, 65, 95, 98, 100, 102, 103, 104, 108, 109, 110, 112,
+    114, 117, 58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76, 77, 78, 79, 80,
+    81, 82, 83, 84, 85, 86, 87, 89, 106, 107, 113, 118, 119, 120, 121, 122, 38,
+    42, 44, 59, 88, 90, 33, 34, 40, 41, 63, 39, 43, 124, 35, 62, 0, 36, 64, 91,
+    93, 126, 94, 125, 60, 96, 123, 92, 195, 208, 128, 130, 131, 162, 184, 194,
+    224, 226, 153, 161, 167, 172, 176, 177, 179, 209, 216, 217, 227, 229, 230,
+    129, 132, 133, 134, 136, 146, 154, 156, 160, 163, 164, 169, 170, 173, 178,
+    181, 185, 186, 187, 189, 190, 196, 198, 228, 232, 233, 1, 135, 137, 138,
+    139, 140, 141, 143, 147, 149, 150, 151, 152, 155, 157, 158, 165, 166, 168,
+    174, 175, 180, 182, 183, 188, 191, 197, 231, 239, 9, 142, 144, 145, 148,
+    159, 171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193, 200, 201,
+    202, 205, 210, 213, 218, 219, 238, 240, 242, 243, 255, 203, 204, 211, 212,
+    214, 221, 222, 223, 241, 244, 245, 246, 247, 248, 250, 251, 252, 253, 254,
+    2, 3, 4, 5, 6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20, 21, 23, 24, 25,
+    26, 27, 28, 29, 30, 31, 127, 220, 249, 10, 13, 22, 256,
+};
+
+/* decode bit by bit, as puff.c does for DEFLATE. Padding is fewer than 8
+ * bits, all 1, the start of EOS.
+ */
+static int huff_decode(const uint8_t *in, size_t len, char *out, size_t *n)
+{
+    int code = 0, first = 0, index = 0, bits = 0;
+    char *o = out;
+
+    for (size_t i = 0; i < len; i++) {
+        for (int b = 7; b >= 0; b--) {
+            code |= (in[i] >> b) & 1;
+            bits++;
+            int count = huff_count[bits];
+            if (code - first < count) {
+                int sym = huff_sym[index + code - first];
+                if (sym == 256)
+                    return -1;
+                *o++ = sym;
+                code = first = index = bits = 0;
+                continue;
+            }
+            if (bits == HUFF_MAX_BITS)
+                return -1;
+            index += count;
+            first = (first + count) << 1;
+            code <<= 1;
+        }
+    }
+
+    /* code is shifted once past the pending bits */
+    if (bits > 7 || code >> 1 != (1 << bits) - 1)
+        return -1;
+    *n = o - out;
+    return 0;
+}
+
+/* an integer with an n-bit prefix, -1 if it is cut off or too large */
+static int64_t decode_int(const uint8_t **p, const uint8_t *end, int n)
+{
+    int64_t mask = (1 << n) - 1;
+    int64_t v = *(*p)++ & mask;
+
+    if (v < mask)
+        return v;
+    for (int shift = 0; *p < end && shift <= 21; shift += 7) {
+        uint8_t b = *(*p)++;
+        v += (int64_t) (b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return v;
+    }
+    return -1;
+}
+
+/* a string literal points into the input, unless it is Huffman coded and
+ * gets decoded into scratch
+ */
+static int decode_string(const uint8_t **p,
+                         const uint8_t *end,
+                         char **scratch,
+                         const char **s,
+                         size_t *len)
+{
+    if (*p >= end)
+        return -1;
+
+    bool huffman = **p & 0x80;
+    int64_t n = decode_int(p, end, 7);
+    if (n < 0 || n > end - *p)
+        return -1;
+
+    if (!huffman) {
+        *s = (const char *) *p;
+        *len = n;
+    } else {
+        if (huff_decode(*p, n, *scratch, len) < 0)
+            return -1;
+        *s = *scratch;
+        *scratch += *len;
+    }
+    *p += n;
+    return 0;
+}
+
+static inline hpack_entry_t *dynamic_entry(hpack_table_t *t, size_t i)
+{
+    return &t->entries[(t->first + i) % DYNAMIC_ENTRIES];
+}
+
+static void evict(hpack_table_t *t, size_t max_size)
+{
+    while (t->size > max_size) {
+        hpack_entry_t *e = dynamic_entry(t, --t->count);
+        t->size -= e->name_len + e->value_len + ENTRY_OVERHEAD;
+        free(e->name);
+    }
+}
+
+/* takes over name, which value follows */
+static void insert(hpack_table_t *t,
+                   char *name,
+                   size_t name_len,
+                   size_t value_len)
+{
+    size_t size = name_len + value_len + ENTRY_OVERHEAD;
+
+    if (size > t->max_size) {
+        evict(t, 0);
+        free(name);
+        return;
+    }
+    evict(t, t->max_size - size);
+
+    t->first = (t->first + DYNAMIC_ENTRIES - 1) % DYNAMIC_ENTRIES;
+    t->count++;
+    t->size += size;
+    *dynamic_entry(t, 0) = (hpack_entry_t){
+        .name = name,
+        .value = name + name_len,
+        .name_len = name_len,
+        .value_len = value_len,
+    };
+}
+
+static int lookup(hpack_table_t *t,
+                  int64_t index,
+                  const char **name,
+                  size_t *name_len,
+                  const char **value,
+                  size_t *value_len)
+{
+    if (index <= 0 || index > STATIC_ENTRIES + (int64_t) t->count)
+        return -1;
+
+    if (index <= STATIC_ENTRIES) {
+        *name = static_table[index].name;
+        *name_len = strlen(*name);
+        *value = static_table[index].value;
+        *value_len = strlen(*value);
+        return 0;
+    }
+
+    hpack_entry_t *e = dynamic_entry(t, index - STATIC_ENTRIES - 1);
+    *name = e->name;
+    *name_len = e->name_len;
+    *value = e->value;
+    *value_len = e->value_len;
+    return 0;
+}
+
+void hpack_init(hpack_table_t *t)
+{
+    t->first = t->count = t->size = 0;
+    t->max_size = HPACK_TABLE_SIZE;
+}
+
+void hpack_free(hpack_table_t *t)
+{
+    evict(t, 0);
+}
+
+/* decode a header block and call handler for every field. The strings
+ * are only valid during the call. Returns -1 on a compression error,
+ * after which the table is out of sync with the client's.
+ */
+int hpack_decode(hpack_table_t *t,
+                 const uint8_t *in,
+                 size_t len,
+                 hpack_field_handler handler,
+                 void *arg)
+{
+    const uint8_t *p = in, *end = in + len;
+    const char *name, *value;
+    size_t name_len, value_len;
+    bool fields = false;
+    int rc = -1;
+
+    /* Huffman codes are 5 bits or longer */
+    char *scratch = malloc(len * 8 / 5 + 1), *sp = scratch;
+    if (!scratch)
+        return -1;
+
+    while (p < end) {
+        uint8_t b = *p;
+
+        if (b & 0x80) { /* indexed field */
+            if (lookup(t, decode_int(&p, end, 7), &name, &name_len, &value,
+                       &value_len) < 0)
+                goto out;
+            handler(arg, name, name_len, value, value_len);
+        } else if ((b & 0xe0) == 0x20) { /* dynamic table size update */
+            int64_t size = decode_int(&p, end, 5);
+            if (fields || size < 0 || size > HPACK_TABLE_SIZE)
+                goto out;
+            t->max_size = size;
+            evict(t, size);
+            continue;
+        } else { /* literal, with incremental indexing or without */
+            bool indexing = (b & 0xc0) == 0x40;
+            int64_t index = decode_int(&p, end, indexing ? 6 : 4);
+            if (index < 0)
+                goto out;
+            if (index > 0) {
+                if (lookup(t, index, &name, &name_len, &value, &value_len) <
+                    0)
+                    goto out;
+            } else if (decode_string(&p, end, &sp, &name, &name_len) < 0) {
+                goto out;
+            }
+            if (decode_string(&p, end, &sp, &value, &value_len) < 0)
+                goto out;
+
+            if (!indexing) {
+                handler(arg, name, name_len, value, value_len);
+            } else {
+                /* the name may be that of an entry about to be evicted */
+                char *entry = malloc(name_len + value_len + 1);
+                if (!entry)
+                    goto out;
+                memcpy(entry, name, name_len);
+                memcpy(entry + name_len, value, value_len);
+                handler(arg, entry, name_len, entry + name_len, value_len);
+                insert(t, entry, name_len, value_len);
+            }
+        }
+        fields = true;
+    }
+    rc = 0;
+
+out:
+    free(scratch);
+    return rc;
+}
+
+static size_t encode_int(uint8_t *out, uint8_t first, int n, size_t v)
+{
+    size_t mask = (1 << n) - 1, i = 0;
+
+    if (v < mask) {
+        out[0] = first | v;
+        return 1;
+    }
+    out[i++] = first | mask;
+    for (v -= mask; v >= 0x80; v >>= 7)
+        out[i++] = (v & 0x7f) | 0x80;
+    out[i++] = v;
+    return i;
+}
+
+size_t hpack_encode_indexed(uint8_t *out, int index)
+{
+    return encode_int(out, 0x80, 7, index);
+}
+
+/* a literal field without indexing, its name from the static table. The
+ * encoder never adds to the client's table, which therefore costs nothing.
+ */
+size_t hpack_encode_literal(uint8_t *out,
+                            int index,
+                            const char *value,
+                            size_t len)
+{
+    size_t n = encode_int(out, 0, 4, index);
+    n += encode_int(out + n, 0, 7, len);
+    memcpy(out + n, value, len);
+    return n + len;
+}
@@ -0,0 +1,59 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* bytes of the dynamic table a client may use, the HTTP/2 default of
+ * SETTINGS_HEADER_TABLE_SIZE. Each entry counts 32 bytes beyond its name
+ * and value, so it holds HPACK_TABLE_SIZE / 32 entries at most.
+ */
+#define HPACK_TABLE_SIZE 4096
+
+/* indices into the static table of the headers responses use */
+enum hpack_static {
+    HPACK_STATUS_200 = 8,
+    HPACK_STATUS_304 = 11,
+    HPACK_STATUS_404 = 13,
+    HPACK_STATUS = 8,
+    HPACK_CONTENT_LENGTH = 28,
+    HPACK_CONTENT_TYPE = 31,
+    HPACK_DATE = 33,
+    HPACK_ETAG = 34,
+    HPACK_LAST_MODIFIED = 44,
+    HPACK_SERVER = 54,
+};
+
+typedef struct {
+    char *name, *value; /* one allocation, value follows name */
+    size_t name_len, value_len;
+} hpack_entry_t;
+
+/* the dynamic table of a decoder, newest entry first */
+typedef struct {
+    hpack_entry_t entries[HPACK_TABLE_SIZE / 32];
+    size_t first, count; /* ring of entries */
+    size_t size, max_size;
+} hpack_table_t;
+
+typedef void (*hpack_field_handler)(void *arg,
+                                    const char *name,
+                                    size_t name_len,
+                                    const char *value,
+                                    size_t value_len);
+
+void hpack_init(hpack_table_t *t);
+void hpack_free(hpack_table_t *t);
+int hpack_decode(hpack_table_t *t,
+                 const uint8_t *in,
+                 size_t len,
+                 hpack_field_handler handler,
+                 void *arg);
+
+size_t hpack_encode_indexed(uint8_t *out, int index);
+size_t hpack_encode_literal(uint8_t *out,
+                            int index,
+                            const char *value,
+                            size_t len);
+
+#endif
@@ -1,32 +1,109 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* for preadv2(2), readahead(2) and splice(2) */
+#endif
+
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/errqueue.h>
+#include <linux/openat2.h>
+#include <linux/sockios.h>
+#include <netinet/in.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/sendfile.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include "buffer.h"
+#include "file_cache.h"
 #include "http.h"
+#include "io_pool.h"
 #include "logger.h"
+#include "router.h"
 #include "timer.h"
+#if (ENABLE_TLS)
+#include "tls.h"
+#endif
+#if (ENABLE_HTTP2)
+#include "http2.h"
+#endif
+#if (ENABLE_ACCESS_LOG)
+#include "access_log.h"
+#endif
+#if (ENABLE_PROXY)
+#include "proxy.h"
+#endif
+#if (ENABLE_UPLOAD)
+#include "upload.h"
+#endif
+#if (ENABLE_PACK)
+#include "pack.h"
+#endif
 
 #define MAXLINE 8192
-#define SHORTLINE 512
 
-#ifndef MIN
-#define MIN(a, b) ((a) < (b) ? (a) : (b))
+/* file bytes checked to be in the page cache before sendfile() gets them */
+#define IO_WINDOW (1 << 20) /* 1MB */
+
+/* how response bodies are sent. SEND_AUTO picks by where the body is and
+ * its size, the others force one way for all files, to compare them.
+ */
+enum send_backend {
+    SEND_AUTO,
+    SEND_SENDFILE, /* from the page cache, no copy */
+    SEND_SPLICE,   /* through a pipe, for files sendfile() cannot take */
+    SEND_ZEROCOPY, /* mmap() the file, send() with MSG_ZEROCOPY */
+    SEND_WRITE,    /* mmap() the file, copying write() */
+};
+
+#ifndef SEND_BACKEND
+#define SEND_BACKEND SEND_AUTO
 #endif
 
-static ssize_t writen(int fd, void *usrbuf, size_t n)
+/* smaller files go out in the same write() as the header */
+#define SEND_INLINE_MAX 4096
+
+/* bodies in memory this large are sent with MSG_ZEROCOPY. Below that, the
+ * completion notification costs more than the copy saves.
+ */
+#define ZEROCOPY_MIN (64 << 10) /* 64KB */
+
+/* read from and write to the client. Over TLS, records go through OpenSSL
+ * unless the kernel encrypts them after the handshake.
+ */
+ssize_t http_recv(http_request_t *r, void *buf, size_t len)
+{
+#if (ENABLE_TLS)
+    return tls_read(r, buf, len);
+#else
+    return read(r->fd, buf, len);
+#endif
+}
+
+ssize_t http_send(http_request_t *r, const void *buf, size_t len, int flags)
+{
+#if (ENABLE_TLS)
+    if (!r->ktls_send)
+        return tls_write(r, buf, len);
+#endif
+    return send(r->fd, buf, len, flags);
+}
+
+static ssize_t writen(http_request_t *r, void *usrbuf, size_t n)
 {
     ssize_t nwritten;
     char *bufp = usrbuf;
 
     for (size_t nleft = n; nleft > 0; nleft -= nwritten) {
-        if ((nwritten = write(fd, bufp, nleft)) <= 0) {
+        if ((nwritten = http_send(r, bufp, nleft, 0)) <= 0) {
             if (errno == EINTR) /* interrupted by sig handler return */
                 nwritten = 0;   /* and call write() again */
             else {
@@ -40,70 +117,42 @@ static ssize_t writen(int fd, void *usrbuf, size_t n)
     return n;
 }
 
-// static char *webroot = NULL;
+#if (ENABLE_ACCESS_LOG)
+/* log a response, once it is complete or cut short. A logged request
+ * forgets its URI, so that an error response to the next one, turned down
+ * before its request line is parsed, does not show it.
+ */
+static void log_request(http_request_t *r,
+                        int status,
+                        size_t bytes,
+                        size_t duration)
+{
+    int method = 0, version = 0;
+    size_t len = 0;
 
-typedef struct {
-    const char *type;
-    const char *value;
-} mime_type_t;
-
-static mime_type_t mime[] = {{".html", "text/html"},
-                             {".xml", "text/xml"},
-                             {".xhtml", "application/xhtml+xml"},
-                             {".txt", "text/plain"},
-                             {".pdf", "application/pdf"},
-                             {".png", "image/png"},
-                             {".gif", "image/gif"},
-                             {".jpg", "image/jpeg"},
-                             {".css", "text/css"},
-                             {NULL, "text/plain"}};
-
-static void parse_uri(char *uri, int uri_length, char *filename, char *webroot)
-{
-    assert(uri && "parse_uri: uri is NULL");
-    uri[uri_length] = '\0';
-
-    /* TODO: support query string, i.e.
-     *       https://example.com/over/there?name=ferret
-     * Reference: https://en.wikipedia.org/wiki/Query_string
-     */
-    char *question_mark = strchr(uri, '?');
-    int file_length;
-    if (question_mark) {
-        file_length = (int) (question_mark - uri);
-        debug("file_length = (question_mark - uri) = %d", file_length);
-    } else {
-        file_length = uri_length;
-        debug("file_length = uri_length = %d", file_length);
-    }
-
-    /* uri_length can not be too long */
-    if (uri_length > (SHORTLINE >> 1)) {
-        log_err("uri too long: %.*s", uri_length, uri);
-        return;
+    if (r->uri_start && r->uri_end) {
+        method = r->method;
+        version = r->http_major * 10 + r->http_minor;
+        len = (char *) r->uri_end - (char *) r->uri_start;
     }
-
-    strcpy(filename, webroot);
-    debug("before strncat, filename = %s, uri = %.*s, file_len = %d", filename,
-          file_length, uri, file_length);
-    strncat(filename, uri, file_length);
-
-    char *last_comp = strrchr(filename, '/');
-    char *last_dot = strrchr(last_comp, '.');
-    if (!last_dot && filename[strlen(filename) - 1] != '/')
-        strcat(filename, "/");
-
-    if (filename[strlen(filename) - 1] == '/')
-        strcat(filename, "index.html");
-
-    debug("served filename = %s", filename);
+    access_log(r->fd, method, version, r->uri_start, len, status, bytes,
+               duration);
+    r->uri_start = r->uri_end = NULL;
+    r->status = 0;
 }
+#else
+#define log_request(r, status, bytes, duration)
+#endif
 
-static void do_error(int fd,
-                     char *cause,
-                     char *errnum,
-                     char *shortmsg,
-                     char *longmsg)
+/* an error page, its header carrying the fields of headers as well, each
+ * ended by CRLF
+ */
+static void send_error(http_request_t *r,
+                       char *cause,
+                       char *errnum,
+                       char *shortmsg,
+                       char *longmsg,
+                       const char *headers)
 {
     char header[MAXLINE], body[MAXLINE];
 
@@ -115,27 +164,71 @@ static void do_error(int fd,
 
     sprintf(header,
             "HTTP/1.1 %s %s\r\n"
+            "Date: %s\r\n"
             "Server: seHTTPd\r\n"
             "Content-type: text/html\r\n"
             "Connection: close\r\n"
+            "%s"
             "Content-length: %d\r\n\r\n",
-            errnum, shortmsg, (int) strlen(body));
+            errnum, shortmsg, time_http_date(), headers, (int) strlen(body));
 
-    writen(fd, header, strlen(header));
-    writen(fd, body, strlen(body));
+    size_t header_len = strlen(header), body_len = strlen(body);
+    writen(r, header, header_len);
+    writen(r, body, body_len);
+    log_request(r, atoi(errnum), header_len + body_len, 0);
+
+    /* the connection is closed next. Closing it with unread data, such as
+     * the body of the refused request, would reset it, which can destroy
+     * the page before the client has it. Only writing ends for now, see
+     * linger().
+     */
+#if (ENABLE_TLS)
+    tls_close(r);
+#endif
+    shutdown(r->fd, SHUT_WR);
+    r->lingering = true;
+    r->read_deadline = time_msec() + TIMEOUT_LINGER;
+}
+
+/* drop what the client still sends after an error page. Returns true
+ * while it may send more, until TIMEOUT_LINGER has passed.
+ */
+static bool linger(http_request_t *r)
+{
+    char buf[4096];
+    ssize_t n;
+
+    while ((n = read(r->fd, buf, sizeof(buf))) > 0)
+        ;
+    return n < 0 && errno == EAGAIN && time_msec() < r->read_deadline;
 }
 
-static const char *get_file_type(const char *type)
+static void do_error(http_request_t *r,
+                     char *cause,
+                     char *errnum,
+                     char *shortmsg,
+                     char *longmsg)
 {
-    if (!type)
-        return "text/plain";
+    send_error(r, cause, errnum, shortmsg, longmsg, "");
+}
 
-    int i;
-    for (i = 0; mime[i].type; ++i) {
-        if (!strcmp(type, mime[i].type))
-            return mime[i].value;
+/* the Allow field naming methods, enum http_method */
+static void allow_field(int methods, char *buf)
+{
+    static const struct {
+        int method;
+        const char *name;
+    } names[] = {{HTTP_GET, "GET"}, {HTTP_HEAD, "HEAD"}, {HTTP_POST, "POST"}};
+    const char *sep = " ";
+
+    buf += sprintf(buf, "Allow:");
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (methods & names[i].method) {
+            buf += sprintf(buf, "%s%s", sep, names[i].name);
+            sep = ", ";
+        }
     }
-    return mime[i].value;
+    strcpy(buf, "\r\n");
 }
 
 static const char *get_msg_from_status(int status_code)
@@ -143,6 +236,9 @@ static const char *get_msg_from_status(int status_code)
     if (status_code == HTTP_OK)
         return "OK";
 
+    if (status_code == HTTP_CREATED)
+        return "Created";
+
     if (status_code == HTTP_NOT_MODIFIED)
         return "Not Modified";
 
@@ -152,93 +248,818 @@ static const char *get_msg_from_status(int status_code)
     return "Unknown";
 }
 
-static void serve_static(int fd,
-                         char *filename,
-                         size_t filesize,
-                         http_out_t *out)
+/* request bytes buffered beyond BUF_SIZE by all connections of a worker */
+static size_t buffered_bytes;
+
+static inline void *rebase(void *p, uintptr_t from, char *to)
+{
+    return p ? to + ((uintptr_t) p - from) : NULL;
+}
+
+/* the parser keeps pointers into the buffer, move them by to - from */
+static void rebase_request(http_request_t *r, uintptr_t from, char *to)
+{
+    r->request_start = rebase(r->request_start, from, to);
+    r->uri_start = rebase(r->uri_start, from, to);
+    r->uri_end = rebase(r->uri_end, from, to);
+    r->request_end = rebase(r->request_end, from, to);
+    r->cur_header_key_start = rebase(r->cur_header_key_start, from, to);
+    r->cur_header_key_end = rebase(r->cur_header_key_end, from, to);
+    r->cur_header_value_start = rebase(r->cur_header_value_start, from, to);
+    r->cur_header_value_end = rebase(r->cur_header_value_end, from, to);
+
+    list_head *pos;
+    list_for_each (pos, &(r->list)) {
+        http_header_t *hd = list_entry(pos, http_header_t, list);
+        hd->key_start = rebase(hd->key_start, from, to);
+        hd->key_end = rebase(hd->key_end, from, to);
+        hd->value_start = rebase(hd->value_start, from, to);
+        hd->value_end = rebase(hd->value_end, from, to);
+    }
+}
+
+static inline bool receiving_request(http_request_t *r)
+{
+    return r->pos < r->last || r->state || r->request_line_done;
+}
+
+/* give the buffer of a connection back to the pool once nothing in it is
+ * left to parse, idle keep-alive connections hold no buffer
+ */
+void http_detach_buffer(http_request_t *r)
+{
+    if (!r->buf)
+        return;
+    if (r->buf_size > BUF_SIZE)
+        __sync_sub_and_fetch(&buffered_bytes, r->buf_size - BUF_SIZE);
+    buf_put(r->buf, r->buf_size);
+    r->buf = NULL;
+    r->buf_size = 0;
+    r->pos = r->last = 0;
+}
+
+/* make room to read into a full buffer. Bytes of requests already served
+ * are dropped first, pipelined requests only move down when the buffer
+ * runs full instead of after each response. Otherwise the buffer doubles,
+ * within MAX_BUF and MAX_BUFFERED.
+ */
+bool http_make_room(http_request_t *r)
+{
+    if (!r->buf) {
+        r->buf = buf_get(BUF_SIZE);
+        if (!r->buf)
+            return false;
+        r->buf_size = BUF_SIZE;
+        r->pos = r->last = 0;
+        return true;
+    }
+
+    /* the request being parsed starts at request_start once the parser
+     * has seen its first byte
+     */
+    char *start = (r->state || r->request_line_done) ? r->request_start
+                                                     : r->buf + r->pos;
+    size_t done = start - r->buf;
+    if (done > 0) {
+        memmove(r->buf, start, r->last - done);
+        rebase_request(r, (uintptr_t) start, r->buf);
+        r->pos -= done;
+        r->last -= done;
+        return true;
+    }
+
+    size_t new_size = r->buf_size * 2;
+    size_t extra = new_size - r->buf_size;
+
+    if (new_size > MAX_BUF)
+        return false;
+    if (__sync_add_and_fetch(&buffered_bytes, extra) > MAX_BUFFERED) {
+        __sync_sub_and_fetch(&buffered_bytes, extra);
+        return false;
+    }
+
+    char *to = buf_get(new_size);
+    if (!to) {
+        __sync_sub_and_fetch(&buffered_bytes, extra);
+        return false;
+    }
+    memcpy(to, r->buf, r->last);
+    rebase_request(r, (uintptr_t) r->buf, to);
+    buf_put(r->buf, r->buf_size);
+    r->buf = to;
+    r->buf_size = new_size;
+    return true;
+}
+
+static void finish_response(http_request_t *r)
+{
+    if (r->file_fd >= 0)
+        close(r->file_fd);
+    r->file_fd = -1;
+    /* pages still queued with MSG_ZEROCOPY hold their own references */
+    if (r->body_map)
+        munmap((void *) r->body, r->body_map);
+    r->body = NULL;
+    r->body_map = 0;
+    free(r->out_buf);
+    r->out_buf = NULL;
+    r->writing = false;
+}
+
+static void free_headers(http_request_t *r)
+{
+    while (!list_empty(&(r->list))) {
+        list_head *pos = r->list.next;
+        list_del(pos);
+        free(list_entry(pos, http_header_t, list));
+    }
+}
+
+void http_release_request(http_request_t *r)
+{
+#if (ENABLE_HTTP2)
+    http2_release(r);
+#endif
+#if (ENABLE_UPLOAD)
+    upload_release(r);
+#endif
+#if (ENABLE_PROXY)
+    proxy_release(r);
+#endif
+#if (ENABLE_ACCESS_LOG)
+    /* a response cut short is logged with what the client got of it */
+    if (r->status)
+        log_request(r, r->status, r->out_sent, time_msec() - r->write_start);
+#endif
+    http_detach_buffer(r);
+    free_headers(r);
+    finish_response(r);
+}
+
+/* wake up a connection parked while an I/O thread worked for it. Writable
+ * sockets report EPOLLOUT right away, do_request() then picks up where it
+ * left off.
+ */
+static void resume_request(http_request_t *r)
+{
+    struct epoll_event event = {
+        .data.ptr = r,
+        .events = EPOLLOUT | EPOLLET | EPOLLONESHOT,
+    };
+    epoll_ctl(r->epfd, EPOLL_CTL_MOD, r->fd, &event);
+}
+
+/* open path, as http_normalize_uri() made it, below the directory root.
+ * The lookup starts there rather than at "/", and RESOLVE_BENEATH keeps
+ * symbolic links from leading out of it. nonblocking fails with EAGAIN
+ * where the lookup would miss the dentry cache. Kernels before 5.12 do
+ * not know RESOLVE_CACHED and block; before 5.6 there is only openat(),
+ * for which the normalized path stays below the root all the same.
+ */
+int http_open_file(int root, const char *path, bool nonblocking)
+{
+#if defined(SYS_openat2) && defined(RESOLVE_BENEATH)
+    static bool no_openat2 = false, no_cached = false;
+    struct open_how how = {.flags = O_RDONLY | O_CLOEXEC};
+
+    while (!no_openat2) {
+        how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+#if defined(RESOLVE_CACHED)
+        if (nonblocking && !no_cached)
+            how.resolve |= RESOLVE_CACHED;
+#endif
+        int fd = syscall(SYS_openat2, root, path + 1, &how, sizeof(how));
+        if (fd >= 0 || (errno != ENOSYS && errno != EINVAL))
+            return fd;
+#if defined(RESOLVE_CACHED)
+        if (errno == EINVAL && (how.resolve & RESOLVE_CACHED)) {
+            no_cached = true;
+            continue;
+        }
+#endif
+        no_openat2 = true;
+    }
+#else
+    (void) nonblocking;
+#endif
+    return openat(root, path + 1, O_RDONLY | O_CLOEXEC);
+}
+
+typedef struct {
+    http_request_t *r;
+    int root;
+    char filename[SHORTLINE];
+} lookup_job_t;
+
+static void lookup_path(void *arg)
+{
+    lookup_job_t *job = arg;
+    struct stat sbuf;
+
+    /* only to fill the caches */
+    fstatat(job->root, job->filename + 1, &sbuf, 0);
+    resume_request(job->r);
+    free(job);
+}
+
+/* look the path up on an I/O thread, and parse the request once more when
+ * that is done. The request is put back into the buffer as if it had not
+ * been parsed, also when -1 tells that it could not be handed over.
+ */
+static int offload_open(http_request_t *r, int root, const char *filename)
+{
+    r->pos = (char *) r->request_start - r->buf;
+    r->state = 0;
+    r->request_line_done = false;
+    free_headers(r);
+    /* the body is framed again too, or its first bytes would be taken for
+     * the header being put back
+     */
+    r->req_body = HTTP_BODY_NONE;
+    r->chunk_state = 0;
+    r->body_left = 0;
+    r->expect_continue = false;
+
+    lookup_job_t *job = malloc(sizeof(lookup_job_t));
+    if (!job)
+        return -1;
+    job->r = r;
+    job->root = root;
+    strcpy(job->filename, filename);
+
+    if (io_offload(lookup_path, job) < 0) {
+        free(job);
+        return -1;
+    }
+    return 0;
+}
+
+/* whether the next IO_WINDOW bytes of the file are in the page cache.
+ * Only their last byte is tried: pages are read ahead and evicted in runs.
+ * Where RWF_NOWAIT is not supported, sendfile() may block as it did before.
+ */
+static bool file_cached(http_request_t *r)
+{
+    size_t len = r->file_left < IO_WINDOW ? r->file_left : IO_WINDOW;
+    struct iovec iov = {.iov_base = &(char){0}, .iov_len = 1};
+
+    if (preadv2(r->file_fd, &iov, 1, r->file_off + len - 1, RWF_NOWAIT) < 0 &&
+        errno == EAGAIN)
+        return false;
+    r->file_cached = r->file_off + len;
+    return true;
+}
+
+static void read_ahead(void *arg)
+{
+    http_request_t *r = arg;
+    size_t len = r->file_left < IO_WINDOW ? r->file_left : IO_WINDOW;
+
+    readahead(r->file_fd, r->file_off, len);
+
+    /* the wait for the disk does not count against the client's rate */
+    r->write_start = time_msec();
+    r->out_sent = 0;
+    resume_request(r);
+}
+
+/* splice() file data to the socket through a pipe of the calling thread.
+ * The pipe is shared by all connections, so what the socket does not take
+ * is taken back out of it and sent again later.
+ */
+static ssize_t splice_file(http_request_t *r)
+{
+    static __thread int pipefd[2] = {-1, -1};
+    static __thread char *discard;
+    loff_t off = r->file_off;
+
+    if (pipefd[0] < 0 && pipe2(pipefd, O_NONBLOCK) < 0)
+        return -1;
+
+    ssize_t in = splice(r->file_fd, &off, pipefd[1], NULL, r->file_left,
+                        SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (in <= 0)
+        return in;
+
+    ssize_t n = splice(pipefd[0], NULL, r->fd, NULL, in,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    int err = errno;
+    ssize_t left = in - (n > 0 ? n : 0);
+    if (left > 0 && (discard || (discard = malloc(MAXLINE)))) {
+        while (left > 0) {
+            ssize_t m = read(pipefd[0], discard,
+                             left < MAXLINE ? left : MAXLINE);
+            if (m <= 0)
+                break;
+            left -= m;
+        }
+    }
+    if (left > 0) { /* the pipe cannot be used for anyone else */
+        close(pipefd[0]);
+        close(pipefd[1]);
+        pipefd[0] = pipefd[1] = -1;
+    }
+    if (n > 0)
+        r->file_off += n;
+    errno = err;
+    return n;
+}
+
+/* send from the file, by sendfile() as long as the file supports it */
+ssize_t http_send_file(http_request_t *r)
+{
+#if (ENABLE_TLS)
+    if (!r->ktls_send)
+        return tls_send_file(r);
+#endif
+    if (SEND_BACKEND != SEND_SPLICE && !r->splice_file) {
+        ssize_t n = sendfile(r->fd, r->file_fd, &r->file_off, r->file_left);
+        if (n >= 0 || (errno != EINVAL && errno != ENOSYS))
+            return n;
+        r->splice_file = true;
+    }
+    return splice_file(r);
+}
+
+/* send a body in memory, large ones without copying it into the socket */
+static ssize_t send_body(http_request_t *r)
+{
+    int flags = 0;
+
+    if (r->file_left >= ZEROCOPY_MIN && !r->zc_off &&
+        (SEND_BACKEND == SEND_AUTO || SEND_BACKEND == SEND_ZEROCOPY)) {
+        static const int one = 1;
+        if (r->zc_sent == 0 && setsockopt(r->fd, SOL_SOCKET, SO_ZEROCOPY,
+                                          &one, sizeof(one)) < 0)
+            r->zc_off = true;
+        else
+            flags = MSG_ZEROCOPY;
+    }
+
+    ssize_t n = http_send(r, r->body + r->file_off, r->file_left, flags);
+    if (n < 0 && flags && errno == ENOBUFS) /* out of option memory */
+        n = http_send(r, r->body + r->file_off, r->file_left, 0);
+    else if (n >= 0 && flags)
+        r->zc_sent++;
+    if (n > 0)
+        r->file_off += n;
+    return n;
+}
+
+/* take MSG_ZEROCOPY completions off the socket's error queue, which
+ * reports as EPOLLERR. Returns false if a real error is queued there.
+ */
+bool http_reap_zerocopy(http_request_t *r)
+{
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+    struct msghdr msg = {0};
+
+    for (;;) {
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(r->fd, &msg, MSG_ERRQUEUE) < 0)
+            return errno == EAGAIN;
+
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+        if (!cm || cm->cmsg_level != SOL_IP || cm->cmsg_type != IP_RECVERR)
+            return false;
+        struct sock_extended_err *serr = (void *) CMSG_DATA(cm);
+        if (serr->ee_errno || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+            return false;
+
+        r->zc_done += serr->ee_data - serr->ee_info + 1;
+        /* the kernel had to copy, e.g. over loopback: stop asking */
+        if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+            r->zc_off = true;
+    }
+}
+
+/* whether the client takes the response at MIN_SEND_RATE at least, once
+ * TIMEOUT_WRITE has passed. What it received is what was written less what
+ * still waits in the socket: out_sent alone runs megabytes ahead of it.
+ */
+static bool keeps_up(http_request_t *r)
+{
+    size_t elapsed = time_msec() - r->write_start;
+    int queued = 0;
+
+    if (elapsed <= TIMEOUT_WRITE)
+        return true;
+    if (ioctl(r->fd, SIOCOUTQ, &queued) < 0 || queued < 0)
+        queued = 0;
+    size_t received =
+        r->out_sent > (size_t) queued ? r->out_sent - queued : 0;
+    if (received * 1000 / elapsed >= MIN_SEND_RATE)
+        return true;
+    log_err("client too slow, %zu bytes in %zu ms", received, elapsed);
+    return false;
+}
+
+/* the timer callback of a connection. A response being written is only
+ * cut short by MIN_SEND_RATE: waiting for EPOLLOUT says little about the
+ * client, as the kernel only reports it once half of a send buffer grown
+ * to megabytes has drained.
+ */
+int http_expire(http_request_t *r)
+{
+    if (r->writing && keeps_up(r)) {
+        r->deadline = time_msec() + TIMEOUT_WRITE;
+        return 1;
+    }
+    return http_close_conn(r);
+}
+
+/* write as much of the response as the socket takes. Returns 0 once it is
+ * complete, EAGAIN when the socket is full, EINPROGRESS while an I/O thread
+ * reads the file and -1 on error. The unsent part of a header on the stack
+ * is copied, so that it survives until EPOLLOUT.
+ */
+static int write_response(http_request_t *r, const char *header)
+{
+    ssize_t n;
+
+    while (r->out_pos < r->out_len) {
+        n = http_send(r, header + r->out_pos, r->out_len - r->out_pos, 0);
+        if (n < 0)
+            goto error;
+        r->out_pos += n;
+        r->out_sent += n;
+    }
+
+    while (r->file_left > 0) {
+        if (r->body) {
+            n = send_body(r);
+        } else {
+            if (r->file_off >= r->file_cached && !file_cached(r) &&
+                io_offload(read_ahead, r) == 0) {
+                r->writing = true;
+                return EINPROGRESS;
+            }
+            n = http_send_file(r);
+        }
+        if (n < 0)
+            goto error;
+        if (n == 0) {
+            log_err("file shrank while being sent");
+            return -1;
+        }
+        r->file_left -= n;
+        r->out_sent += n;
+    }
+
+    log_request(r, r->status, r->out_sent, time_msec() - r->write_start);
+    finish_response(r);
+    return 0;
+
+error:
+    if (errno == EINTR)
+        return write_response(r, header);
+    if (errno != EAGAIN) {
+        log_err("write err, and errno = %d", errno);
+        return -1;
+    }
+
+    if (!r->out_buf && r->out_pos < r->out_len) {
+        r->out_len -= r->out_pos;
+        r->out_buf = malloc(r->out_len);
+        if (!r->out_buf)
+            return -1;
+        memcpy(r->out_buf, header + r->out_pos, r->out_len);
+        r->out_pos = 0;
+    }
+    r->writing = true;
+    return EAGAIN;
+}
+
+/* the Connection field of a response, and Keep-Alive if the connection
+ * is kept: count_request() settled that. The timeout is rounded up to
+ * whole seconds, timeout=0 would tell the client not to reuse it at all.
+ */
+size_t http_connection_fields(http_request_t *r, char *buf, size_t size)
+{
+    if (!r->keep_alive_timeout)
+        return snprintf(buf, size, "Connection: close\r\n");
+    return snprintf(buf, size,
+                    "Connection: keep-alive\r\n"
+                    "Keep-Alive: timeout=%zu, max=%d\r\n",
+                    (r->keep_alive_timeout + 999) / 1000,
+                    KEEPALIVE_REQUESTS - r->nrequests);
+}
+
+static int serve_static(http_request_t *r,
+                        char *filename,
+                        int file_fd,
+                        const file_meta_t *meta,
+                        http_out_t *out)
 {
     char header[MAXLINE];
+    size_t filesize = meta->size;
 
     const char *dot_pos = strrchr(filename, '.');
-    const char *file_type = get_file_type(dot_pos);
+    const char *file_type = http_file_type(dot_pos);
 
-    sprintf(header, "HTTP/1.1 %d %s\r\n", out->status,
-            get_msg_from_status(out->status));
+    sprintf(header, "HTTP/1.1 %d %s\r\nDate: %s\r\n", out->status,
+            get_msg_from_status(out->status), time_http_date());
 
     size_t upto = strlen(header);
 
-    if (out->keep_alive) {
-        upto += snprintf(header + upto, MAXLINE - upto,
-                         "Connection: keep-alive\r\n"
-                         "Keep-Alive: timeout=%d\r\n",
-                         TIMEOUT_DEFAULT);
-    }
+    upto += http_connection_fields(r, header + upto, MAXLINE - upto);
 
     if (out->modified) {
-        char buf[SHORTLINE];
-
         upto += snprintf(header + upto, MAXLINE - upto,
                          "Content-type: %s\r\n"
                          "Content-length: %zu\r\n",
                          file_type, filesize);
+    }
+
+    /* a 304 carries the validators too, the client updates its copy */
+    upto += snprintf(header + upto, MAXLINE - upto,
+                     "ETag: %s\r\nLast-Modified: %s\r\n", meta->etag_str,
+                     meta->last_modified);
+
+    upto += snprintf(header + upto, MAXLINE - upto, "Server: seHTTPd\r\n\r\n");
 
-        struct tm tm;
-        localtime_r(&(out->mtime), &tm);
-        strftime(buf, SHORTLINE, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    r->out_len = upto;
+    r->out_pos = 0;
+    r->file_left = 0;
+    r->write_start = time_msec();
+    r->out_sent = 0;
+    r->status = out->status;
+
+    /* a 304, or the answer to HEAD, is the header alone */
+    if (!out->modified || r->method == HTTP_HEAD) {
+        if (file_fd >= 0)
+            close(file_fd);
+        return write_response(r, header);
+    }
 
-        upto += snprintf(header + upto, MAXLINE - upto, "Last-Modified: %s\r\n",
-                         buf);
+    r->file_off = r->file_cached = 0;
+    r->file_left = filesize;
+    r->splice_file = false;
+
+    /* small files are read into the header, unless that would block */
+    if (SEND_BACKEND == SEND_AUTO && filesize <= SEND_INLINE_MAX &&
+        upto + filesize <= MAXLINE) {
+        struct iovec iov = {.iov_base = header + upto, .iov_len = filesize};
+        if (preadv2(file_fd, &iov, 1, 0, RWF_NOWAIT) == (ssize_t) filesize) {
+            close(file_fd);
+            r->out_len += filesize;
+            r->file_left = 0;
+            return write_response(r, header);
+        }
     }
 
+    if ((SEND_BACKEND == SEND_ZEROCOPY || SEND_BACKEND == SEND_WRITE) &&
+        filesize > 0) {
+        void *p = mmap(NULL, filesize, PROT_READ, MAP_SHARED, file_fd, 0);
+        if (p != MAP_FAILED) {
+            close(file_fd);
+            r->body = p;
+            r->body_map = filesize;
+            return write_response(r, header);
+        }
+    }
+
+    r->file_fd = file_fd;
+    return write_response(r, header);
+}
+
+#if (ENABLE_PACK)
+/* a file from the pack, in the variant the client takes. Its header lines
+ * were made by mkpack. A small body is copied from the mapping, a larger
+ * one sent from the pack file.
+ */
+static int serve_pack(http_request_t *r,
+                      const pack_t *pack,
+                      const pack_entry_t *e,
+                      http_out_t *out)
+{
+    char header[MAXLINE];
+    const pack_variant_t *v =
+        out->accept_gzip && e->gzip.header_len ? &e->gzip : &e->plain;
+    file_meta_t meta = {.mtime = v->mtime, .etag = v->etag};
+    int status = HTTP_OK;
+
+    if ((r->method == HTTP_GET || r->method == HTTP_HEAD) &&
+        (out->if_none_match || out->if_modified_since >= 0) &&
+        file_not_modified(&meta, out->if_none_match, out->if_none_match_len,
+                          out->if_modified_since))
+        status = HTTP_NOT_MODIFIED;
+
+    size_t upto = sprintf(header, "HTTP/1.1 %d %s\r\nDate: %s\r\n", status,
+                          get_msg_from_status(status), time_http_date());
+
+    upto += http_connection_fields(r, header + upto, MAXLINE - upto);
+
+    size_t len = status == HTTP_OK ? v->header_len : v->validators_len;
+    memcpy(header + upto, pack_data(pack, v->header), len);
+    upto += len;
     upto += snprintf(header + upto, MAXLINE - upto, "Server: seHTTPd\r\n\r\n");
 
-    size_t n = (size_t) writen(fd, header, strlen(header));
-    assert(n == upto && "writen error");
-    if (n != upto) {
-        log_err("n != strlen(header)");
-        return;
+    r->out_len = upto;
+    r->out_pos = 0;
+    r->file_left = 0;
+    r->write_start = time_msec();
+    r->out_sent = 0;
+    r->status = status;
+
+    size_t body = status == HTTP_OK && r->method != HTTP_HEAD ? v->len : 0;
+    if (body <= SEND_INLINE_MAX && upto + body <= MAXLINE) {
+        memcpy(header + upto, pack_data(pack, v->off), body);
+        r->out_len += body;
+        return write_response(r, header);
     }
 
-    if (!out->modified)
-        return;
+    r->file_fd = pack_dup(pack);
+    if (r->file_fd < 0)
+        return -1;
+    r->file_off = r->file_cached = v->off;
+    r->file_left = body;
+    r->splice_file = false;
+    return write_response(r, header);
+}
+#endif
+
+#if (ENABLE_UPLOAD)
+/* a response of a status line and header only, such as 201 to an upload */
+static int serve_status(http_request_t *r, int status)
+{
+    char header[MAXLINE];
+
+    size_t upto = sprintf(header, "HTTP/1.1 %d %s\r\nDate: %s\r\n", status,
+                          get_msg_from_status(status), time_http_date());
 
-    int srcfd = open(filename, O_RDONLY, 0);
-    assert(srcfd > 2 && "open error");
+    upto += http_connection_fields(r, header + upto, MAXLINE - upto);
+    upto += snprintf(header + upto, MAXLINE - upto,
+                     "Content-length: 0\r\nServer: seHTTPd\r\n\r\n");
 
-    sendfile(fd, srcfd, NULL, filesize);
-    close(srcfd);
+    r->out_len = upto;
+    r->out_pos = 0;
+    r->file_left = 0;
+    r->write_start = time_msec();
+    r->out_sent = 0;
+    r->status = status;
+    return write_response(r, header);
 }
+#endif
 
-static inline int init_http_out(http_out_t *o, int fd)
+/* a response whose body the handler of a route makes in memory. Returns
+ * what write_response() does, or HTTP_INTERNAL_SERVER_ERROR if the handler
+ * failed.
+ */
+static int serve_handler(http_request_t *r, const route_t *route)
 {
-    o->fd = fd;
-    o->keep_alive = false;
+    char response[2 * MAXLINE];
+    char *body = response + MAXLINE;
+    const char *type = "text/plain";
+
+    ssize_t len = route->handler(r, route->options, body, MAXLINE, &type);
+    if (len < 0)
+        return HTTP_INTERNAL_SERVER_ERROR;
+
+    size_t upto = sprintf(response, "HTTP/1.1 %d %s\r\nDate: %s\r\n", HTTP_OK,
+                          get_msg_from_status(HTTP_OK), time_http_date());
+
+    upto += http_connection_fields(r, response + upto, MAXLINE - upto);
+    upto += snprintf(response + upto, MAXLINE - upto,
+                     "Content-type: %s\r\nContent-length: %zd\r\n"
+                     "Cache-Control: no-cache\r\nServer: seHTTPd\r\n\r\n",
+                     type, len);
+
+    if (r->method != HTTP_HEAD) {
+        memmove(response + upto, body, len);
+        upto += len;
+    }
+
+    r->out_len = upto;
+    r->out_pos = 0;
+    r->file_left = 0;
+    r->write_start = time_msec();
+    r->out_sent = 0;
+    r->status = HTTP_OK;
+    return write_response(r, response);
+}
+
+/* the body of a request which is answered without it */
+static ssize_t discard_body(http_request_t *r UNUSED,
+                            const char *data UNUSED,
+                            size_t len)
+{
+    return len;
+}
+
+static inline int init_http_out(http_out_t *o, http_request_t *r)
+{
+    o->fd = r->fd;
+    /* HTTP/1.1 connections are persistent unless the client says
+     * otherwise, HTTP/1.0 ones only when it asks for it
+     */
+    o->keep_alive =
+        r->http_major > 1 || (r->http_major == 1 && r->http_minor >= 1);
+    o->keep_alive_timeout = 0;
     o->modified = true;
+    o->if_none_match = NULL;
+    o->if_none_match_len = 0;
+    o->if_modified_since = -1;
+    o->accept_gzip = false;
     o->status = 0;
+    o->upgrade_h2c = false;
+    o->h2_settings = NULL;
+    o->h2_settings_len = 0;
     return 0;
 }
 
+/* count the request on its connection and settle whether the connection
+ * is kept after the response
+ */
+static void count_request(http_request_t *r, http_out_t *out)
+{
+    r->nrequests++;
+    out->keep_alive_timeout = http_keep_alive_timeout();
+    if (r->nrequests >= KEEPALIVE_REQUESTS || !out->keep_alive_timeout)
+        out->keep_alive = false;
+
+    r->keep_alive_timeout = out->keep_alive ? out->keep_alive_timeout : 0;
+}
+
 void do_request(void *ptr)
 {
     http_request_t *r = ptr;
-    int fd = r->fd;
     int rc;
     char filename[SHORTLINE];
-    char *webroot = r->root;
+    struct epoll_event event = {.data.ptr = ptr};
+    bool blocking_open = false;
+
+#if (ENABLE_TLS)
+    /* the handshake comes first, within the header deadline */
+    if (!r->tls_ready) {
+        rc = tls_handshake(r);
+        if (rc < 0)
+            goto close;
+        if (rc) {
+            event.events = rc | EPOLLET | EPOLLONESHOT;
+            timer_set_deadline(r, r->read_deadline);
+            epoll_ctl(r->epfd, EPOLL_CTL_MOD, r->fd, &event);
+            return;
+        }
+    }
+#endif
+
+    if (r->lingering)
+        goto close;
+
+#if (ENABLE_HTTP2)
+    if (r->h2) {
+        http2_do_request(r);
+        return;
+    }
+#endif
+
+#if (ENABLE_PROXY)
+    if (r->proxy) {
+        rc = proxy_do_request(r);
+        goto proxied;
+    }
+#endif
+
+#if (ENABLE_UPLOAD)
+    if (r->upload) {
+        rc = upload_do_request(r);
+        goto uploaded;
+    }
+#endif
+
+    /* woken up by EPOLLOUT to go on with a response */
+    if (r->writing) {
+        if (!keeps_up(r))
+            goto close;
+        rc = write_response(r, r->out_buf);
+        goto written;
+    }
+
+    /* the body of a request already answered is still coming in */
+    if (r->req_body)
+        goto discard;
+
+    /* a request put back by offload_open() is parsed again first */
+    if (r->pos < r->last)
+        goto do_parse;
 
-    del_timer(r);
     for (;;) {
-        char *plast;
-        size_t remain_size;
         int n;
 
     do_read:
-        plast = &r->buf[r->last];
-        remain_size =
-            MIN(r->buf_size - (r->last - r->pos) - 1, r->buf_size - r->last);
+        if (r->last == r->buf_size && !http_make_room(r)) {
+            if (r->buf_size == MAX_BUF)
+                do_error(r, "request", "431", "Request Header Fields Too Large",
+                         "The request header is too large");
+            else
+                do_error(r, "request", "503", "Service Unavailable",
+                         "Too many requests are being received");
+            goto close;
+        }
 
-        n = read(fd, plast, remain_size);
-        assert(r->last - r->pos < MAX_BUF && "request buffer overflow!");
+        n = http_recv(r, &r->buf[r->last], r->buf_size - r->last);
 
         if (n == 0) /* EOF */
             goto err;
@@ -248,27 +1069,45 @@ void do_request(void *ptr)
                 log_err("read err, and errno = %d", errno);
                 goto err;
             }
+            if (!receiving_request(r))
+                http_detach_buffer(r);
             break;
         }
 
-        r->last += n;
-        assert(r->last - r->pos < MAX_BUF && "request buffer overflow!");
+        /* the first bytes of a request start its header deadline */
+        if (r->idle) {
+            r->idle = false;
+            r->read_deadline = time_msec() + TIMEOUT_HEADER;
+        }
 
-        if (r->last == r->buf_size) {
-            r->buf_size *= 2;
-            if (r->buf_size > MAX_BUF)
-                r->buf_size = MAX_BUF;
-            r->buf = (char *) realloc(r->buf, r->buf_size);
+        r->last += n;
+        if (r->last == r->buf_size)
             goto do_read;
+
+    do_parse:
+#if (ENABLE_HTTP2)
+        /* clients which know the server speaks HTTP/2 start right away */
+        if (!r->nrequests && !r->state && !r->request_line_done && !r->tls) {
+            rc = http2_preface(r);
+            if (rc == EAGAIN)
+                continue;
+            if (rc == 0) {
+                http2_do_request(r);
+                return;
+            }
         }
+#endif
 
-        /* about to parse request line */
-        rc = http_parse_request_line(r);
-        if (rc == EAGAIN)
-            continue;
-        if (rc != 0) {
-            log_err("rc != 0");
-            goto err;
+        /* about to parse request line, unless an earlier read completed it */
+        if (!r->request_line_done) {
+            rc = http_parse_request_line(r);
+            if (rc == EAGAIN)
+                continue;
+            if (rc != 0) {
+                log_err("rc != 0");
+                goto err;
+            }
+            r->request_line_done = true;
         }
 
         debug("uri = %.*s", (int) (r->uri_end - r->uri_start),
@@ -281,6 +1120,19 @@ void do_request(void *ptr)
             log_err("rc != 0");
             goto err;
         }
+        r->request_line_done = false;
+
+        rc = http_body_init(r);
+        if (rc == HTTP_NOT_IMPLEMENTED) {
+            do_error(r, "request", "501", "Not Implemented",
+                     "The transfer coding is not supported");
+            goto close;
+        }
+        if (rc != 0) {
+            do_error(r, "request", "400", "Bad Request",
+                     "The length of the request body is unclear");
+            goto close;
+        }
 
         /* handle http header */
         http_out_t *out = malloc(sizeof(http_out_t));
@@ -289,55 +1141,284 @@ void do_request(void *ptr)
             exit(1);
         }
 
-        init_http_out(out, fd);
-
-        parse_uri(r->uri_start, r->uri_end - r->uri_start, filename, webroot);
+        init_http_out(out, r);
+
+        /* the route of the path tells what answers the request. Its dot
+         * segments and escapes are resolved first, as for finding a file,
+         * so that a route is reached by every spelling of its paths and
+         * by no other.
+         */
+        ssize_t path_len = http_normalize_path(
+            r->uri_start, (char *) r->uri_end - (char *) r->uri_start,
+            filename, sizeof(filename));
+        if (path_len < 0) {
+            do_error(r, "request", "400", "Bad Request",
+                     "The URI is malformed or leaves the web root");
+            free(out);
+            goto close;
+        }
+        const route_t *route = router_match(filename, path_len);
+        if (!route || !router_allows(route, r->fd)) {
+            do_error(r, "request", "404", "Not Found",
+                     "Nothing is served here");
+            free(out);
+            goto close;
+        }
+        if (route->methods && !(route->methods & r->method)) {
+            char allow[32];
+            allow_field(route->methods, allow);
+            send_error(r, "request", "405", "Method Not Allowed",
+                       "The method is not allowed for the URI", allow);
+            free(out);
+            goto close;
+        }
 
-        struct stat sbuf;
-        if (stat(filename, &sbuf) < 0) {
-            do_error(fd, filename, "404", "Not Found", "Can't find the file");
-            continue;
+        if (route->type == ROUTE_HANDLER) {
+            http_handle_header(r, out);
+            if (r->expect_continue)
+                out->keep_alive = false;
+            count_request(r, out);
+            rc = serve_handler(r, route);
+            free(out);
+            if (rc == HTTP_INTERNAL_SERVER_ERROR) {
+                do_error(r, "handler", "500", "Internal Server Error",
+                         "The response cannot be made");
+                goto close;
+            }
+            goto written;
         }
 
-        if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) {
-            do_error(fd, filename, "403", "Forbidden", "Can't read the file");
-            continue;
+#if (ENABLE_PROXY)
+        /* the request is answered by an upstream server */
+        if (route->type == ROUTE_PROXY) {
+            rc = proxy_start(r); /* before the header list is consumed */
+            http_handle_header(r, out);
+            count_request(r, out);
+            free(out);
+            if (rc == 0)
+                rc = proxy_do_request(r);
+
+        proxied:
+            if (rc == HTTP_BAD_GATEWAY) {
+                do_error(r, "upstream", "502", "Bad Gateway",
+                         "The upstream server did not answer");
+                goto close;
+            }
+#if (ENABLE_ACCESS_LOG)
+            if (rc == 0)
+                log_request(r, r->status, r->out_sent,
+                            time_msec() - r->write_start);
+#endif
+            goto written;
         }
+#endif
 
-        out->mtime = sbuf.st_mtime;
+#if (ENABLE_UPLOAD)
+        /* POST requests store their body as a file */
+        if (route->type == ROUTE_UPLOAD) {
+            rc = upload_start(r, filename, path_len);
+            http_handle_header(r, out);
+            count_request(r, out);
+            free(out);
+            if (rc == 0)
+                rc = upload_do_request(r);
+
+        uploaded:
+            switch (rc) {
+            case EINPROGRESS:
+                return;
+            case HTTP_CREATED:
+                rc = serve_status(r, HTTP_CREATED);
+                goto written;
+            case HTTP_BAD_REQUEST:
+                do_error(r, "upload", "400", "Bad Request",
+                         "The file name or the request body is malformed");
+                break;
+            case HTTP_CONFLICT:
+                do_error(r, "upload", "409", "Conflict",
+                         "The file exists already");
+                break;
+            case HTTP_PAYLOAD_TOO_LARGE:
+                do_error(r, "upload", "413", "Payload Too Large",
+                         "The file is too large");
+                break;
+            case HTTP_INTERNAL_SERVER_ERROR:
+                do_error(r, "upload", "500", "Internal Server Error",
+                         "The file cannot be stored");
+                break;
+            }
+            goto close;
+        }
+#endif
 
+        /* filename is the path of the file below the route's directory */
+        if (http_index_path(filename, path_len, sizeof(filename)) < 0) {
+            do_error(r, "request", "400", "Bad Request",
+                     "The URI is malformed or leaves the web root");
+            free(out);
+            goto close;
+        }
         http_handle_header(r, out);
         assert(list_empty(&(r->list)) && "header list should be empty");
 
+#if (ENABLE_PACK)
+        /* files in the pack are served from it, without a look at the
+         * file system
+         */
+        const route_static_t *dir = route->options;
+        pack_t *pack = dir->pack ? pack_acquire() : NULL;
+        const pack_entry_t *packed =
+            pack ? pack_lookup(pack, filename, strlen(filename)) : NULL;
+        if (packed) {
+            if (r->expect_continue)
+                out->keep_alive = false;
+            count_request(r, out);
+            rc = serve_pack(r, pack, packed, out);
+            pack_release(pack);
+            free(out);
+            goto written;
+        }
+        if (pack)
+            pack_release(pack);
+#endif
+
+        /* a client revalidating a file looked at lately is answered from
+         * what was learned about it then, without opening it
+         */
+        file_meta_t meta;
+        int file_fd = -1;
+        bool conditional =
+            (r->method == HTTP_GET || r->method == HTTP_HEAD) &&
+            (out->if_none_match || out->if_modified_since >= 0);
+        if (conditional && file_cache_get(route->root, filename, &meta) &&
+            file_not_modified(&meta, out->if_none_match,
+                              out->if_none_match_len, out->if_modified_since))
+            goto not_modified;
+
+        /* error responses announce "Connection: close", so close it */
+        file_fd = http_open_file(route->root, filename, !blocking_open);
+        blocking_open = false;
+        if (file_fd < 0 && errno == EAGAIN) {
+            free(out);
+            if (offload_open(r, route->root, filename) == 0)
+                return;
+            /* no I/O thread to take it, look it up here after all */
+            blocking_open = true;
+            goto do_parse;
+        }
+        if (file_fd < 0 && errno == ENOENT) {
+            do_error(r, filename, "404", "Not Found", "Can't find the file");
+            free(out);
+            goto close;
+        }
+
+        struct stat sbuf;
+        if (file_fd < 0 || fstat(file_fd, &sbuf) < 0 ||
+            !(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) {
+            do_error(r, filename, "403", "Forbidden", "Can't read the file");
+            if (file_fd >= 0)
+                close(file_fd);
+            free(out);
+            goto close;
+        }
+
+        file_meta_init(&meta, &sbuf);
+        file_cache_put(route->root, filename, &meta);
+        if (conditional &&
+            file_not_modified(&meta, out->if_none_match,
+                              out->if_none_match_len, out->if_modified_since)) {
+            close(file_fd);
+            file_fd = -1;
+        not_modified:
+            out->modified = false;
+            out->status = HTTP_NOT_MODIFIED;
+        }
+
+#if (ENABLE_HTTP2)
+        /* h2c is HTTP/2 over cleartext only. This response goes out as
+         * the first stream.
+         */
+        if (out->upgrade_h2c && out->h2_settings && !r->req_body && !r->tls &&
+            http2_upgrade(r, out->h2_settings, out->h2_settings_len) == 0) {
+            if (file_fd >= 0)
+                close(file_fd);
+            free(out);
+            http2_do_request(r);
+            return;
+        }
+#endif
+
         if (!out->status)
             out->status = HTTP_OK;
 
-        serve_static(fd, filename, sbuf.st_size, out);
+        /* a client waiting for 100 Continue never sends the body, and the
+         * connection cannot carry another request
+         */
+        if (r->expect_continue)
+            out->keep_alive = false;
 
-        if (!out->keep_alive) {
+        count_request(r, out);
+        rc = serve_static(r, filename, file_fd, &meta, out);
+        free(out);
+
+    written:
+        if (rc == EINPROGRESS) /* read_ahead() resumes it */
+            return;
+        if (rc == EAGAIN)
+            goto wait_write;
+        if (rc != 0)
+            goto err;
+
+    discard:
+        /* also before closing: unread data would turn the close into a
+         * reset, which can destroy the response before the client has it
+         */
+        if (r->req_body && !r->expect_continue) {
+            rc = http_read_body(r, discard_body);
+            if (rc == EAGAIN) {
+                r->read_deadline = time_msec() + TIMEOUT_BODY;
+                break;
+            }
+            if (rc != 0)
+                goto close;
+        }
+
+        if (!r->keep_alive_timeout) {
             debug("no keep_alive! ready to close");
-            free(out);
             goto close;
-        } else {
-            r->last = 0;
-            r->pos = 0;
         }
-        free(out);
+
+        /* pipelined requests may already be buffered behind this one */
+        if (r->pos < r->last) {
+            r->read_deadline = time_msec() + TIMEOUT_HEADER;
+            goto do_parse;
+        }
+        http_detach_buffer(r);
+        r->idle = true;
+        r->read_deadline = time_msec() + r->keep_alive_timeout;
     }
 
-    struct epoll_event event = {
-        .data.ptr = ptr,
-        .events = EPOLLIN | EPOLLET | EPOLLONESHOT,
-    };
-    add_timer(r, TIMEOUT_DEFAULT, http_close_conn);
+    event.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
+    timer_set_deadline(r, r->read_deadline);
     epoll_ctl(r->epfd, EPOLL_CTL_MOD, r->fd, &event);
+    return;
 
-    // add_timer(r, TIMEOUT_DEFAULT, http_close_conn);
+wait_write:
+    /* the client has to keep reading, see MIN_SEND_RATE */
+    event.events = EPOLLOUT | EPOLLET | EPOLLONESHOT;
+    timer_set_deadline(r, time_msec() + TIMEOUT_WRITE);
+    epoll_ctl(r->epfd, EPOLL_CTL_MOD, r->fd, &event);
     return;
 
 err:
 close:
-    /* TODO: handle the timeout raised by inactive connections */
+    if (r->lingering && linger(r)) {
+        event.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
+        timer_set_deadline(r, r->read_deadline);
+        epoll_ctl(r->epfd, EPOLL_CTL_MOD, r->fd, &event);
+        return;
+    }
+    del_timer(r);
     rc = http_close_conn(r);
     assert(rc == 0 && "do_request: http_close_conn");
 }
@@ -3,6 +3,8 @@
 
 #include <errno.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
 #include <time.h>
 
 #include "list.h"
@@ -10,7 +12,8 @@
 enum http_parser_retcode {
     HTTP_PARSER_INVALID_METHOD = 10,
     HTTP_PARSER_INVALID_REQUEST,
-    HTTP_PARSER_INVALID_HEADER
+    HTTP_PARSER_INVALID_HEADER,
+    HTTP_PARSER_INVALID_CHUNK
 };
 
 enum http_method {
@@ -22,42 +25,126 @@ enum http_method {
 
 enum http_status {
     HTTP_OK = 200,
+    HTTP_CREATED = 201,
     HTTP_NOT_MODIFIED = 304,
+    HTTP_BAD_REQUEST = 400,
     HTTP_NOT_FOUND = 404,
+    HTTP_METHOD_NOT_ALLOWED = 405,
+    HTTP_CONFLICT = 409,
+    HTTP_PAYLOAD_TOO_LARGE = 413,
+    HTTP_INTERNAL_SERVER_ERROR = 500,
+    HTTP_NOT_IMPLEMENTED = 501,
+    HTTP_BAD_GATEWAY = 502,
+};
+
+/* how the body of a request is framed, if it has one */
+enum http_request_body {
+    HTTP_BODY_NONE = 0,
+    HTTP_BODY_LENGTH,  /* Content-Length */
+    HTTP_BODY_CHUNKED, /* Transfer-Encoding: chunked */
 };
 
 #define MAX_BUF 8388608 /* 8MB */
 #define BUF_SIZE 8192
 
+/* request bytes all connections of a worker may buffer beyond BUF_SIZE */
+#define MAX_BUFFERED (64 << 20) /* 64MB */
+
+/* connections of a worker, idle keep-alive ones are closed sooner and
+ * sooner as their number approaches it
+ */
+#define MAX_CONNECTIONS 8192
+
+/* file names, a request URI is at most half of it */
+#define SHORTLINE 512
+
+#define KEEPALIVE_REQUESTS 1000 /* requests per connection */
+
+#define CACHE_LINE_SIZE 64
+
+/* the fields every event touches come first and fill exactly one cache
+ * line, the ones only used while parsing a request or writing a response
+ * follow
+ */
 typedef struct {
-    void *root;
+    /* hot: read on every event */
     int fd;
-    int epfd;
-    char *buf; /* ring buffer */
-    size_t buf_size;
+    int state; /* of the parser */
+    char *buf; /* only attached while a request is being received */
     size_t pos, last;
-    int state;
+    size_t buf_size;
+    void *timer;
+    size_t deadline; /* ms, or TIMER_ACTIVE while being served */
+    int epfd;
+    bool request_line_done; /* the header is parsed by a later read */
+    bool idle;              /* between keep-alive requests */
+    bool writing;           /* response resumed on EPOLLOUT */
+    bool lingering;         /* an error page is out, the connection closes */
+
+    /* cold: once per request */
+    size_t read_deadline;      /* ms, for the request being received */
+    size_t keep_alive_timeout; /* ms, 0 to close after the response */
+    int nrequests;             /* served on this connection */
+    bool tls_ready;            /* TLS handshake done */
+    bool ktls_send;            /* the kernel encrypts what is written */
+    void *tls;    /* SSL of the connection, built with ENABLE_TLS */
+    void *h2;     /* HTTP/2 state, once the connection switched to it */
+    void *proxy;  /* request being forwarded to an upstream, if any */
+    void *upload; /* request body being stored, built with ENABLE_UPLOAD */
+
+    /* parser scratch, pointing into buf */
     void *request_start;
     int method;
     void *uri_start, *uri_end;
     int http_major, http_minor;
     void *request_end;
-
     struct list_head list; /* store http header */
     void *cur_header_key_start, *cur_header_key_end;
     void *cur_header_value_start, *cur_header_value_end;
 
-    void *timer;
-} http_request_t;
+    /* request body still to be read, see http_read_body() */
+    int req_body;         /* enum http_request_body */
+    int chunk_state;      /* of the chunked decoder */
+    size_t body_left;     /* of the body, or of the current chunk */
+    size_t body_start;    /* where body bytes are read into buf */
+    bool expect_continue; /* 100 Continue is due before reading it */
+
+    /* response still being written */
+    char *out_buf; /* unsent part of the response header */
+    size_t out_len, out_pos;
+    int file_fd;
+    const char *body; /* or the body is in memory, sent from file_off */
+    size_t body_map;  /* length of the mapping of body to unmap, if any */
+    off_t file_off;
+    off_t file_cached; /* in the page cache up to here */
+    size_t file_left;
+    bool splice_file; /* the file cannot be sendfile()'d */
+    bool zc_off;      /* MSG_ZEROCOPY would be copied anyway */
+    unsigned int zc_sent, zc_done; /* MSG_ZEROCOPY sends, completions */
+    size_t write_start, out_sent; /* to enforce MIN_SEND_RATE */
+    int status; /* of the response, until it is in the access log */
+} __attribute__((aligned(CACHE_LINE_SIZE))) http_request_t;
+
+_Static_assert(offsetof(http_request_t, fd) == 0 &&
+                   offsetof(http_request_t, state) == sizeof(int),
+               "fd and state lead http_request_t");
+_Static_assert(offsetof(http_request_t, writing) < CACHE_LINE_SIZE &&
+                   offsetof(http_request_t, read_deadline) == CACHE_LINE_SIZE,
+               "the hot fields of http_request_t fill its first cache line");
 
 typedef struct {
     int fd;
     bool keep_alive;
-    time_t mtime;  /* the modified time of the file */
-    bool modified; /* compare If-modified-since field with mtime to decide
-                    * whether the file is modified since last time
-                    */
+    size_t keep_alive_timeout; /* ms */
+    bool modified;           /* false to answer 304 Not Modified */
+    char *if_none_match;     /* If-None-Match, NULL if not given */
+    int if_none_match_len;
+    time_t if_modified_since; /* If-Modified-Since, -1 if not given */
+    bool accept_gzip;         /* Accept-Encoding allows gzip */
     int status;
+    bool upgrade_h2c;  /* Upgrade: h2c */
+    char *h2_settings; /* HTTP2-Settings, base64url */
+    int h2_settings_len;
 } http_out_t;
 
 typedef struct {
@@ -78,19 +165,53 @@ typedef struct {
 
 void http_handle_header(http_request_t *r, http_out_t *o);
 int http_close_conn(http_request_t *r);
-
-static inline void init_http_request(http_request_t *r,
-                                     int fd,
-                                     int epfd,
-                                     char *root)
+int http_expire(http_request_t *r);
+bool http_reap_zerocopy(http_request_t *r);
+size_t http_keep_alive_timeout();
+size_t http_connection_fields(http_request_t *r, char *buf, size_t size);
+
+/* shared with the HTTP/2 framing in http2.c */
+bool http_make_room(http_request_t *r);
+void http_detach_buffer(http_request_t *r);
+ssize_t http_recv(http_request_t *r, void *buf, size_t len);
+ssize_t http_send(http_request_t *r, const void *buf, size_t len, int flags);
+ssize_t http_send_file(http_request_t *r);
+int http_open_file(int root, const char *path, bool nonblocking);
+const char *http_file_type(const char *type);
+
+extern size_t http_conns;
+void http_release_request(http_request_t *r);
+
+static inline void init_http_request(http_request_t *r, int fd, int epfd)
 {
     r->fd = fd, r->epfd = epfd;
     r->pos = r->last = 0;
     r->state = 0;
-    r->root = root;
+    r->request_line_done = false;
+    r->deadline = r->read_deadline = 0;
+    r->idle = false;
+    r->nrequests = 0;
+    r->writing = false;
+    r->lingering = false;
+    r->keep_alive_timeout = 0;
+    r->out_buf = NULL;
+    r->file_fd = -1;
+    r->body = NULL;
+    r->body_map = 0;
+    r->zc_off = false;
+    r->zc_sent = r->zc_done = 0;
+    r->uri_start = r->uri_end = NULL;
+    r->status = 0;
+    r->tls = NULL;
+    r->h2 = NULL;
+    r->proxy = NULL;
+    r->upload = NULL;
+    r->req_body = HTTP_BODY_NONE;
+    r->expect_continue = false;
+    r->tls_ready = r->ktls_send = false;
     INIT_LIST_HEAD(&(r->list));
-    r->buf_size = BUF_SIZE;
-    r->buf = (char *) malloc(r->buf_size);
+    r->buf = NULL;
+    r->buf_size = 0;
 }
 
 /* TODO: public functions should have conventions to prefix http_ */
@@ -98,5 +219,27 @@ void do_request(void *infd);
 
 int http_parse_request_line(http_request_t *r);
 int http_parse_request_body(http_request_t *r);
+int http_parse_chunked(http_request_t *r);
+time_t http_parse_date(const char *s, size_t len);
+ssize_t http_normalize_path(const char *uri,
+                            size_t len,
+                            char *path,
+                            size_t size);
+ssize_t http_index_path(char *path, size_t len, size_t size);
+ssize_t http_normalize_uri(const char *uri,
+                           size_t len,
+                           char *path,
+                           size_t size);
+
+/* takes len bytes of a request body, in the order they came. Returns how
+ * many it took, 0 when it cannot take any for now, or -1 on error.
+ */
+typedef ssize_t (*http_body_handler)(http_request_t *r,
+                                     const char *data,
+                                     size_t len);
+
+int http_body_init(http_request_t *r);
+int http_read_body(http_request_t *r, http_body_handler handler);
+int http_read_body_to_file(http_request_t *r, int fd, size_t *room);
 
 #endif
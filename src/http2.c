@@ -0,0 +1,1059 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "file_cache.h"
+#include "hpack.h"
+#include "http2.h"
+#include "logger.h"
+#include "router.h"
+#include "timer.h"
+#if (ENABLE_PACK)
+#include "pack.h"
+#endif
+#if (ENABLE_ACCESS_LOG)
+#include "access_log.h"
+#endif
+
+#define PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define PREFACE_LEN (sizeof(PREFACE) - 1)
+
+#define FRAME_HEADER 9
+#define DEFAULT_WINDOW 65535
+#define MAX_WINDOW 0x7fffffff
+#define DEFAULT_FRAME_SIZE 16384
+#define MAX_FRAME_SIZE 16777215
+
+/* output buffer to start with, it grows up to H2_OUT_MAX */
+#define OUT_SIZE 16384
+
+enum h2_frame {
+    H2_DATA,
+    H2_HEADERS,
+    H2_PRIORITY,
+    H2_RST_STREAM,
+    H2_SETTINGS,
+    H2_PUSH_PROMISE,
+    H2_PING,
+    H2_GOAWAY,
+    H2_WINDOW_UPDATE,
+    H2_CONTINUATION,
+};
+
+enum h2_flag {
+    H2_END_STREAM = 0x1,
+    H2_ACK = 0x1,
+    H2_END_HEADERS = 0x4,
+    H2_PADDED = 0x8,
+    H2_PRIORITY_FLAG = 0x20,
+};
+
+enum h2_setting {
+    H2_HEADER_TABLE_SIZE = 1,
+    H2_ENABLE_PUSH,
+    H2_MAX_CONCURRENT_STREAMS,
+    H2_INITIAL_WINDOW_SIZE,
+    H2_MAX_FRAME_SIZE,
+};
+
+enum h2_error {
+    H2_NO_ERROR,
+    H2_PROTOCOL_ERROR,
+    H2_INTERNAL_ERROR,
+    H2_FLOW_CONTROL_ERROR,
+    H2_FRAME_SIZE_ERROR = 6,
+    H2_REFUSED_STREAM,
+    H2_COMPRESSION_ERROR = 9,
+    H2_ENHANCE_YOUR_CALM = 11,
+};
+
+/* a response with DATA still to send */
+typedef struct {
+    list_head list;
+    uint32_t id;
+    int fd; /* the file served */
+    off_t off;
+    size_t left;
+    int64_t window; /* negative when the client shrank it */
+} h2_stream_t;
+
+typedef struct {
+    hpack_table_t hpack;
+    list_head streams; /* served in turn */
+    int nstreams;
+    uint32_t last_id;    /* of the streams opened by the client */
+    int64_t window;      /* of the connection */
+    int64_t init_window; /* of new streams, SETTINGS_INITIAL_WINDOW_SIZE */
+    size_t max_frame;    /* SETTINGS_MAX_FRAME_SIZE of the client */
+    bool preface;        /* the client preface was received */
+    bool goaway;         /* the client opens no more streams */
+    bool closing;        /* after the GOAWAY queued */
+
+    /* a header block continued in CONTINUATION frames */
+    uint8_t *block;
+    size_t block_len;
+    uint32_t block_id;
+    bool block_trailer; /* the trailer of a request, not a new one */
+
+    /* frames to write. The payload in r->file_* of stream sending goes
+     * out between out[payload_at - 1] and out[payload_at].
+     */
+    uint8_t *out;
+    size_t out_pos, out_len, out_size;
+    size_t payload_at;
+    h2_stream_t *sending;
+} h2_conn_t;
+
+/* what a request asks for, copied out of its header block */
+typedef struct {
+    int method;
+    char path[SHORTLINE >> 1];
+    size_t path_len; /* 0 if missing or too long */
+    char if_none_match[128];
+    int if_none_match_len;    /* -1 if missing or too long */
+    time_t if_modified_since; /* -1 if missing */
+} h2_request_t;
+
+static inline uint32_t get_be32(const uint8_t *p)
+{
+    return (uint32_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static inline void put_be32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24, p[1] = v >> 16, p[2] = v >> 8, p[3] = v;
+}
+
+static void frame_header(uint8_t *p,
+                         size_t len,
+                         int type,
+                         int flags,
+                         uint32_t id)
+{
+    p[0] = len >> 16, p[1] = len >> 8, p[2] = len;
+    p[3] = type;
+    p[4] = flags;
+    put_be32(p + 5, id);
+}
+
+/* room for len more bytes of output, NULL beyond H2_OUT_MAX */
+static uint8_t *reserve(h2_conn_t *c, size_t len)
+{
+    if (c->out_len + len <= c->out_size)
+        return c->out + c->out_len;
+
+    if (c->out_pos > 0) {
+        memmove(c->out, c->out + c->out_pos, c->out_len - c->out_pos);
+        c->out_len -= c->out_pos;
+        if (c->payload_at)
+            c->payload_at -= c->out_pos;
+        c->out_pos = 0;
+    }
+
+    size_t size = c->out_size ? c->out_size : OUT_SIZE;
+    while (size < c->out_len + len)
+        size *= 2;
+    if (size > H2_OUT_MAX)
+        return NULL;
+    if (size > c->out_size) {
+        uint8_t *out = realloc(c->out, size);
+        if (!out)
+            return NULL;
+        c->out = out;
+        c->out_size = size;
+    }
+    return c->out + c->out_len;
+}
+
+static int queue_frame(h2_conn_t *c,
+                       int type,
+                       int flags,
+                       uint32_t id,
+                       const void *payload,
+                       size_t len)
+{
+    uint8_t *p = reserve(c, FRAME_HEADER + len);
+    if (!p)
+        return -1;
+    frame_header(p, len, type, flags, id);
+    if (len)
+        memcpy(p + FRAME_HEADER, payload, len);
+    c->out_len += FRAME_HEADER + len;
+    return 0;
+}
+
+static int queue_u32(h2_conn_t *c, int type, uint32_t id, uint32_t v)
+{
+    uint8_t payload[4];
+    put_be32(payload, v);
+    return queue_frame(c, type, 0, id, payload, sizeof(payload));
+}
+
+/* a connection error: nothing more is read, the GOAWAY is written if the
+ * socket takes it, and the connection closed
+ */
+static int goaway(h2_conn_t *c, uint32_t error)
+{
+    uint8_t payload[8];
+
+    put_be32(payload, c->last_id);
+    put_be32(payload + 4, error);
+    queue_frame(c, H2_GOAWAY, 0, 0, payload, sizeof(payload));
+    c->closing = true;
+    return -1;
+}
+
+static void free_stream(h2_conn_t *c, h2_stream_t *s)
+{
+    list_del(&s->list);
+    close(s->fd);
+    free(s);
+    c->nstreams--;
+}
+
+static h2_stream_t *find_stream(h2_conn_t *c, uint32_t id)
+{
+    list_head *pos;
+    list_for_each (pos, &c->streams) {
+        h2_stream_t *s = list_entry(pos, h2_stream_t, list);
+        if (s->id == id)
+            return s;
+    }
+    return NULL;
+}
+
+/* a stream reset by the client, or by the server */
+static void reset_stream(h2_conn_t *c, uint32_t id)
+{
+    h2_stream_t *s = find_stream(c, id);
+    if (!s)
+        return;
+    /* a payload is never cut short, its frame header announced it */
+    if (s == c->sending)
+        s->left = 0;
+    else
+        free_stream(c, s);
+}
+
+static int queue_settings(h2_conn_t *c)
+{
+    uint8_t payload[6];
+
+    payload[0] = 0, payload[1] = H2_MAX_CONCURRENT_STREAMS;
+    put_be32(payload + 2, H2_MAX_STREAMS);
+    return queue_frame(c, H2_SETTINGS, 0, 0, payload, sizeof(payload));
+}
+
+/* returns an error code for the connection, or 0 */
+static int apply_settings(h2_conn_t *c, const uint8_t *p, size_t len)
+{
+    if (len % 6)
+        return H2_FRAME_SIZE_ERROR;
+
+    for (; len > 0; p += 6, len -= 6) {
+        uint32_t v = get_be32(p + 2);
+
+        switch (p[0] << 8 | p[1]) {
+        case H2_ENABLE_PUSH:
+            if (v > 1)
+                return H2_PROTOCOL_ERROR;
+            break;
+        case H2_INITIAL_WINDOW_SIZE: {
+            if (v > MAX_WINDOW)
+                return H2_FLOW_CONTROL_ERROR;
+            /* the windows of open streams change by as much */
+            list_head *pos;
+            list_for_each (pos, &c->streams) {
+                h2_stream_t *s = list_entry(pos, h2_stream_t, list);
+                s->window += (int64_t) v - c->init_window;
+            }
+            c->init_window = v;
+            break;
+        }
+        case H2_MAX_FRAME_SIZE:
+            if (v < DEFAULT_FRAME_SIZE || v > MAX_FRAME_SIZE)
+                return H2_PROTOCOL_ERROR;
+            c->max_frame = v;
+            break;
+        default: /* the encoder never uses the client's dynamic table */
+            break;
+        }
+    }
+    return 0;
+}
+
+static void request_field(void *arg,
+                          const char *name,
+                          size_t name_len,
+                          const char *value,
+                          size_t value_len)
+{
+    h2_request_t *q = arg;
+
+    if (name_len == 7 && !memcmp(name, ":method", 7)) {
+        if (value_len == 3 && !memcmp(value, "GET", 3))
+            q->method = HTTP_GET;
+        else if (value_len == 4 && !memcmp(value, "HEAD", 4))
+            q->method = HTTP_HEAD;
+        else
+            q->method = HTTP_UNKNOWN;
+    } else if (name_len == 5 && !memcmp(name, ":path", 5)) {
+        q->path_len = value_len < sizeof(q->path) ? value_len : 0;
+        memcpy(q->path, value, q->path_len);
+    } else if (name_len == 13 && !memcmp(name, "if-none-match", 13) &&
+               value_len <= sizeof(q->if_none_match)) {
+        memcpy(q->if_none_match, value, value_len);
+        q->if_none_match_len = value_len;
+    } else if (name_len == 17 && !memcmp(name, "if-modified-since", 17)) {
+        q->if_modified_since = http_parse_date(value, value_len);
+    }
+}
+
+/* the HEADERS of a response, with the entity headers of the file if meta */
+static int queue_headers(h2_conn_t *c,
+                         uint32_t id,
+                         int status,
+                         const char *filename,
+                         const file_meta_t *meta,
+                         bool end_stream)
+{
+    uint8_t block[SHORTLINE];
+    char value[SHORTLINE >> 2];
+    size_t n = 0;
+
+    if (status == HTTP_OK) {
+        n += hpack_encode_indexed(block, HPACK_STATUS_200);
+    } else if (status == HTTP_NOT_MODIFIED) {
+        n += hpack_encode_indexed(block, HPACK_STATUS_304);
+    } else if (status == HTTP_NOT_FOUND) {
+        n += hpack_encode_indexed(block, HPACK_STATUS_404);
+    } else {
+        int len = snprintf(value, sizeof(value), "%d", status);
+        n += hpack_encode_literal(block, HPACK_STATUS, value, len);
+    }
+    n += hpack_encode_literal(block + n, HPACK_SERVER, "seHTTPd", 7);
+    const char *date = time_http_date();
+    n += hpack_encode_literal(block + n, HPACK_DATE, date, strlen(date));
+
+    if (meta) {
+        const char *type = http_file_type(strrchr(filename, '.'));
+        n += hpack_encode_literal(block + n, HPACK_CONTENT_TYPE, type,
+                                  strlen(type));
+        if (status == HTTP_OK) {
+            int len = snprintf(value, sizeof(value), "%zu",
+                               (size_t) meta->size);
+            n += hpack_encode_literal(block + n, HPACK_CONTENT_LENGTH, value,
+                                      len);
+        }
+        n += hpack_encode_literal(block + n, HPACK_ETAG, meta->etag_str,
+                                  sizeof(meta->etag_str) - 1);
+        n += hpack_encode_literal(block + n, HPACK_LAST_MODIFIED,
+                                  meta->last_modified,
+                                  sizeof(meta->last_modified) - 1);
+    }
+
+    return queue_frame(c, H2_HEADERS,
+                       H2_END_HEADERS | (end_stream ? H2_END_STREAM : 0), id,
+                       block, n);
+}
+
+/* answer the request of stream id. Streams are sent in turns, so the log
+ * has the length of the body, not when it was sent.
+ */
+static int respond(http_request_t *r,
+                   uint32_t id,
+                   const h2_request_t *q,
+                   int status,
+                   const char *filename,
+                   const file_meta_t *meta,
+                   bool end_stream)
+{
+    if (queue_headers(r->h2, id, status, filename, meta, end_stream) < 0)
+        return -1;
+#if (ENABLE_ACCESS_LOG)
+    access_log(r->fd, q->method, 20, q->path, q->path_len, status,
+               end_stream ? 0 : meta->size, 0);
+#else
+    (void) q;
+#endif
+    return 0;
+}
+
+/* serve a request from the files of its route, as do_request()
+ * does for HTTP/1.x
+ */
+static int serve_stream(http_request_t *r, h2_conn_t *c, uint32_t id,
+                        h2_request_t *q)
+{
+    char filename[SHORTLINE];
+    struct stat st;
+    file_meta_t meta;
+
+    if (q->method != HTTP_GET && q->method != HTTP_HEAD)
+        return respond(r, id, q, 405, NULL, NULL, true);
+    if (!q->path_len)
+        return respond(r, id, q, HTTP_NOT_FOUND, NULL, NULL, true);
+
+    const char *inm = q->if_none_match_len >= 0 ? q->if_none_match : NULL;
+    bool conditional = inm || q->if_modified_since >= 0;
+
+    int fd;
+    off_t off = 0;
+
+    /* only files are served over HTTP/2, other routes are not found. The
+     * route is that of the normalized path, as in do_request().
+     */
+    ssize_t path_len =
+        http_normalize_path(q->path, q->path_len, filename, sizeof(filename));
+    if (path_len < 0)
+        return respond(r, id, q, 400, NULL, NULL, true);
+    const route_t *route = router_match(filename, path_len);
+    if (!route || route->type != ROUTE_STATIC)
+        return respond(r, id, q, HTTP_NOT_FOUND, NULL, NULL, true);
+    if (http_index_path(filename, path_len, sizeof(filename)) < 0)
+        return respond(r, id, q, 400, NULL, NULL, true);
+
+#if (ENABLE_PACK)
+    /* files in the pack are sent from it, in their plain variant: these
+     * responses carry no Content-Encoding
+     */
+    const route_static_t *dir = route->options;
+    pack_t *pack = dir->pack ? pack_acquire() : NULL;
+    const pack_entry_t *e =
+        pack ? pack_lookup(pack, filename, strlen(filename)) : NULL;
+    if (e) {
+        pack_meta(&e->plain, &meta);
+        off = e->plain.off;
+        fd = pack_dup(pack);
+    }
+    if (pack)
+        pack_release(pack);
+    if (e) {
+        if (fd < 0)
+            return -1;
+        goto found;
+    }
+#endif
+
+    if (conditional && file_cache_get(route->root, filename, &meta) &&
+        file_not_modified(&meta, inm, q->if_none_match_len,
+                          q->if_modified_since))
+        return respond(r, id, q, HTTP_NOT_MODIFIED, filename, &meta, true);
+
+    fd = http_open_file(route->root, filename, false);
+    if (fd < 0 && errno == ENOENT)
+        return respond(r, id, q, HTTP_NOT_FOUND, NULL, NULL, true);
+    if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+        !(S_IRUSR & st.st_mode)) {
+        if (fd >= 0)
+            close(fd);
+        return respond(r, id, q, 403, NULL, NULL, true);
+    }
+
+    file_meta_init(&meta, &st);
+    file_cache_put(route->root, filename, &meta);
+
+#if (ENABLE_PACK)
+found:
+#endif
+    if (conditional && file_not_modified(&meta, inm, q->if_none_match_len,
+                                         q->if_modified_since)) {
+        close(fd);
+        return respond(r, id, q, HTTP_NOT_MODIFIED, filename, &meta, true);
+    }
+
+    if (q->method == HTTP_HEAD || meta.size == 0) {
+        close(fd);
+        return respond(r, id, q, HTTP_OK, filename, &meta, true);
+    }
+
+    h2_stream_t *s = malloc(sizeof(h2_stream_t));
+    if (!s || respond(r, id, q, HTTP_OK, filename, &meta, false) < 0) {
+        free(s);
+        close(fd);
+        return -1;
+    }
+    s->id = id;
+    s->fd = fd;
+    s->off = off;
+    s->left = meta.size;
+    s->window = c->init_window;
+    list_add_tail(&s->list, &c->streams);
+    c->nstreams++;
+    return 0;
+}
+
+/* a complete header block opens stream id */
+static int open_stream(http_request_t *r,
+                       h2_conn_t *c,
+                       uint32_t id,
+                       const uint8_t *block,
+                       size_t len)
+{
+    h2_request_t q = {
+        .method = HTTP_UNKNOWN,
+        .if_none_match_len = -1,
+        .if_modified_since = -1,
+    };
+
+    /* decoded even if the stream is refused, to keep the table in sync */
+    if (hpack_decode(&c->hpack, block, len, request_field, &q) < 0)
+        return H2_COMPRESSION_ERROR;
+
+    if (c->nstreams >= H2_MAX_STREAMS)
+        return queue_u32(c, H2_RST_STREAM, id, H2_REFUSED_STREAM) < 0
+                   ? H2_ENHANCE_YOUR_CALM
+                   : 0;
+    return serve_stream(r, c, id, &q) < 0 ? H2_INTERNAL_ERROR : 0;
+}
+
+static void drop_field(void *arg UNUSED,
+                       const char *name UNUSED,
+                       size_t name_len UNUSED,
+                       const char *value UNUSED,
+                       size_t value_len UNUSED)
+{
+}
+
+/* a complete header block: a request opening stream id, or the trailer
+ * ending the body of one, which is decoded for the table and dropped
+ */
+static int header_block(http_request_t *r,
+                        h2_conn_t *c,
+                        uint32_t id,
+                        const uint8_t *block,
+                        size_t len,
+                        bool trailer)
+{
+    if (!trailer)
+        return open_stream(r, c, id, block, len);
+    return hpack_decode(&c->hpack, block, len, drop_field, NULL) < 0
+               ? H2_COMPRESSION_ERROR
+               : 0;
+}
+
+/* returns an error code for the connection, or 0 */
+static int handle_frame(http_request_t *r,
+                        h2_conn_t *c,
+                        int type,
+                        int flags,
+                        uint32_t id,
+                        const uint8_t *p,
+                        size_t len)
+{
+    switch (type) {
+    case H2_DATA:
+        if (!id)
+            return H2_PROTOCOL_ERROR;
+        /* request bodies are dropped, the window they took given back:
+         * that of the connection, and that of the stream while more of
+         * the body is to come
+         */
+        if (len && queue_u32(c, H2_WINDOW_UPDATE, 0, len) < 0)
+            return H2_ENHANCE_YOUR_CALM;
+        if (len && !(flags & H2_END_STREAM) &&
+            queue_u32(c, H2_WINDOW_UPDATE, id, len) < 0)
+            return H2_ENHANCE_YOUR_CALM;
+        return 0;
+
+    case H2_HEADERS: {
+        size_t pad = 0;
+        /* on a stream already opened, it is the trailer of the request,
+         * which ends the stream
+         */
+        bool trailer = id <= c->last_id;
+        if (!(id & 1) || (trailer && !(flags & H2_END_STREAM)))
+            return H2_PROTOCOL_ERROR;
+        if (flags & H2_PADDED) {
+            if (len < 1)
+                return H2_FRAME_SIZE_ERROR;
+            pad = *p++;
+            len--;
+        }
+        if (flags & H2_PRIORITY_FLAG) {
+            if (len < 5)
+                return H2_FRAME_SIZE_ERROR;
+            p += 5;
+            len -= 5;
+        }
+        if (pad > len)
+            return H2_PROTOCOL_ERROR;
+        len -= pad;
+        if (!trailer)
+            c->last_id = id;
+
+        if (flags & H2_END_HEADERS)
+            return header_block(r, c, id, p, len, trailer);
+
+        c->block = malloc(H2_MAX_HEADER_BLOCK);
+        if (!c->block || len > H2_MAX_HEADER_BLOCK)
+            return H2_ENHANCE_YOUR_CALM;
+        memcpy(c->block, p, len);
+        c->block_len = len;
+        c->block_id = id;
+        c->block_trailer = trailer;
+        return 0;
+    }
+
+    case H2_CONTINUATION: {
+        if (!c->block || id != c->block_id)
+            return H2_PROTOCOL_ERROR;
+        if (c->block_len + len > H2_MAX_HEADER_BLOCK)
+            return H2_ENHANCE_YOUR_CALM;
+        memcpy(c->block + c->block_len, p, len);
+        c->block_len += len;
+        if (!(flags & H2_END_HEADERS))
+            return 0;
+
+        int rc = header_block(r, c, id, c->block, c->block_len,
+                              c->block_trailer);
+        free(c->block);
+        c->block = NULL;
+        return rc;
+    }
+
+    case H2_RST_STREAM:
+        if (!id)
+            return H2_PROTOCOL_ERROR;
+        if (len != 4)
+            return H2_FRAME_SIZE_ERROR;
+        reset_stream(c, id);
+        return 0;
+
+    case H2_SETTINGS: {
+        if (id)
+            return H2_PROTOCOL_ERROR;
+        if (flags & H2_ACK)
+            return len ? H2_FRAME_SIZE_ERROR : 0;
+        int rc = apply_settings(c, p, len);
+        if (rc)
+            return rc;
+        return queue_frame(c, H2_SETTINGS, H2_ACK, 0, NULL, 0) < 0
+                   ? H2_ENHANCE_YOUR_CALM
+                   : 0;
+    }
+
+    case H2_PUSH_PROMISE: /* clients do not push */
+        return H2_PROTOCOL_ERROR;
+
+    case H2_PING:
+        if (id)
+            return H2_PROTOCOL_ERROR;
+        if (len != 8)
+            return H2_FRAME_SIZE_ERROR;
+        if (!(flags & H2_ACK) && queue_frame(c, H2_PING, H2_ACK, 0, p, len) < 0)
+            return H2_ENHANCE_YOUR_CALM;
+        return 0;
+
+    case H2_GOAWAY:
+        c->goaway = true;
+        return 0;
+
+    case H2_WINDOW_UPDATE: {
+        if (len != 4)
+            return H2_FRAME_SIZE_ERROR;
+        uint32_t inc = get_be32(p) & MAX_WINDOW;
+        if (!id) {
+            if (!inc)
+                return H2_PROTOCOL_ERROR;
+            c->window += inc;
+            return c->window > MAX_WINDOW ? H2_FLOW_CONTROL_ERROR : 0;
+        }
+        h2_stream_t *s = find_stream(c, id);
+        if (s && (!inc || s->window + inc > MAX_WINDOW)) {
+            reset_stream(c, id);
+            return queue_u32(c, H2_RST_STREAM, id,
+                             inc ? H2_FLOW_CONTROL_ERROR : H2_PROTOCOL_ERROR) <
+                           0
+                       ? H2_ENHANCE_YOUR_CALM
+                       : 0;
+        }
+        if (s)
+            s->window += inc;
+        return 0;
+    }
+
+    default: /* PRIORITY and unknown frames */
+        return 0;
+    }
+}
+
+/* take the complete frames off the buffer. Returns -1 after a connection
+ * error.
+ */
+static int process_frames(http_request_t *r, h2_conn_t *c)
+{
+    if (!c->preface) {
+        size_t n = r->last - r->pos;
+        if (memcmp(r->buf + r->pos, PREFACE, n < PREFACE_LEN ? n : PREFACE_LEN))
+            return goaway(c, H2_PROTOCOL_ERROR);
+        if (n < PREFACE_LEN)
+            return 0;
+        r->pos += PREFACE_LEN;
+        c->preface = true;
+    }
+
+    while (r->last - r->pos >= FRAME_HEADER) {
+        const uint8_t *p = (uint8_t *) r->buf + r->pos;
+        size_t len = p[0] << 16 | p[1] << 8 | p[2];
+        int type = p[3], flags = p[4];
+        uint32_t id = get_be32(p + 5) & MAX_WINDOW;
+
+        /* SETTINGS_MAX_FRAME_SIZE is left at its default */
+        if (len > DEFAULT_FRAME_SIZE)
+            return goaway(c, H2_FRAME_SIZE_ERROR);
+        if (r->last - r->pos < FRAME_HEADER + len)
+            break;
+        r->pos += FRAME_HEADER + len;
+
+        if (c->block && type != H2_CONTINUATION)
+            return goaway(c, H2_PROTOCOL_ERROR);
+        int rc = handle_frame(r, c, type, flags, id, p + FRAME_HEADER, len);
+        if (rc)
+            return goaway(c, rc);
+    }
+    return 0;
+}
+
+/* the next stream allowed to send, the one which waited longest */
+static h2_stream_t *next_stream(h2_conn_t *c)
+{
+    list_head *pos;
+    list_for_each (pos, &c->streams) {
+        h2_stream_t *s = list_entry(pos, h2_stream_t, list);
+        if (s->left > 0 && s->window > 0)
+            return s;
+    }
+    return NULL;
+}
+
+/* queue DATA frames of the streams in turn, as far as the flow control
+ * windows allow. A large payload is left in r->file_* for sendfile(),
+ * behind its frame header, and ends the batch. Returns whether anything
+ * was queued.
+ */
+static bool schedule(http_request_t *r, h2_conn_t *c)
+{
+    bool queued = false;
+    h2_stream_t *s;
+
+    while (c->window > 0 && c->out_len < H2_WRITE_BATCH &&
+           (s = next_stream(c))) {
+        size_t n = s->left;
+        if (n > c->max_frame)
+            n = c->max_frame;
+        if ((int64_t) n > s->window)
+            n = s->window;
+        if ((int64_t) n > c->window)
+            n = c->window;
+        bool inline_data = n <= H2_INLINE_MAX;
+
+        uint8_t *p = reserve(c, FRAME_HEADER + (inline_data ? n : 0));
+        if (!p)
+            break;
+        if (inline_data &&
+            pread(s->fd, p + FRAME_HEADER, n, s->off) != (ssize_t) n) {
+            log_err("file shrank while being sent");
+            queue_u32(c, H2_RST_STREAM, s->id, H2_INTERNAL_ERROR);
+            free_stream(c, s);
+            continue;
+        }
+
+        s->left -= n;
+        s->window -= n;
+        c->window -= n;
+        frame_header(p, n, H2_DATA, s->left ? 0 : H2_END_STREAM, s->id);
+        queued = true;
+
+        /* its turn is over */
+        list_del(&s->list);
+        list_add_tail(&s->list, &c->streams);
+
+        if (inline_data) {
+            c->out_len += FRAME_HEADER + n;
+            s->off += n;
+            if (!s->left)
+                free_stream(c, s);
+            continue;
+        }
+
+        c->out_len += FRAME_HEADER;
+        c->payload_at = c->out_len;
+        c->sending = s;
+        r->file_fd = s->fd;
+        r->file_off = s->off;
+        r->file_left = n;
+        s->off += n;
+        break;
+    }
+    return queued;
+}
+
+/* write what is queued and what the streams may send. Returns 0 once
+ * everything is written, EAGAIN when the socket is full and -1 on error.
+ */
+static int flush(http_request_t *r, h2_conn_t *c)
+{
+    ssize_t n;
+
+    for (;;) {
+        size_t end = r->file_left ? c->payload_at : c->out_len;
+        while (c->out_pos < end) {
+            n = http_send(r, c->out + c->out_pos, end - c->out_pos, 0);
+            if (n < 0)
+                goto error;
+            c->out_pos += n;
+        }
+
+        while (r->file_left > 0) {
+            n = http_send_file(r);
+            if (n < 0)
+                goto error;
+            if (n == 0) {
+                log_err("file shrank while being sent");
+                return -1;
+            }
+            r->file_left -= n;
+        }
+        if (c->sending) {
+            h2_stream_t *s = c->sending;
+            c->sending = NULL;
+            c->payload_at = 0;
+            r->file_fd = -1;
+            if (!s->left)
+                free_stream(c, s);
+        }
+
+        if (c->out_pos == c->out_len) {
+            c->out_pos = c->out_len = 0;
+            if (!schedule(r, c))
+                return 0;
+        }
+    }
+
+error:
+    if (errno == EINTR)
+        return flush(r, c);
+    if (errno != EAGAIN) {
+        log_err("write err, and errno = %d", errno);
+        return -1;
+    }
+    return EAGAIN;
+}
+
+/* read and handle frames until the socket runs dry. Returns -1 when the
+ * client closed the connection or it failed.
+ */
+static int read_frames(http_request_t *r, h2_conn_t *c)
+{
+    if (process_frames(r, c) < 0)
+        return 0;
+
+    for (;;) {
+        if (r->last == r->buf_size && !http_make_room(r)) {
+            goaway(c, H2_ENHANCE_YOUR_CALM);
+            return 0;
+        }
+
+        ssize_t n = http_recv(r, r->buf + r->last, r->buf_size - r->last);
+        if (n == 0)
+            return -1;
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN) {
+                log_err("read err, and errno = %d", errno);
+                return -1;
+            }
+            return 0;
+        }
+
+        r->last += n;
+        if (process_frames(r, c) < 0)
+            return 0;
+    }
+}
+
+static h2_conn_t *new_conn(http_request_t *r)
+{
+    h2_conn_t *c = calloc(1, sizeof(h2_conn_t));
+    if (!c)
+        return NULL;
+
+    hpack_init(&c->hpack);
+    INIT_LIST_HEAD(&c->streams);
+    c->window = c->init_window = DEFAULT_WINDOW;
+    c->max_frame = DEFAULT_FRAME_SIZE;
+
+    r->h2 = c;
+    r->splice_file = false;
+    r->file_left = 0;
+    return c;
+}
+
+/* whether a new connection starts with the preface of a client which
+ * knows the server speaks HTTP/2. Returns 0 when it does, and the
+ * connection switched, EAGAIN while too little of it arrived to tell.
+ */
+int http2_preface(http_request_t *r)
+{
+    size_t n = r->last - r->pos;
+
+    if (memcmp(r->buf + r->pos, PREFACE, n < PREFACE_LEN ? n : PREFACE_LEN))
+        return -1;
+    if (n < PREFACE_LEN)
+        return EAGAIN;
+
+    h2_conn_t *c = new_conn(r);
+    if (!c || queue_settings(c) < 0)
+        return -1;
+    return 0;
+}
+
+static ssize_t base64url_decode(const char *in, size_t len, uint8_t *out)
+{
+    uint32_t acc = 0;
+    int bits = 0;
+    ssize_t n = 0;
+
+    for (size_t i = 0; i < len && in[i] != '='; i++) {
+        char ch = in[i];
+        int v;
+        if (ch >= 'A' && ch <= 'Z')
+            v = ch - 'A';
+        else if (ch >= 'a' && ch <= 'z')
+            v = ch - 'a' + 26;
+        else if (ch >= '0' && ch <= '9')
+            v = ch - '0' + 52;
+        else if (ch == '-')
+            v = 62;
+        else if (ch == '_')
+            v = 63;
+        else
+            return -1;
+
+        acc = acc << 6 | v;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            out[n++] = acc >> bits;
+        }
+    }
+    return n;
+}
+
+/* switch to HTTP/2 after the HTTP/1.1 request just parsed, which asked for
+ * "Upgrade: h2c". Its response is sent on stream 1 after the 101, the
+ * settings of the client come base64url encoded in HTTP2-Settings.
+ */
+int http2_upgrade(http_request_t *r, const char *settings, size_t len)
+{
+    static const char switching[] =
+        "HTTP/1.1 101 Switching Protocols\r\n"
+        "Connection: Upgrade\r\n"
+        "Upgrade: h2c\r\n\r\n";
+    uint8_t payload[SHORTLINE];
+
+    if (len > sizeof(payload) / 3 * 4)
+        return -1;
+    ssize_t n = base64url_decode(settings, len, payload);
+    if (n < 0 || n % 6)
+        return -1;
+
+    h2_conn_t *c = new_conn(r);
+    if (!c)
+        return -1;
+
+    h2_request_t q = {
+        .method = r->method,
+        .if_none_match_len = -1,
+        .if_modified_since = -1,
+    };
+    q.path_len = (char *) r->uri_end - (char *) r->uri_start;
+    if (q.path_len >= sizeof(q.path))
+        q.path_len = 0;
+    memcpy(q.path, r->uri_start, q.path_len);
+
+    c->last_id = 1;
+    uint8_t *p = reserve(c, sizeof(switching) - 1);
+    if (!p || apply_settings(c, payload, n)) {
+        http2_release(r);
+        return -1;
+    }
+    memcpy(p, switching, sizeof(switching) - 1);
+    c->out_len += sizeof(switching) - 1;
+
+    if (queue_settings(c) < 0 || serve_stream(r, c, 1, &q) < 0) {
+        http2_release(r);
+        return -1;
+    }
+    return 0;
+}
+
+/* an event on a connection speaking HTTP/2 */
+void http2_do_request(http_request_t *r)
+{
+    h2_conn_t *c = r->h2;
+    struct epoll_event event = {
+        .data.ptr = r,
+        .events = EPOLLIN | EPOLLET | EPOLLONESHOT,
+    };
+    size_t timeout;
+
+    if (read_frames(r, c) < 0)
+        goto close;
+
+    int rc = flush(r, c);
+    if (rc < 0 || c->closing || (c->goaway && !c->nstreams && rc == 0))
+        goto close;
+
+    if (r->pos == r->last)
+        http_detach_buffer(r);
+
+    if (rc == EAGAIN) {
+        event.events |= EPOLLOUT;
+        timeout = TIMEOUT_WRITE;
+    } else if (c->nstreams || r->pos < r->last) {
+        /* waiting for WINDOW_UPDATE, or the rest of a frame */
+        timeout = TIMEOUT_HEADER;
+    } else {
+        timeout = http_keep_alive_timeout();
+        if (!timeout) {
+            goaway(c, H2_NO_ERROR);
+            flush(r, c);
+            goto close;
+        }
+    }
+
+    timer_set_deadline(r, time_msec() + timeout);
+    epoll_ctl(r->epfd, EPOLL_CTL_MOD, r->fd, &event);
+    return;
+
+close:
+    del_timer(r);
+    http_close_conn(r);
+}
+
+void http2_release(http_request_t *r)
+{
+    h2_conn_t *c = r->h2;
+    if (!c)
+        return;
+
+    /* the file of a payload being sent belongs to its stream */
+    r->file_fd = -1;
+    r->file_left = 0;
+    while (!list_empty(&c->streams))
+        free_stream(c, list_entry(c->streams.next, h2_stream_t, list));
+    hpack_free(&c->hpack);
+    free(c->block);
+    free(c->out);
+    free(c);
+    r->h2 = NULL;
+}
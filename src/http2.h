@@ -0,0 +1,29 @@
+#ifndef HTTP2_H
+#define HTTP2_H
+
+#include "http.h"
+
+/* SETTINGS_MAX_CONCURRENT_STREAMS, beyond which streams are refused */
+#define H2_MAX_STREAMS 128
+
+/* DATA payloads this small are copied behind their frame header, so that
+ * those of many streams go out in one write(). Larger ones are sent from
+ * the file with sendfile().
+ */
+#define H2_INLINE_MAX 4096
+
+/* frames queued before they are written */
+#define H2_WRITE_BATCH (64 << 10) /* 64KB */
+
+/* frames a client may make the server queue without reading them */
+#define H2_OUT_MAX (1 << 20) /* 1MB */
+
+/* a header block, with its CONTINUATION frames */
+#define H2_MAX_HEADER_BLOCK (64 << 10) /* 64KB */
+
+int http2_preface(http_request_t *r);
+int http2_upgrade(http_request_t *r, const char *settings, size_t len);
+void http2_do_request(http_request_t *r);
+void http2_release(http_request_t *r);
+
+#endif
@@ -0,0 +1,269 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* for splice(2) */
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "http.h"
+#include "logger.h"
+
+/* body bytes spliced from the socket to a file at a time, what a pipe
+ * holds by default
+ */
+#define SPLICE_CHUNK (64 << 10) /* 64KB */
+
+static bool field_is(http_header_t *hd, const char *name, size_t len)
+{
+    return (size_t) ((char *) hd->key_end - (char *) hd->key_start) == len &&
+           !strncasecmp(hd->key_start, name, len);
+}
+
+/* find out from the header fields whether a body follows the header of r
+ * and how its end is found, before anything is answered. Returns 0, or the
+ * status to turn the request down with.
+ */
+int http_body_init(http_request_t *r)
+{
+    bool chunked = false, length = false, expect = false;
+    size_t content_length = 0;
+
+    r->req_body = HTTP_BODY_NONE;
+    r->chunk_state = 0;
+    r->body_left = 0;
+    r->body_start = r->pos;
+    r->expect_continue = false;
+
+    list_head *pos;
+    list_for_each (pos, &(r->list)) {
+        http_header_t *hd = list_entry(pos, http_header_t, list);
+        char *value = hd->value_start, *end = hd->value_end;
+        while (end > value && (end[-1] == ' ' || end[-1] == '\t'))
+            end--;
+        size_t len = end - value;
+
+        if (field_is(hd, "Content-Length", 14)) {
+            size_t n = 0;
+            if (!len)
+                return HTTP_BAD_REQUEST;
+            for (char *c = value; c < end; c++) {
+                if (*c < '0' || *c > '9' || n >> 59)
+                    return HTTP_BAD_REQUEST;
+                n = n * 10 + (*c - '0');
+            }
+            /* repeated, it has to say the same */
+            if (length && n != content_length)
+                return HTTP_BAD_REQUEST;
+            length = true;
+            content_length = n;
+        } else if (field_is(hd, "Transfer-Encoding", 17)) {
+            /* chunked is the only coding understood */
+            if (chunked || len != 7 || strncasecmp(value, "chunked", 7))
+                return HTTP_NOT_IMPLEMENTED;
+            chunked = true;
+        } else if (field_is(hd, "Expect", 6)) {
+            expect = len == 12 && !strncasecmp(value, "100-continue", 12);
+        }
+    }
+
+    bool http10 = r->http_major == 1 && r->http_minor == 0;
+
+    /* with both, a proxy in front of the server could see the request end
+     * elsewhere. HTTP/1.0 knows no chunked coding.
+     */
+    if (chunked && (length || http10))
+        return HTTP_BAD_REQUEST;
+
+    if (chunked) {
+        r->req_body = HTTP_BODY_CHUNKED;
+    } else if (content_length) {
+        r->req_body = HTTP_BODY_LENGTH;
+        r->body_left = content_length;
+    }
+    r->expect_continue = expect && r->req_body && !http10;
+    return 0;
+}
+
+/* a client sending "Expect: 100-continue" waits for this before the body.
+ * It is small enough for the socket buffer of a request just received.
+ */
+static int send_continue(http_request_t *r)
+{
+    static const char line[] = "HTTP/1.1 100 Continue\r\n\r\n";
+
+    r->expect_continue = false;
+    ssize_t n = http_send(r, line, sizeof(line) - 1, 0);
+    return n == sizeof(line) - 1 ? 0 : -1;
+}
+
+/* pass on the body bytes in buf from pos, to handler or to the file fd.
+ * Returns 0 once none are left there, EBUSY when handler has no room and
+ * the status to answer with or -1 on error.
+ */
+static int take_buffered(http_request_t *r,
+                         http_body_handler handler,
+                         int fd,
+                         size_t *room)
+{
+    while (r->req_body) {
+        if (r->req_body == HTTP_BODY_CHUNKED) {
+            int rc = http_parse_chunked(r);
+            if (rc == EAGAIN)
+                return 0;
+            if (rc != 0) {
+                log_err("bad chunked request body");
+                return HTTP_BAD_REQUEST;
+            }
+            if (!r->body_left) {
+                r->req_body = HTTP_BODY_NONE;
+                break;
+            }
+        }
+        if (r->pos == r->last)
+            return 0;
+
+        size_t n = r->last - r->pos;
+        if (n > r->body_left)
+            n = r->body_left;
+
+        ssize_t k;
+        if (fd >= 0) {
+            if (n > *room)
+                n = *room;
+            if (!n)
+                return HTTP_PAYLOAD_TOO_LARGE;
+            k = write(fd, r->buf + r->pos, n);
+            if (k <= 0)
+                return -1;
+            *room -= k;
+        } else {
+            k = handler(r, r->buf + r->pos, n);
+            if (k < 0)
+                return -1;
+            if (!k)
+                return EBUSY;
+        }
+
+        r->pos += k;
+        r->body_left -= k;
+        if (!r->body_left && r->req_body == HTTP_BODY_LENGTH)
+            r->req_body = HTTP_BODY_NONE;
+    }
+    return 0;
+}
+
+/* move up to len body bytes from the socket to the file fd through a pipe
+ * of the calling thread, without copying them to user space
+ */
+static ssize_t splice_body(http_request_t *r, int fd, size_t len)
+{
+    static __thread int pipefd[2] = {-1, -1};
+
+    if (pipefd[0] < 0 && pipe2(pipefd, O_NONBLOCK | O_CLOEXEC) < 0)
+        return -1;
+
+    if (len > SPLICE_CHUNK)
+        len = SPLICE_CHUNK;
+    ssize_t in = splice(r->fd, NULL, pipefd[1], NULL, len,
+                        SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (in <= 0)
+        return in;
+
+    /* a file takes all of it, unless it cannot be written at all */
+    for (ssize_t left = in; left > 0;) {
+        ssize_t out = splice(pipefd[0], NULL, fd, NULL, left, SPLICE_F_MOVE);
+        if (out <= 0) {
+            /* what stays in the pipe would end up in another file */
+            close(pipefd[0]);
+            close(pipefd[1]);
+            pipefd[0] = pipefd[1] = -1;
+            return -1;
+        }
+        left -= out;
+    }
+    return in;
+}
+
+/* the header filled the buffer. It moves down, or the buffer grows, for
+ * room behind it: a handler may still look at the header.
+ */
+static bool make_body_room(http_request_t *r)
+{
+    r->request_line_done = true; /* http_make_room() keeps the request */
+    bool ok = http_make_room(r);
+    r->request_line_done = false;
+    r->body_start = r->last;
+    return ok && r->last < r->buf_size;
+}
+
+static int read_body(http_request_t *r,
+                     http_body_handler handler,
+                     int fd,
+                     size_t *room)
+{
+    if (r->expect_continue && send_continue(r) < 0)
+        return -1;
+
+    for (;;) {
+        int rc = take_buffered(r, handler, fd, room);
+        if (rc || !r->req_body)
+            return rc;
+
+        /* all of buf is taken, the next bytes go where the body began */
+        r->pos = r->last = r->body_start;
+        if (r->body_start == r->buf_size && !make_body_room(r))
+            return -1;
+
+        ssize_t n;
+        if (fd >= 0 && r->req_body == HTTP_BODY_LENGTH && !r->tls) {
+            if (r->body_left > *room)
+                return HTTP_PAYLOAD_TOO_LARGE;
+            n = splice_body(r, fd, r->body_left);
+            if (n > 0) {
+                *room -= n;
+                r->body_left -= n;
+                if (!r->body_left)
+                    r->req_body = HTTP_BODY_NONE;
+                continue;
+            }
+        } else {
+            n = http_recv(r, r->buf + r->last, r->buf_size - r->last);
+            if (n > 0) {
+                r->last += n;
+                continue;
+            }
+        }
+
+        if (n == 0) {
+            log_err("request body cut short");
+            return -1;
+        }
+        if (errno == EINTR)
+            continue;
+        return errno == EAGAIN ? EAGAIN : -1;
+    }
+}
+
+/* go on reading the request body, passing it to handler as it arrives.
+ * Only what one read brings in is buffered, in buf behind the header.
+ * Returns 0 once all of it is taken, EAGAIN to wait for the client, EBUSY
+ * when handler took nothing, HTTP_BAD_REQUEST if it is malformed or -1 on
+ * error.
+ */
+int http_read_body(http_request_t *r, http_body_handler handler)
+{
+    return read_body(r, handler, -1, NULL);
+}
+
+/* the same, appending the body to the file fd, at most *room bytes which
+ * are counted off. Bodies of known length go from the socket to the file
+ * with splice(). Returns HTTP_PAYLOAD_TOO_LARGE for a longer body.
+ */
+int http_read_body_to_file(http_request_t *r, int fd, size_t *room)
+{
+    return read_body(r, NULL, fd, room);
+}
@@ -1,6 +1,7 @@
 #include <assert.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "http.h"
 
@@ -292,8 +293,13 @@ int http_parse_request_body(http_request_t *r)
 
         switch (state) {
         case s_start:
-            if (ch == CR || ch == LF)
+            /* an empty line right after the request line: no headers */
+            if (ch == CR) {
+                state = s_crlfcr;
                 break;
+            }
+            if (ch == LF)
+                goto done;
 
             r->cur_header_key_start = p;
             state = s_key;
@@ -388,3 +394,348 @@ done:
 
     return 0;
 }
+
+static inline int hex_value(uint8_t ch)
+{
+    if (ch >= '0' && ch <= '9')
+        return ch - '0';
+    ch |= 0x20;
+    return (ch >= 'a' && ch <= 'f') ? ch - 'a' + 10 : -1;
+}
+
+/* decode a chunked request body in buf from pos. Returns 0 at chunk data,
+ * body_left bytes of it starting at pos, which the caller takes and counts
+ * down before calling again. Returns 0 with body_left 0 once the last
+ * chunk and the trailer are past.
+ *
+ * Every line has to end in CRLF. A server in front of this one, or an
+ * upstream the body is forwarded to, might end a line at a lone LF where
+ * this one would not, and so see other requests in the same bytes.
+ */
+int http_parse_chunked(http_request_t *r)
+{
+    uint8_t ch;
+    size_t pi;
+    int d;
+
+    enum {
+        s_start = 0,
+        s_size,
+        s_extension,
+        s_size_almost_done,
+        s_data,
+        s_after_data,
+        s_after_data_almost_done,
+        s_trailer_start,
+        s_trailer,
+        s_trailer_line_almost_done,
+        s_trailer_almost_done,
+        s_done
+    } state;
+
+    state = r->chunk_state;
+
+    if (state == s_done)
+        return 0;
+    if (state == s_data) {
+        if (r->body_left)
+            return 0;
+        state = s_after_data;
+    }
+
+    for (pi = r->pos; pi < r->last; pi++) {
+        ch = r->buf[pi];
+
+        switch (state) {
+        /* the size has at least one hex digit */
+        case s_start:
+            if ((d = hex_value(ch)) < 0)
+                return HTTP_PARSER_INVALID_CHUNK;
+            r->body_left = d;
+            state = s_size;
+            break;
+
+        case s_size:
+            if ((d = hex_value(ch)) >= 0) {
+                if (r->body_left >> 59)
+                    return HTTP_PARSER_INVALID_CHUNK;
+                r->body_left = r->body_left * 16 + d;
+                break;
+            }
+            if (ch == ';' || ch == ' ' || ch == '\t') {
+                state = s_extension;
+                break;
+            }
+            if (ch == CR) {
+                state = s_size_almost_done;
+                break;
+            }
+            return HTTP_PARSER_INVALID_CHUNK;
+
+        case s_extension:
+            if (ch == CR)
+                state = s_size_almost_done;
+            else if (ch == LF)
+                return HTTP_PARSER_INVALID_CHUNK;
+            break;
+
+        case s_size_almost_done:
+            if (ch != LF)
+                return HTTP_PARSER_INVALID_CHUNK;
+            if (r->body_left) {
+                r->pos = pi + 1;
+                r->chunk_state = s_data;
+                return 0;
+            }
+            state = s_trailer_start;
+            break;
+
+        /* chunk data is followed by CRLF */
+        case s_after_data:
+            if (ch != CR)
+                return HTTP_PARSER_INVALID_CHUNK;
+            state = s_after_data_almost_done;
+            break;
+
+        case s_after_data_almost_done:
+            if (ch != LF)
+                return HTTP_PARSER_INVALID_CHUNK;
+            state = s_start;
+            break;
+
+        /* trailer fields are skipped, an empty line ends the body */
+        case s_trailer_start:
+            if (ch == CR)
+                state = s_trailer_almost_done;
+            else if (ch == LF)
+                return HTTP_PARSER_INVALID_CHUNK;
+            else
+                state = s_trailer;
+            break;
+
+        case s_trailer:
+            if (ch == CR)
+                state = s_trailer_line_almost_done;
+            else if (ch == LF)
+                return HTTP_PARSER_INVALID_CHUNK;
+            break;
+
+        case s_trailer_line_almost_done:
+            if (ch != LF)
+                return HTTP_PARSER_INVALID_CHUNK;
+            state = s_trailer_start;
+            break;
+
+        case s_trailer_almost_done:
+            if (ch != LF)
+                return HTTP_PARSER_INVALID_CHUNK;
+            goto done;
+
+        case s_data:
+        case s_done:
+            break;
+        }
+    }
+
+    r->pos = pi;
+    r->chunk_state = state;
+
+    return EAGAIN;
+
+done:
+    r->pos = pi + 1;
+    r->chunk_state = s_done;
+    r->body_left = 0;
+
+    return 0;
+}
+
+static inline int two_digits(const uint8_t *p)
+{
+    if ((unsigned) (p[0] - '0') > 9 || (unsigned) (p[1] - '0') > 9)
+        return -1;
+    return (p[0] - '0') * 10 + (p[1] - '0');
+}
+
+/* a date in any of the three forms RFC 9110 has recipients accept:
+ *
+ *     Sun, 06 Nov 1994 08:49:37 GMT    IMF-fixdate, what clients send now
+ *     Sunday, 06-Nov-94 08:49:37 GMT   obsolete RFC 850 form
+ *     Sun Nov  6 08:49:37 1994         obsolete asctime() form
+ *
+ * A two-digit year is taken to be in 1970 to 2069. Returns the time, or -1
+ * if s is not such a date.
+ */
+time_t http_parse_date(const char *s, size_t len)
+{
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    const uint8_t *p = (const uint8_t *) s, *m, *t, *comma;
+    int mon, day, year;
+
+    while (len && (*p == ' ' || *p == '\t'))
+        p++, len--;
+    while (len && (p[len - 1] == ' ' || p[len - 1] == '\t'))
+        len--;
+
+    if (len == 29 && p[3] == ',') {
+        if (p[4] != ' ' || p[7] != ' ' || p[11] != ' ' || p[16] != ' ' ||
+            p[25] != ' ' || memcmp(p + 26, "GMT", 3))
+            return -1;
+        int century = two_digits(p + 12);
+        day = two_digits(p + 5);
+        year = two_digits(p + 14);
+        if (century < 0 || year < 0)
+            return -1;
+        year += century * 100;
+        m = p + 8, t = p + 17;
+    } else if (len == 24 && p[3] == ' ') {
+        if (p[7] != ' ' || p[10] != ' ' || p[19] != ' ')
+            return -1;
+        int century = two_digits(p + 20);
+        day = two_digits(p + 8);
+        if (p[8] == ' ' && (unsigned) (p[9] - '0') <= 9)
+            day = p[9] - '0'; /* days below 10 are padded with a space */
+        year = two_digits(p + 22);
+        if (century < 0 || year < 0)
+            return -1;
+        year += century * 100;
+        m = p + 4, t = p + 11;
+    } else if (len >= 30 && len <= 33 &&
+               (comma = memchr(p, ',', len)) && p + len - comma == 24) {
+        /* the weekday spelled out, its length left unchecked */
+        if (comma[1] != ' ' || comma[4] != '-' || comma[8] != '-' ||
+            comma[11] != ' ' || comma[20] != ' ' ||
+            memcmp(comma + 21, "GMT", 3))
+            return -1;
+        day = two_digits(comma + 2);
+        year = two_digits(comma + 9);
+        if (year < 0)
+            return -1;
+        year += year < 70 ? 2000 : 1900;
+        m = comma + 5, t = comma + 12;
+    } else {
+        return -1;
+    }
+
+    for (mon = 0; mon < 12; mon++) {
+        if (!memcmp(m, months + 3 * mon, 3))
+            break;
+    }
+
+    int hour = two_digits(t), min = two_digits(t + 3), sec = two_digits(t + 6);
+    if (mon == 12 || day < 1 || day > 31 || year < 1970 || t[2] != ':' ||
+        t[5] != ':' || hour < 0 || hour > 23 || min < 0 || min > 59 ||
+        sec < 0 || sec > 60)
+        return -1;
+
+    /* days since the epoch, counted in years starting on March 1st so that
+     * leap days come last
+     */
+    int y = year - (mon < 2);
+    int era = y / 400, yoe = y % 400;
+    int doy = (153 * ((mon + 10) % 12) + 2) / 5 + day - 1;
+    long days = era * 146097L + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+
+    return (time_t) days * 86400 + hour * 3600 + min * 60 + sec;
+}
+
+#define INDEX_FILE "index.html"
+
+/* the path of an origin-form URI, percent-decoded and with its dot
+ * segments resolved in one pass: "/a//b/../c/" and "/%63" become "/a/c/"
+ * and "/c". A decoded '/' separates segments like any other. Routes are
+ * matched against this, so that no spelling of a path reaches a route its
+ * file would not be under. Returns the length of path, or -1 if the URI is
+ * malformed, climbs above the root or does not fit into size bytes.
+ */
+ssize_t http_normalize_path(const char *uri, size_t len, char *path,
+                            size_t size)
+{
+    const char *q = memchr(uri, '?', len);
+    const uint8_t *p = (const uint8_t *) uri;
+    const uint8_t *end = q ? (const uint8_t *) q : p + len;
+    size_t o = 1, seg = 1; /* where the output and its last segment are */
+
+    if (p == end || *p != '/' || size < 2)
+        return -1;
+    path[0] = '/';
+
+    for (p++;; p++) {
+        int ch = p < end ? *p : '/';
+
+        if (ch == '%') {
+            int hi, lo;
+            if (end - p < 3 || (hi = hex_value(p[1])) < 0 ||
+                (lo = hex_value(p[2])) < 0 || !(hi | lo))
+                return -1;
+            ch = hi << 4 | lo;
+            p += 2;
+        }
+
+        if (ch != '/') {
+            if (o >= size - 1)
+                return -1;
+            path[o++] = ch;
+            continue;
+        }
+
+        /* a segment ends: "" and "." are dropped, ".." takes the one
+         * before along
+         */
+        size_t n = o - seg;
+        if (n == 1 && path[seg] == '.') {
+            o = seg;
+        } else if (n == 2 && path[seg] == '.' && path[seg + 1] == '.') {
+            if (seg == 1)
+                return -1;
+            o = seg - 1;
+            while (path[o - 1] != '/')
+                o--;
+            seg = o;
+        } else if (n && p < end) {
+            if (o >= size - 1)
+                return -1;
+            path[o++] = '/';
+            seg = o;
+        }
+        if (p >= end)
+            break;
+    }
+    path[o] = '\0';
+    return o;
+}
+
+/* the file a path as http_normalize_path() made it stands for, in place:
+ * directories, and names without an extension, stand for their index
+ * file. Returns the new length, or -1 if it does not fit into size bytes.
+ */
+ssize_t http_index_path(char *path, size_t len, size_t size)
+{
+    size_t o = len, seg = len;
+
+    while (path[seg - 1] != '/')
+        seg--;
+    if (o > seg && !memchr(path + seg, '.', o - seg)) {
+        if (o >= size - 1)
+            return -1;
+        path[o++] = '/';
+        seg = o;
+    }
+    if (o == seg) {
+        if (o + sizeof(INDEX_FILE) > size)
+            return -1;
+        memcpy(path + o, INDEX_FILE, sizeof(INDEX_FILE) - 1);
+        o += sizeof(INDEX_FILE) - 1;
+    }
+    path[o] = '\0';
+    return o;
+}
+
+/* http_normalize_path() and http_index_path() in one: "/", "/a//b/../c/"
+ * and "/%63" become "/index.html", "/a/c/index.html" and "/c/index.html"
+ */
+ssize_t http_normalize_uri(const char *uri, size_t len, char *path, size_t size)
+{
+    ssize_t n = http_normalize_path(uri, len, path, size);
+    return n < 0 ? -1 : http_index_path(path, n, size);
+}
@@ -1,13 +1,32 @@
-#ifndef _GNU_SOURCE
-#define _GNU_SOURCE /* for the sake of strptime(3) */
-#endif
-
-#include <math.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "http.h"
+#include "timer.h"
+#if (ENABLE_TLS)
+#include "tls.h"
+#endif
+
+/* connections open in this worker */
+size_t http_conns;
+
+/* idle connections are kept for TIMEOUT_DEFAULT while there are few of
+ * them. Past half of MAX_CONNECTIONS the timeout shrinks linearly, down to
+ * 0 at the limit, i.e. no keep-alive at all, so that idle clients make
+ * room for new ones during a spike.
+ */
+size_t http_keep_alive_timeout()
+{
+    size_t conns = __atomic_load_n(&http_conns, __ATOMIC_RELAXED);
+
+    if (conns <= MAX_CONNECTIONS / 2)
+        return TIMEOUT_DEFAULT;
+    if (conns >= MAX_CONNECTIONS)
+        return 0;
+    return (size_t) TIMEOUT_DEFAULT * (MAX_CONNECTIONS - conns) /
+           (MAX_CONNECTIONS / 2);
+}
 
 int http_close_conn(http_request_t *r)
 {
@@ -17,9 +36,13 @@ int http_close_conn(http_request_t *r)
      * underlying open file description have been closed (or before if the
      * descriptor is explicitly removed using epoll_ctl(2) EPOLL_CTL_DEL).
      */
+#if (ENABLE_TLS)
+    tls_close(r);
+#endif
     close(r->fd);
-    free(r->buf);
+    http_release_request(r);
     free(r);
+    __sync_fetch_and_sub(&http_conns, 1);
     return 0;
 }
 
@@ -31,39 +54,145 @@ static int http_process_ignore(http_request_t *r UNUSED,
     return 0;
 }
 
+/* Connection is a comma separated list of options. It overrides the
+ * default of the HTTP version, which do_request() has set.
+ */
 static int http_process_connection(http_request_t *r UNUSED,
                                    http_out_t *out,
                                    char *data,
                                    int len)
 {
-    if (!strncasecmp("keep-alive", data, len))
-        out->keep_alive = true;
+    char *end = data + len;
+
+    while (data < end) {
+        while (data < end && (*data == ' ' || *data == ','))
+            data++;
+
+        char *token = data;
+        while (data < end && *data != ',' && *data != ' ')
+            data++;
+
+        int n = data - token;
+        if (n == 10 && !strncasecmp("keep-alive", token, n))
+            out->keep_alive = true;
+        else if (n == 5 && !strncasecmp("close", token, n))
+            out->keep_alive = false;
+    }
     return 0;
 }
 
+/* the validators are only kept here, do_request() compares them with the
+ * file once it knows which one is asked for
+ */
 static int http_process_if_modified_since(http_request_t *r UNUSED,
                                           http_out_t *out,
                                           char *data,
-                                          int len UNUSED)
+                                          int len)
 {
-    struct tm tm;
-    if (!strptime(data, "%a, %d %b %Y %H:%M:%S GMT", &tm))
-        return 0;
+    out->if_modified_since = http_parse_date(data, len);
+    return 0;
+}
+
+static int http_process_if_none_match(http_request_t *r UNUSED,
+                                      http_out_t *out,
+                                      char *data,
+                                      int len)
+{
+    out->if_none_match = data;
+    out->if_none_match_len = len;
+    return 0;
+}
 
-    time_t client_time = mktime(&tm);
-    double time_diff = difftime(out->mtime, client_time);
-    /* TODO: use custom absolute value function rather without libm */
-    if (fabs(time_diff) < 1e-6) { /* Not modified */
-        out->modified = false;
-        out->status = HTTP_NOT_MODIFIED;
+#if (ENABLE_HTTP2)
+/* Upgrade lists protocols the client would rather speak, h2c is HTTP/2 over
+ * cleartext TCP. HTTP2-Settings comes along with it.
+ */
+static int http_process_upgrade(http_request_t *r UNUSED,
+                                http_out_t *out,
+                                char *data,
+                                int len)
+{
+    char *end = data + len;
+
+    while (data < end) {
+        while (data < end && (*data == ' ' || *data == ','))
+            data++;
+
+        char *token = data;
+        while (data < end && *data != ',' && *data != ' ')
+            data++;
+
+        if (data - token == 3 && !strncasecmp("h2c", token, 3))
+            out->upgrade_h2c = true;
     }
     return 0;
 }
 
+static int http_process_http2_settings(http_request_t *r UNUSED,
+                                       http_out_t *out,
+                                       char *data,
+                                       int len)
+{
+    out->h2_settings = data;
+    out->h2_settings_len = len;
+    return 0;
+}
+#endif
+
+#if (ENABLE_PACK)
+/* Accept-Encoding lists content codings, each with an optional weight.
+ * Weight 0 refuses a coding.
+ */
+static int http_process_accept_encoding(http_request_t *r UNUSED,
+                                        http_out_t *out,
+                                        char *data,
+                                        int len)
+{
+    char *end = data + len;
+
+    while (data < end) {
+        while (data < end && (*data == ' ' || *data == ','))
+            data++;
+
+        char *token = data;
+        while (data < end && *data != ',' && *data != ';' && *data != ' ')
+            data++;
+        bool gzip = data - token == 4 && !strncasecmp("gzip", token, 4);
+
+        bool refused = false;
+        while (data < end && *data != ',') {
+            if (*data++ != ';')
+                continue;
+            while (data < end && *data == ' ')
+                data++;
+            if (end - data < 3 || (*data | 0x20) != 'q' || data[1] != '=')
+                continue;
+            data += 2;
+            char *q = data;
+            while (data < end && (*data == '0' || *data == '.'))
+                data++;
+            refused = *q == '0' && (data == end || *data == ',' ||
+                                    *data == ';' || *data == ' ');
+        }
+        if (gzip)
+            out->accept_gzip = !refused;
+    }
+    return 0;
+}
+#endif
+
 static http_header_handle_t http_headers_in[] = {
     {"Host", http_process_ignore},
     {"Connection", http_process_connection},
     {"If-Modified-Since", http_process_if_modified_since},
+    {"If-None-Match", http_process_if_none_match},
+#if (ENABLE_PACK)
+    {"Accept-Encoding", http_process_accept_encoding},
+#endif
+#if (ENABLE_HTTP2)
+    {"Upgrade", http_process_upgrade},
+    {"HTTP2-Settings", http_process_http2_settings},
+#endif
     {"", http_process_ignore}};
 
 void http_handle_header(http_request_t *r, http_out_t *o)
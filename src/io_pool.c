@@ -0,0 +1,89 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "io_pool.h"
+#include "logger.h"
+
+typedef struct {
+    void (*function)(void *);
+    void *arg;
+} io_job_t;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    io_job_t *jobs; /* ring buffer */
+    int size, in, out, count;
+} pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void *io_thread_cycle(void *arg UNUSED)
+{
+    while (1) {
+        pthread_mutex_lock(&pool.lock);
+        while (pool.count == 0)
+            pthread_cond_wait(&pool.cond, &pool.lock);
+        io_job_t job = pool.jobs[pool.out];
+        pool.out = (pool.out + 1) % pool.size;
+        pool.count--;
+        pthread_mutex_unlock(&pool.lock);
+
+        job.function(job.arg);
+    }
+    return NULL;
+}
+
+/* start the threads of the calling process, after fork(). The queue takes
+ * jobs only once a thread is there to run them: until then, and for good
+ * if none starts, io_offload() leaves them to the caller.
+ */
+int io_pool_init(int thread_count, int queue_size)
+{
+    pthread_t thread;
+    int started = 0;
+
+    pool.jobs = malloc(sizeof(io_job_t) * queue_size);
+    if (!pool.jobs)
+        return -1;
+
+    for (int i = 0; i < thread_count; i++) {
+        if (pthread_create(&thread, NULL, io_thread_cycle, NULL)) {
+            log_err("pthread_create");
+            break;
+        }
+        pthread_detach(thread);
+        started++;
+    }
+    if (!started) {
+        free(pool.jobs);
+        pool.jobs = NULL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.size = queue_size;
+    pthread_mutex_unlock(&pool.lock);
+    return 0;
+}
+
+/* run job(arg) on an I/O thread. Returns -1 if the queue is full or there
+ * are no I/O threads, the caller does the work itself then.
+ */
+int io_offload(void (*job)(void *), void *arg)
+{
+    pthread_mutex_lock(&pool.lock);
+    if (pool.count >= pool.size) {
+        pthread_mutex_unlock(&pool.lock);
+        return -1;
+    }
+    pool.jobs[pool.in].function = job;
+    pool.jobs[pool.in].arg = arg;
+    pool.in = (pool.in + 1) % pool.size;
+    pool.count++;
+    pthread_cond_signal(&pool.cond);
+    pthread_mutex_unlock(&pool.lock);
+    return 0;
+}
@@ -0,0 +1,13 @@
+#ifndef IO_POOL_H
+#define IO_POOL_H
+
+/* a few threads which do the file system work that would otherwise block
+ * the event loop: path lookups and reads missing the kernel caches
+ */
+#define IO_THREADS 4
+#define IO_QUEUE_SIZE 1024
+
+int io_pool_init(int thread_count, int queue_size);
+int io_offload(void (*job)(void *), void *arg);
+
+#endif
@@ -100,13 +100,25 @@ task_t *thpool_deq(thread_t *thread)
     return thread->buffer + out_offset;
 }
 
-void thpool_enq(thpool_t *lf_thpool, void (*task)(void *), void *arg)
+/* returns -1 if the workqueue of the chosen thread is full */
+int thpool_enq(thpool_t *lf_thpool, void (*task)(void *), void *arg)
 {
     thread_t *thread = round_robin_schedule(lf_thpool);
-    dispatch_task(thread, task, arg);
+    if (!dispatch_task(thread, task, arg))
+        return -1;
     if (__sync_val_compare_and_swap(&(thread->task_count), 0, 0) == 1) {
         pthread_kill(thread->thr, SIGUSR1);
     }
+    return 0;
+}
+
+/* tasks waiting in all workqueues */
+int thpool_pending(thpool_t *lf_thpool)
+{
+    int pending = 0;
+    for (int i = 0; i < lf_thpool->thread_count; ++i)
+        pending += (lf_thpool->threads + i)->task_count;
+    return pending;
 }
 
 thread_t *round_robin_schedule(thpool_t *lf_thpool)
@@ -119,10 +131,8 @@ thread_t *round_robin_schedule(thpool_t *lf_thpool)
 int dispatch_task(thread_t *thread, void (*task)(void *), void *arg)
 {
     if (__sync_val_compare_and_swap(&(thread->task_count), 0, 0) ==
-        thread->size) {
-        puts("workqueue full");
+        thread->size)
         return 0;
-    }
     (thread->buffer + thread->in)->function = task;
     (thread->buffer + thread->in)->arg = arg;
     __sync_fetch_and_add(&(thread->task_count), 1);
@@ -39,7 +39,8 @@ typedef struct {
 thpool_t *thpool_create(int thread_count, int queue_size);
 int thpool_destroy(thpool_t *lf_thpool);
 task_t *thpool_deq(thread_t *thread);
-void thpool_enq(thpool_t *lf_thpool, void (*task)(void *), void *arg);
+int thpool_enq(thpool_t *lf_thpool, void (*task)(void *), void *arg);
+int thpool_pending(thpool_t *lf_thpool);
 thread_t *round_robin_schedule(thpool_t *lf_thpool);
 int dispatch_task(thread_t *thread, void (*task)(void *), void *arg);
 
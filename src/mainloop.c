@@ -1,18 +1,38 @@
 #include <arpa/inet.h>
 #include <assert.h>
 #include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <wait.h>
 
 #include "http.h"
+#include "io_pool.h"
 #include "logger.h"
+#include "router.h"
 #include "timer.h"
+#if (ENABLE_TLS)
+#include "tls.h"
+#endif
+#if (ENABLE_ACCESS_LOG)
+#include "access_log.h"
+#endif
+#if (ENABLE_PROXY)
+#include "proxy.h"
+#endif
+#if (ENABLE_UPLOAD)
+#include "upload.h"
+#endif
+#if (ENABLE_PACK)
+#include "pack.h"
+#endif
 
 #if (ENABLE_THPOOL)
 #if (THPOOL)
@@ -32,9 +52,20 @@ thpool_t *thpool;
 #define THREAD_COUNT 32
 #define WORK_QUEUE_SIZE (2 << 16) /* 65536 */
 
+/* requests arriving while this many are queued get a 503 instead, so that
+ * the admitted ones are not stuck in the queue for longer than clients wait
+ */
+#define SHED_QUEUE_DEPTH (THREAD_COUNT * 64)
+
+/* how often a listener paused at MAX_CONNECTIONS is checked again */
+#define ACCEPT_RETRY 100 /* ms */
+
 /* TODO: use command line options to specify */
+#if (ENABLE_TLS)
+#define PORT 8443
+#else
 #define PORT 8081
-#define WEBROOT "./www"
+#endif
 
 bool master_process = false;
 int worker_processes = 4;
@@ -42,6 +73,14 @@ int worker_processes = 4;
 int epfd = -1;
 static struct epoll_event *events;
 
+static http_request_t *listen_request;
+static bool accept_paused = false;
+
+/* spare descriptor, given up to accept and turn away a connection when the
+ * process runs out of them
+ */
+static int reserve_fd = -1;
+
 void event_init()
 {
     assert(epfd == -1);
@@ -54,18 +93,101 @@ void event_init()
     assert(events && "epoll_event: malloc");
 }
 
+/* requests start on a cache line, so that their hot fields share one */
+static http_request_t *alloc_request()
+{
+    void *p;
+    if (posix_memalign(&p, CACHE_LINE_SIZE, sizeof(http_request_t)))
+        return NULL;
+    return p;
+}
+
 void request_init(int listenfd)
 {
-    http_request_t *request = malloc(sizeof(http_request_t));
-    init_http_request(request, listenfd, epfd, WEBROOT);
+    http_request_t *request = alloc_request();
+    init_http_request(request, listenfd, epfd);
 
     struct epoll_event event = {
         .data.ptr = request,
         .events = EPOLLIN | EPOLLET | EPOLLEXCLUSIVE,
     };
     epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &event);
+
+    listen_request = request;
+    reserve_fd = open("/dev/null", O_RDONLY);
+}
+
+/* stop watching the listen socket at MAX_CONNECTIONS, new connections wait
+ * in its backlog. EPOLLEXCLUSIVE cannot be modified, so it is removed and
+ * added again, which also reports connections that queued up meanwhile.
+ */
+static void pause_accept(bool pause)
+{
+    if (pause == accept_paused)
+        return;
+
+    if (pause) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, listen_request->fd, NULL);
+    } else {
+        struct epoll_event event = {
+            .data.ptr = listen_request,
+            .events = EPOLLIN | EPOLLET | EPOLLEXCLUSIVE,
+        };
+        epoll_ctl(epfd, EPOLL_CTL_ADD, listen_request->fd, &event);
+    }
+    accept_paused = pause;
 }
 
+/* answer 503 without looking at the request. The response is prebuilt
+ * except for the Date header. fd must be non-blocking.
+ */
+static void reject_connection(int fd)
+{
+#if (ENABLE_TLS)
+    /* the client expects a handshake, closing is all it understands */
+    (void) fd;
+#else
+    static char head[] =
+        "HTTP/1.1 503 Service Unavailable\r\n"
+        "Server: seHTTPd\r\n"
+        "Retry-After: 1\r\n"
+        "Connection: close\r\n"
+        "Content-Length: 0\r\n"
+        "Date: ";
+    static char tail[] = "\r\n\r\n";
+    const char *date = time_http_date();
+    struct iovec iov[] = {
+        {head, sizeof(head) - 1},
+        {(char *) date, strlen(date)},
+        {tail, sizeof(tail) - 1},
+    };
+    char discard[4096];
+
+    if (writev(fd, iov, 3) < 0)
+        return;
+
+    /* closing with unread data resets the connection, which could make
+     * the client lose the response
+     */
+    shutdown(fd, SHUT_WR);
+    while (read(fd, discard, sizeof(discard)) > 0)
+        ;
+#endif
+}
+
+#if (ENABLE_THPOOL)
+static void shed_request(http_request_t *r)
+{
+    /* a response already begun cannot be replaced, and an HTTP/2 client
+     * would not understand this one
+     */
+    if (!r->writing && !r->h2 && !r->proxy && !r->req_body)
+        reject_connection(r->fd);
+    del_timer(r);
+    http_close_conn(r);
+}
+#endif
+
 /* set a socket non-blocking. If a listen socket is a blocking socket, after
  * it comes out from epoll and accepts the last connection, the next accpet
  * will block unexpectedly.
@@ -130,6 +252,11 @@ void accept_connection(int listenfd)
 {
     /* we hava one or more incoming connections */
     while (1) {
+        if (http_conns >= MAX_CONNECTIONS) {
+            pause_accept(true);
+            break;
+        }
+
         socklen_t inlen = 1;
         struct sockaddr_in clientaddr;
         int infd = accept(listenfd, (struct sockaddr *) &clientaddr, &inlen);
@@ -138,6 +265,26 @@ void accept_connection(int listenfd)
                 /* we have processed all incoming connections */
                 break;
             }
+            if (errno == ECONNABORTED || errno == EINTR)
+                continue;
+
+            /* out of descriptors: the listen socket is edge-triggered, so
+             * the backlog has to be drained, or it never reports again
+             */
+            if ((errno == EMFILE || errno == ENFILE) && reserve_fd >= 0) {
+                close(reserve_fd);
+                infd = accept(listenfd, NULL, NULL);
+                if (infd >= 0) {
+                    sock_set_non_blocking(infd);
+                    reject_connection(infd);
+                    close(infd);
+                }
+                reserve_fd = open("/dev/null", O_RDONLY);
+                if (infd >= 0)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    break;
+            }
             log_err("accept");
             break;
         }
@@ -145,42 +292,84 @@ void accept_connection(int listenfd)
         int rc UNUSED = sock_set_non_blocking(infd);
         assert(rc == 0 && "sock_set_non_blocking");
 
-        http_request_t *request = malloc(sizeof(http_request_t));
+        /* the response header and body are written separately, so do not
+         * let Nagle hold back the body until the client's delayed ACK
+         */
+        int optval = 1;
+        setsockopt(infd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+
+        http_request_t *request = alloc_request();
         if (!request) {
-            log_err("malloc");
+            log_err("posix_memalign");
             break;
         }
 
-        init_http_request(request, infd, epfd, WEBROOT);
+        init_http_request(request, infd, epfd);
+        __sync_fetch_and_add(&http_conns, 1);
 
         struct epoll_event event;
         event.data.ptr = request;
         event.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
         epoll_ctl(epfd, EPOLL_CTL_ADD, infd, &event);
 
-        add_timer(request, TIMEOUT_DEFAULT, http_close_conn);
+        add_timer(request, TIMEOUT_HEADER, http_expire);
+        request->read_deadline = request->deadline;
     }
 }
 
 void process_events(int listenfd)
 {
-    int n = epoll_wait(epfd, events, MAXEVENTS, find_timer());
+    int timeout = find_timer();
+
+    /* connections closing do not wake up the loop */
+    if (accept_paused) {
+        if (http_conns < MAX_CONNECTIONS)
+            pause_accept(false);
+        else if (timeout < 0 || timeout > ACCEPT_RETRY)
+            timeout = ACCEPT_RETRY;
+    }
+
+    int n = epoll_wait(epfd, events, MAXEVENTS, timeout);
+    time_update();
     for (int i = 0; i < n; i++) {
         http_request_t *r = events[i].data.ptr;
         int fd = r->fd;
         if (listenfd == fd) {
             accept_connection(listenfd);
         } else {
-            if ((events[i].events & EPOLLERR) ||
-                (events[i].events & EPOLLHUP) ||
-                (!(events[i].events & EPOLLIN))) {
+            /* MSG_ZEROCOPY completions are reported as errors, the
+             * connection goes on as if woken up for nothing
+             */
+            bool reaped = (events[i].events & EPOLLERR) &&
+                          r->zc_sent != r->zc_done && http_reap_zerocopy(r);
+            /* a request being forwarded may have its upstream connection
+             * fail, the proxy answers the client then
+             */
+            if (!reaped &&
+                ((events[i].events & EPOLLERR) ||
+                 (events[i].events & EPOLLHUP) ||
+                 (!(events[i].events & (EPOLLIN | EPOLLOUT)))) &&
+                !r->proxy) {
                 log_err("epoll error fd: %d", r->fd);
-                close(fd);
+                del_timer(r);
+                http_close_conn(r);
                 continue;
             }
+
+            /* keep the timer from closing the connection while it is
+             * served, possibly by another thread
+             */
+            r->deadline = TIMER_ACTIVE;
             if (!master_process) {
 #if (ENABLE_THPOOL)
-                thpool_enq(thpool, do_request, events[i].data.ptr);
+                /* responses already being written, and request bodies
+                 * being received, are never shed
+                 */
+                if ((!r->writing &&
+                     thpool_pending(thpool) >= SHED_QUEUE_DEPTH &&
+                     !r->proxy && !r->req_body) ||
+                    thpool_enq(thpool, do_request, r) < 0)
+                    shed_request(r);
                 continue;
 #endif
             }
@@ -220,6 +409,12 @@ void single_process_cycle(int listenfd)
     event_init();
     timer_init();
     request_init(listenfd);
+    if (io_pool_init(IO_THREADS, IO_QUEUE_SIZE) < 0)
+        log_err("no I/O threads, cold files block the event loop");
+#if (ENABLE_ACCESS_LOG)
+    if (access_log_start() < 0)
+        log_err("no access log flusher, requests are not logged");
+#endif
 
     if (!master_process) {
 #if (ENABLE_THPOOL)
@@ -292,6 +487,39 @@ int main()
 
     int listenfd = -1;
 
+    if (router_init() < 0)
+        return 1;
+    /* routes of your own are added here, with router_add() */
+    if (router_compile() < 0)
+        return 1;
+
+#if (ENABLE_TLS)
+    if (tls_init(TLS_CERT, TLS_KEY) < 0) {
+        log_err("cannot load %s and %s", TLS_CERT, TLS_KEY);
+        return 1;
+    }
+#endif
+
+#if (ENABLE_PROXY)
+    if (proxy_init() < 0)
+        return 1;
+#endif
+
+#if (ENABLE_UPLOAD)
+    if (upload_init() < 0)
+        return 1;
+#endif
+
+#if (ENABLE_PACK)
+    /* without a pack, files come from WEBROOT until one is put in place */
+    pack_init();
+#endif
+
+#if (ENABLE_ACCESS_LOG)
+    if (access_log_init(ACCESS_LOG) < 0)
+        log_err("cannot open %s, requests are not logged", ACCESS_LOG);
+#endif
+
 #if !defined(ENABLE_SO_REUSEPORT)
     listenfd = open_listenfd(PORT);
 #endif
@@ -0,0 +1,236 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "pack.h"
+#include "timer.h"
+
+/* a pack file mapped into memory. Requests hold a reference while they
+ * look into it, the one in use holds another, and the last one to let go
+ * unmaps it. Bodies are sent from a dup() of fd, which outlives both.
+ */
+struct pack {
+    const char *map;
+    size_t size;
+    int fd;
+    dev_t dev;
+    ino_t ino;
+    const pack_header_t *header;
+    const uint32_t *seeds;
+    const pack_entry_t *index;
+    int refs;
+};
+
+static pack_t *current;
+static size_t checked; /* ms, when PACK_FILE was last looked at */
+static struct stat rejected; /* the last file which was not a pack */
+
+#if (ENABLE_THPOOL)
+static pthread_mutex_t pack_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static inline void pack_lock_acquire()
+{
+#if (ENABLE_THPOOL)
+    pthread_mutex_lock(&pack_lock);
+#endif
+}
+
+static inline void pack_lock_release()
+{
+#if (ENABLE_THPOOL)
+    pthread_mutex_unlock(&pack_lock);
+#endif
+}
+
+static inline bool within(const pack_t *p, uint64_t off, uint64_t len)
+{
+    return off <= p->size && len <= p->size - off;
+}
+
+static bool valid_variant(const pack_t *p, const pack_variant_t *v)
+{
+    return within(p, v->off, v->len) && within(p, v->header, v->header_len) &&
+           v->validators_len <= v->header_len &&
+           memchr(v->etag_str, '\0', sizeof(v->etag_str)) &&
+           memchr(v->last_modified, '\0', sizeof(v->last_modified));
+}
+
+/* everything the index points at is checked once here, so that lookups
+ * can trust it
+ */
+static bool valid_pack(pack_t *p)
+{
+    const pack_header_t *h = (const pack_header_t *) p->map;
+
+    if (p->size < sizeof(pack_header_t) ||
+        memcmp(h->magic, PACK_MAGIC, sizeof(h->magic)) || h->size != p->size ||
+        (h->nentries && !h->nbuckets) || h->seeds % sizeof(uint32_t) ||
+        h->index % sizeof(uint64_t) ||
+        !within(p, h->seeds, (uint64_t) h->nbuckets * sizeof(uint32_t)) ||
+        !within(p, h->index, (uint64_t) h->nentries * sizeof(pack_entry_t)))
+        return false;
+
+    p->header = h;
+    p->seeds = (const uint32_t *) (p->map + h->seeds);
+    p->index = (const pack_entry_t *) (p->map + h->index);
+
+    for (uint32_t i = 0; i < h->nentries; i++) {
+        const pack_entry_t *e = &p->index[i];
+        if (!within(p, e->path, (uint64_t) e->path_len + 1) ||
+            p->map[e->path + e->path_len] != '\0' ||
+            !valid_variant(p, &e->plain) ||
+            (e->gzip.header_len && !valid_variant(p, &e->gzip)))
+            return false;
+    }
+    return true;
+}
+
+static pack_t *pack_open(const char *path)
+{
+    struct stat st;
+    pack_t *p = malloc(sizeof(pack_t));
+
+    if (!p)
+        return NULL;
+    p->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (p->fd < 0) {
+        free(p);
+        return NULL;
+    }
+    if (fstat(p->fd, &st) < 0 || st.st_size < (off_t) sizeof(pack_header_t))
+        goto invalid;
+
+    p->size = st.st_size;
+    p->dev = st.st_dev;
+    p->ino = st.st_ino;
+    p->map = mmap(NULL, p->size, PROT_READ, MAP_SHARED, p->fd, 0);
+    if (p->map == MAP_FAILED)
+        goto invalid;
+    if (!valid_pack(p)) {
+        munmap((void *) p->map, p->size);
+        goto invalid;
+    }
+    p->refs = 1;
+    return p;
+
+invalid:
+    log_err("%s is not a pack", path);
+    close(p->fd);
+    free(p);
+    return NULL;
+}
+
+static void pack_put(pack_t *p)
+{
+    if (--p->refs)
+        return;
+    munmap((void *) p->map, p->size);
+    close(p->fd);
+    free(p);
+}
+
+/* map PACK_FILE before worker processes fork, if there is one */
+int pack_init()
+{
+    current = pack_open(PACK_FILE);
+    return current ? 0 : -1;
+}
+
+/* take up a pack which replaced the one in use, or drop it if it was
+ * removed. A new pack which cannot be used leaves the old one in place.
+ */
+static void pack_check()
+{
+    struct stat st;
+
+    if (stat(PACK_FILE, &st) < 0) {
+        if (errno == ENOENT && current) {
+            pack_put(current);
+            current = NULL;
+        }
+        return;
+    }
+    if (current && st.st_dev == current->dev && st.st_ino == current->ino)
+        return;
+    if (st.st_dev == rejected.st_dev && st.st_ino == rejected.st_ino &&
+        st.st_size == rejected.st_size &&
+        st.st_mtim.tv_sec == rejected.st_mtim.tv_sec &&
+        st.st_mtim.tv_nsec == rejected.st_mtim.tv_nsec)
+        return; /* not again, until it changes */
+
+    pack_t *p = pack_open(PACK_FILE);
+    if (!p) {
+        rejected = st;
+        return;
+    }
+    if (current)
+        pack_put(current);
+    current = p;
+}
+
+/* the pack in use, held until pack_release(), or NULL if there is none */
+pack_t *pack_acquire()
+{
+    pack_lock_acquire();
+    if (time_msec() - checked >= PACK_CHECK) {
+        checked = time_msec();
+        pack_check();
+    }
+    pack_t *p = current;
+    if (p)
+        p->refs++;
+    pack_lock_release();
+    return p;
+}
+
+void pack_release(pack_t *p)
+{
+    pack_lock_acquire();
+    pack_put(p);
+    pack_lock_release();
+}
+
+/* the file at path, as http_normalize_uri() makes it */
+const pack_entry_t *pack_lookup(const pack_t *p, const char *path, size_t len)
+{
+    const pack_header_t *h = p->header;
+
+    if (!h->nentries)
+        return NULL;
+
+    uint64_t hash = pack_hash(path, len);
+    uint32_t seed = p->seeds[pack_mix(hash, 0) % h->nbuckets];
+    const pack_entry_t *e = &p->index[pack_mix(hash, seed) % h->nentries];
+
+    if (e->path_len != len || memcmp(p->map + e->path, path, len))
+        return NULL;
+    return e;
+}
+
+const char *pack_data(const pack_t *p, uint64_t off)
+{
+    return p->map + off;
+}
+
+/* a descriptor of the pack file, to send bodies from with sendfile() */
+int pack_dup(const pack_t *p)
+{
+    return fcntl(p->fd, F_DUPFD_CLOEXEC, 0);
+}
+
+void pack_meta(const pack_variant_t *v, file_meta_t *m)
+{
+    m->size = v->len;
+    m->mtime = v->mtime;
+    m->etag = v->etag;
+    memcpy(m->etag_str, v->etag_str, sizeof(m->etag_str));
+    memcpy(m->last_modified, v->last_modified, sizeof(m->last_modified));
+}
@@ -0,0 +1,97 @@
+#ifndef PACK_H
+#define PACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "file_cache.h"
+
+/* the files of the web root packed into one by mkpack. Paths found in it
+ * are served from it, others from the web root.
+ */
+#define PACK_FILE "./www.pack"
+
+/* how often the pack file is looked at, to take up one put in its place */
+#define PACK_CHECK 1000 /* ms */
+
+#define PACK_MAGIC "SEPACK01"
+
+/* The layout of a pack, all numbers in the byte order of the machine:
+ *
+ *   pack_header_t
+ *   uint32_t seeds[nbuckets]
+ *   pack_entry_t index[nentries]
+ *   bodies
+ *   paths and header lines
+ *
+ * A path is looked up by a minimal perfect hash: its FNV-1a hash picks a
+ * bucket, and the seed of that bucket mixed into the hash picks its slot
+ * in the index. mkpack chose the seeds so that no two paths share a slot.
+ */
+typedef struct {
+    char magic[8];     /* PACK_MAGIC */
+    uint64_t size;     /* of the whole pack */
+    uint32_t nentries; /* files, each in one slot of the index */
+    uint32_t nbuckets; /* seeds of the perfect hash */
+    uint64_t seeds;    /* offset of the seeds */
+    uint64_t index;    /* offset of the index */
+} pack_header_t;
+
+/* one representation of a file: its body, and the header lines telling
+ * about it
+ */
+typedef struct {
+    uint64_t off, len;       /* of the body */
+    uint64_t header;         /* offset of the header lines */
+    uint32_t header_len;     /* 0 if the file has no such variant */
+    uint32_t validators_len; /* of the leading lines, which a 304 repeats */
+    uint64_t etag;           /* FNV-1a of the body */
+    int64_t mtime;
+    char etag_str[19];
+    char last_modified[30];
+} pack_variant_t;
+
+typedef struct {
+    uint64_t path; /* offset of the path, NUL terminated */
+    uint32_t path_len;
+    uint32_t reserved;
+    pack_variant_t plain, gzip; /* gzip comes from <file>.gz, if there */
+} pack_entry_t;
+
+_Static_assert(sizeof(pack_header_t) == 40 && sizeof(pack_variant_t) == 104 &&
+                   sizeof(pack_entry_t) == 224,
+               "the layout of a pack does not depend on the compiler");
+
+static inline uint64_t pack_hash(const char *path, size_t len)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (unsigned char) path[i]) * 1099511628211ULL;
+    return h;
+}
+
+/* spreads a hash, with seed 0 for the bucket and a bucket's seed for the
+ * slot
+ */
+static inline uint64_t pack_mix(uint64_t h, uint32_t seed)
+{
+    h ^= seed * 0x9e3779b97f4a7c15ULL;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+typedef struct pack pack_t;
+
+int pack_init();
+pack_t *pack_acquire();
+void pack_release(pack_t *p);
+const pack_entry_t *pack_lookup(const pack_t *p, const char *path, size_t len);
+const char *pack_data(const pack_t *p, uint64_t off);
+int pack_dup(const pack_t *p);
+void pack_meta(const pack_variant_t *v, file_meta_t *m);
+
+#endif
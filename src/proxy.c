@@ -0,0 +1,865 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* for memmem(3) */
+#endif
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "buffer.h"
+#include "logger.h"
+#include "proxy.h"
+#include "timer.h"
+
+typedef struct {
+    const char *name;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    int in_flight;        /* requests of this worker forwarded to it */
+    int idle[PROXY_POOL]; /* keep-alive connections, the latest last */
+    int nidle;
+} upstream_t;
+
+static const char *upstream_names[] = PROXY_UPSTREAMS;
+
+#define NUPSTREAMS (int) (sizeof(upstream_names) / sizeof(upstream_names[0]))
+
+_Static_assert(NUPSTREAMS <= 32, "PROXY_UPSTREAMS lists at most 32");
+
+/* the pools belong to the worker process, fork() leaves them empty */
+static upstream_t upstreams[NUPSTREAMS];
+
+#if (ENABLE_THPOOL)
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+enum proxy_state {
+    PROXY_CONNECT,    /* connect() is in progress */
+    PROXY_CONNECTING, /* woken up once it is done */
+    PROXY_SEND,       /* writing the request */
+    PROXY_SEND_BODY,  /* passing the request body on */
+    PROXY_HEADER,     /* reading the response header */
+    PROXY_BODY,       /* passing the response on */
+};
+
+/* how the end of the response body is found */
+enum proxy_framing {
+    FRAME_LENGTH,  /* Content-Length */
+    FRAME_CHUNKED, /* Transfer-Encoding: chunked, followed chunk by chunk */
+    FRAME_EOF,     /* the upstream closes the connection */
+};
+
+/* every line ends in CRLF, as http_parse_chunked() has it for requests */
+enum chunk_state {
+    CHUNK_START,         /* the first hex digit of the size */
+    CHUNK_SIZE,
+    CHUNK_EXT,           /* rest of the chunk size line */
+    CHUNK_SIZE_LF,
+    CHUNK_DATA,          /* left bytes of chunk data */
+    CHUNK_DATA_END,      /* CRLF after the data */
+    CHUNK_DATA_LF,
+    CHUNK_TRAILER_START, /* a trailer field, or the empty line ending it all */
+    CHUNK_TRAILER,
+    CHUNK_TRAILER_LF,
+    CHUNK_LAST_LF,
+    CHUNK_DONE,
+};
+
+/* a request being forwarded. Only one of the two sockets is waited for at
+ * a time, so that a request is never handled by two threads at once.
+ */
+typedef struct {
+    upstream_t *up;
+    int fd; /* to the upstream */
+    bool reused;
+    unsigned failed; /* upstreams which could not be reached, by index */
+    int state;
+
+    char *req; /* to the upstream */
+    size_t req_len, req_pos;
+
+    char *buf; /* the request body going up, then the response, BUF_SIZE */
+    size_t buf_len;
+    size_t buf_pos;  /* of the request body in buf, sent up to here */
+    bool chunked;    /* so is the request body */
+    bool body_taken; /* the request cannot be sent again */
+    bool body_done;
+    char *head; /* the response header for the client */
+    char *out;  /* bytes to write to the client, in head or buf */
+    size_t out_len, out_pos;
+
+    int framing;
+    int chunk;
+    size_t left; /* of the body, or of the chunk */
+    bool done;   /* the whole response is in out */
+    bool keep;   /* the upstream connection can serve another request */
+    bool http10; /* the client speaks HTTP/1.0 and so does the upstream */
+} proxy_t;
+
+static inline void pool_lock_acquire()
+{
+#if (ENABLE_THPOOL)
+    pthread_mutex_lock(&pool_lock);
+#endif
+}
+
+static inline void pool_lock_release()
+{
+#if (ENABLE_THPOOL)
+    pthread_mutex_unlock(&pool_lock);
+#endif
+}
+
+/* parse PROXY_UPSTREAMS, before worker processes fork */
+int proxy_init()
+{
+    for (int i = 0; i < NUPSTREAMS; i++) {
+        upstream_t *u = &upstreams[i];
+        const char *name = upstream_names[i];
+
+        u->name = name;
+        if (!strncmp(name, "unix:", 5)) {
+            struct sockaddr_un *sun = (struct sockaddr_un *) &u->addr;
+            if (strlen(name + 5) >= sizeof(sun->sun_path))
+                goto error;
+            sun->sun_family = AF_UNIX;
+            strcpy(sun->sun_path, name + 5);
+            u->addr_len = sizeof(*sun);
+            continue;
+        }
+
+        struct sockaddr_in *sin = (struct sockaddr_in *) &u->addr;
+        char host[INET_ADDRSTRLEN];
+        const char *colon = strrchr(name, ':');
+        int port = colon ? atoi(colon + 1) : 0;
+        if (!colon || colon - name >= INET_ADDRSTRLEN || port <= 0 ||
+            port > 65535)
+            goto error;
+        memcpy(host, name, colon - name);
+        host[colon - name] = '\0';
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(port);
+        if (inet_pton(AF_INET, host, &sin->sin_addr) != 1)
+            goto error;
+        u->addr_len = sizeof(*sin);
+    }
+    return 0;
+
+error:
+    log_err("bad upstream in PROXY_UPSTREAMS");
+    return -1;
+}
+
+/* the upstream with the fewest requests in flight, of those not failed.
+ * Ties go round, so that a light load is still spread. The pool lock is
+ * held.
+ */
+static upstream_t *pick_upstream(unsigned failed)
+{
+    static unsigned next;
+    unsigned start = __atomic_fetch_add(&next, 1, __ATOMIC_RELAXED);
+    upstream_t *best = NULL;
+
+    for (int n = 0; n < NUPSTREAMS; n++) {
+        int i = (start + n) % NUPSTREAMS;
+        if (failed & (1U << i))
+            continue;
+        if (!best || upstreams[i].in_flight < best->in_flight)
+            best = &upstreams[i];
+    }
+    return best;
+}
+
+/* an idle connection closed by the upstream reads as EOF */
+static bool conn_alive(int fd)
+{
+    char c;
+    return recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && errno == EAGAIN;
+}
+
+/* done with the upstream connection, pool it if it can be used again */
+static void release_conn(proxy_t *p, bool keep)
+{
+    upstream_t *u = p->up;
+    int fd = p->fd;
+
+    pool_lock_acquire();
+    u->in_flight--;
+    if (keep && u->nidle < PROXY_POOL) {
+        u->idle[u->nidle++] = fd;
+        fd = -1;
+    }
+    pool_lock_release();
+
+    if (fd >= 0)
+        close(fd);
+    p->fd = -1;
+}
+
+/* take a pooled connection to an upstream, or start connecting to one.
+ * Returns -1 if none can be reached.
+ */
+static int connect_upstream(proxy_t *p)
+{
+    for (;;) {
+        int fd = -1;
+
+        pool_lock_acquire();
+        upstream_t *u = pick_upstream(p->failed);
+        if (u) {
+            u->in_flight++;
+            if (u->nidle)
+                fd = u->idle[--u->nidle];
+        }
+        pool_lock_release();
+
+        p->up = u;
+        if (!u)
+            return -1;
+
+        if (fd >= 0) {
+            if (conn_alive(fd)) {
+                p->fd = fd;
+                p->reused = true;
+                p->state = PROXY_SEND;
+                return 0;
+            }
+            p->fd = fd;
+            release_conn(p, false);
+            continue;
+        }
+
+        fd = socket(u->addr.ss_family,
+                    SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd >= 0 && u->addr.ss_family == AF_INET) {
+            int optval = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+        }
+        if (fd >= 0) {
+            int rc = connect(fd, (struct sockaddr *) &u->addr, u->addr_len);
+            if (rc == 0 || errno == EINPROGRESS) {
+                p->fd = fd;
+                p->reused = false;
+                p->state = rc == 0 ? PROXY_SEND : PROXY_CONNECT;
+                return 0;
+            }
+        }
+
+        log_err("cannot connect to upstream %s", u->name);
+        p->fd = fd;
+        release_conn(p, false);
+        p->failed |= 1U << (u - upstreams);
+    }
+}
+
+/* the request could not be sent, or got no answer. Nothing has reached
+ * the client yet, so it goes to a fresh connection: of the same upstream
+ * if a pooled one went stale, to another if the upstream failed.
+ */
+static int retry(proxy_t *p)
+{
+    if (!p->reused)
+        p->failed |= 1U << (p->up - upstreams);
+    release_conn(p, false);
+    /* the request body is read from the client only once */
+    if (p->body_taken)
+        return HTTP_BAD_GATEWAY;
+    p->req_pos = 0;
+    p->buf_len = 0;
+    return connect_upstream(p) < 0 ? HTTP_BAD_GATEWAY : 0;
+}
+
+static bool is_hop_by_hop(const char *name, size_t len)
+{
+    static const char *const names[] = {
+        "Connection", "Keep-Alive", "Proxy-Connection", "TE",
+        "Trailer",    "Upgrade",    "HTTP2-Settings",   NULL,
+    };
+
+    for (int i = 0; names[i]; i++) {
+        if (strlen(names[i]) == len && !strncasecmp(names[i], name, len))
+            return true;
+    }
+    return false;
+}
+
+static inline bool is_field(const http_header_t *hd, const char *name)
+{
+    size_t len = strlen(name);
+    return (size_t) ((char *) hd->key_end - (char *) hd->key_start) == len &&
+           !strncasecmp(hd->key_start, name, len);
+}
+
+/* whether the client named the field in a Connection header, as one which
+ * only concerns its connection to this server
+ */
+static bool is_listed(http_request_t *r, const char *name, size_t len)
+{
+    list_head *pos;
+
+    list_for_each (pos, &(r->list)) {
+        http_header_t *hd = list_entry(pos, http_header_t, list);
+        if (!is_field(hd, "Connection"))
+            continue;
+
+        const char *v = hd->value_start, *end = hd->value_end;
+        while (v < end) {
+            while (v < end && (*v == ',' || *v == ' ' || *v == '\t'))
+                v++;
+            const char *token = v;
+            while (v < end && *v != ',' && *v != ' ' && *v != '\t')
+                v++;
+            if ((size_t) (v - token) == len && !strncasecmp(token, name, len))
+                return true;
+        }
+    }
+    return false;
+}
+
+/* the request line and header fields of r for the upstream, without the
+ * fields which only concern the connection to the client. The address of
+ * the client is added to X-Forwarded-For, after those of the proxies it
+ * came through.
+ */
+static int build_request(http_request_t *r, proxy_t *p)
+{
+    char peer[INET_ADDRSTRLEN] = "unknown";
+    struct sockaddr_in sin;
+    socklen_t sin_len = sizeof(sin);
+    if (!getpeername(r->fd, (struct sockaddr *) &sin, &sin_len) &&
+        sin.sin_family == AF_INET)
+        inet_ntop(AF_INET, &sin.sin_addr, peer, sizeof(peer));
+
+    size_t line = (char *) r->uri_end - (char *) r->request_start;
+    size_t size = line + SHORTLINE;
+    list_head *pos;
+    list_for_each (pos, &(r->list)) {
+        http_header_t *hd = list_entry(pos, http_header_t, list);
+        size += (char *) hd->key_end - (char *) hd->key_start +
+                (char *) hd->value_end - (char *) hd->value_start + 4;
+    }
+
+    char *req = malloc(size);
+    if (!req)
+        return -1;
+
+    memcpy(req, r->request_start, line);
+    size_t len = line;
+    len += sprintf(req + len, " HTTP/1.%d\r\n", p->http10 ? 0 : 1);
+
+    list_for_each (pos, &(r->list)) {
+        http_header_t *hd = list_entry(pos, http_header_t, list);
+        char *key = hd->key_start, *value = hd->value_start;
+        size_t key_len = (char *) hd->key_end - key;
+        size_t value_len = (char *) hd->value_end - value;
+
+        /* a chunked body is chunked anew, and 100 Continue is sent by
+         * this server
+         */
+        if ((key_len == 17 && !strncasecmp(key, "Transfer-Encoding", 17)) ||
+            (key_len == 6 && !strncasecmp(key, "Expect", 6)))
+            continue;
+        if (is_hop_by_hop(key, key_len) || is_listed(r, key, key_len) ||
+            is_field(hd, "X-Forwarded-For"))
+            continue;
+
+        memcpy(req + len, key, key_len);
+        len += key_len;
+        req[len++] = ':';
+        req[len++] = ' ';
+        memcpy(req + len, value, value_len);
+        len += value_len;
+        req[len++] = '\r';
+        req[len++] = '\n';
+    }
+
+    /* the header list holds the fields the latest first */
+    len += sprintf(req + len, "X-Forwarded-For: ");
+    for (pos = r->list.prev; pos != &(r->list); pos = pos->prev) {
+        http_header_t *hd = list_entry(pos, http_header_t, list);
+        size_t value_len = (char *) hd->value_end - (char *) hd->value_start;
+        if (!is_field(hd, "X-Forwarded-For") || !value_len)
+            continue;
+        memcpy(req + len, hd->value_start, value_len);
+        len += value_len;
+        len += sprintf(req + len, ", ");
+    }
+    len += sprintf(req + len, "%s\r\n%s%s\r\n", peer,
+                   p->chunked ? "Transfer-Encoding: chunked\r\n" : "",
+                   p->http10 ? "Connection: close\r\n" : "");
+    p->req = req;
+    p->req_len = len;
+    return 0;
+}
+
+/* start forwarding r, whose header list is still to be handled. Returns 0,
+ * or the status to answer with instead.
+ */
+int proxy_start(http_request_t *r)
+{
+    proxy_t *p = calloc(1, sizeof(proxy_t));
+    if (!p)
+        return -1;
+    p->fd = -1;
+    p->http10 = r->http_major == 1 && r->http_minor == 0;
+    p->chunked = r->req_body == HTTP_BODY_CHUNKED;
+
+    int rc = build_request(r, p);
+    if (rc == 0 && !(p->buf = buf_get(BUF_SIZE)))
+        rc = -1;
+    if (rc == 0 && connect_upstream(p) < 0)
+        rc = HTTP_BAD_GATEWAY;
+
+    r->proxy = p;
+    r->write_start = time_msec();
+    r->out_sent = 0;
+    if (rc != 0)
+        proxy_release(r);
+    return rc;
+}
+
+/* room kept in buf for the chunk around the data, and for the last one */
+#define CHUNK_FRAME 20 /* "%zx\r\n", "\r\n" */
+#define LAST_CHUNK "0\r\n\r\n"
+
+/* copy body bytes into buf for the upstream, as a chunk if they came in
+ * chunks
+ */
+static ssize_t forward_body(http_request_t *r, const char *data, size_t len)
+{
+    proxy_t *p = r->proxy;
+    size_t room = BUF_SIZE - p->buf_len;
+
+    if (p->chunked) {
+        if (room <= CHUNK_FRAME + sizeof(LAST_CHUNK))
+            return 0;
+        room -= CHUNK_FRAME + sizeof(LAST_CHUNK);
+        if (len > room)
+            len = room;
+        p->buf_len += sprintf(p->buf + p->buf_len, "%zx\r\n", len);
+        memcpy(p->buf + p->buf_len, data, len);
+        p->buf_len += len;
+        memcpy(p->buf + p->buf_len, "\r\n", 2);
+        p->buf_len += 2;
+    } else {
+        if (len > room)
+            len = room;
+        memcpy(p->buf + p->buf_len, data, len);
+        p->buf_len += len;
+    }
+    return len;
+}
+
+static int wait_for(http_request_t *r, int fd, int events, size_t timeout)
+{
+    struct epoll_event event = {
+        .data.ptr = r,
+        .events = events | EPOLLET | EPOLLONESHOT,
+    };
+
+    timer_set_deadline(r, time_msec() + timeout);
+    /* connections are added once, and stay while pooled */
+    if (epoll_ctl(r->epfd, EPOLL_CTL_MOD, fd, &event) < 0 && errno == ENOENT)
+        epoll_ctl(r->epfd, EPOLL_CTL_ADD, fd, &event);
+    return EINPROGRESS;
+}
+
+static inline int hex_digit(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    c |= 0x20;
+    return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+/* how many of n bytes from the upstream belong to the response, or -1 if
+ * its chunks are malformed. Sets done when the end of it is among them.
+ */
+static ssize_t frame(proxy_t *p, const char *data, size_t n)
+{
+    size_t i = 0;
+
+    switch (p->framing) {
+    case FRAME_EOF:
+        return n;
+    case FRAME_LENGTH:
+        if (n >= p->left) {
+            n = p->left;
+            p->done = true;
+        }
+        p->left -= n;
+        return n;
+    }
+
+    while (i < n && p->chunk != CHUNK_DONE) {
+        char c = data[i];
+        int d;
+
+        switch (p->chunk) {
+        case CHUNK_DATA: {
+            size_t k = n - i < p->left ? n - i : p->left;
+            p->left -= k;
+            if (!p->left)
+                p->chunk = CHUNK_DATA_END;
+            i += k;
+            continue;
+        }
+        case CHUNK_START:
+            if ((d = hex_digit(c)) < 0)
+                return -1;
+            p->left = d;
+            p->chunk = CHUNK_SIZE;
+            break;
+        case CHUNK_SIZE:
+            if ((d = hex_digit(c)) >= 0) {
+                if (p->left >> 59)
+                    return -1;
+                p->left = p->left * 16 + d;
+            } else if (c == ';' || c == ' ' || c == '\t') {
+                p->chunk = CHUNK_EXT;
+            } else if (c == '\r') {
+                p->chunk = CHUNK_SIZE_LF;
+            } else {
+                return -1;
+            }
+            break;
+        case CHUNK_EXT:
+            if (c == '\r')
+                p->chunk = CHUNK_SIZE_LF;
+            else if (c == '\n')
+                return -1;
+            break;
+        case CHUNK_SIZE_LF:
+            if (c != '\n')
+                return -1;
+            p->chunk = p->left ? CHUNK_DATA : CHUNK_TRAILER_START;
+            break;
+        case CHUNK_DATA_END:
+            if (c != '\r')
+                return -1;
+            p->chunk = CHUNK_DATA_LF;
+            break;
+        case CHUNK_DATA_LF:
+            if (c != '\n')
+                return -1;
+            p->chunk = CHUNK_START;
+            break;
+        case CHUNK_TRAILER_START:
+            if (c == '\r')
+                p->chunk = CHUNK_LAST_LF;
+            else if (c == '\n')
+                return -1;
+            else
+                p->chunk = CHUNK_TRAILER;
+            break;
+        case CHUNK_TRAILER:
+            if (c == '\r')
+                p->chunk = CHUNK_TRAILER_LF;
+            else if (c == '\n')
+                return -1;
+            break;
+        case CHUNK_TRAILER_LF:
+            if (c != '\n')
+                return -1;
+            p->chunk = CHUNK_TRAILER_START;
+            break;
+        case CHUNK_LAST_LF:
+            if (c != '\n')
+                return -1;
+            p->chunk = CHUNK_DONE;
+            break;
+        }
+        i++;
+    }
+    if (p->chunk == CHUNK_DONE)
+        p->done = true;
+    return i;
+}
+
+/* turn the response header in buf into the one for the client, followed by
+ * the body bytes read along with it. Returns EAGAIN while it is incomplete
+ * and -1 if it cannot be passed on.
+ */
+static int parse_response(http_request_t *r, proxy_t *p)
+{
+    char *end, *line, *eol;
+    size_t header_len;
+    int status;
+
+    for (;;) {
+        end = memmem(p->buf, p->buf_len, "\r\n\r\n", 4);
+        if (!end)
+            return p->buf_len == BUF_SIZE ? -1 : EAGAIN;
+        header_len = end + 4 - p->buf;
+
+        if (header_len < 16 || memcmp(p->buf, "HTTP/1.", 7) ||
+            p->buf[8] != ' ')
+            return -1;
+        status = atoi(p->buf + 9);
+        if (status < 100 || status > 999 || status == 101)
+            return -1;
+        if (status >= 200)
+            break;
+
+        /* interim responses, such as 103 Early Hints, are dropped */
+        p->buf_len -= header_len;
+        memmove(p->buf, p->buf + header_len, p->buf_len);
+    }
+
+    size_t body = p->buf_len - header_len;
+    p->head = malloc(header_len + SHORTLINE + body);
+    if (!p->head)
+        return -1;
+
+    eol = memchr(p->buf, '\n', header_len);
+    size_t len = sprintf(p->head, "HTTP/1.1 ");
+    memcpy(p->head + len, p->buf + 9, eol + 1 - (p->buf + 9));
+    len += eol + 1 - (p->buf + 9);
+
+    p->framing = FRAME_EOF;
+    p->keep = p->buf[7] == '1' && !p->http10;
+    for (line = eol + 1; line < end + 2; line = eol + 1) {
+        eol = memchr(line, '\n', end + 2 - line);
+        char *colon = memchr(line, ':', eol - line);
+        if (!colon)
+            return -1;
+
+        size_t name_len = colon - line;
+        char *value = colon + 1;
+        while (value < eol && (*value == ' ' || *value == '\t'))
+            value++;
+
+        if (name_len == 14 && !strncasecmp(line, "Content-Length", 14)) {
+            if (p->framing != FRAME_CHUNKED) {
+                p->framing = FRAME_LENGTH;
+                p->left = strtoull(value, NULL, 10);
+            }
+        } else if (name_len == 17 &&
+                   !strncasecmp(line, "Transfer-Encoding", 17)) {
+            if (eol - value >= 8 && !strncasecmp(eol - 8, "chunked", 7))
+                p->framing = FRAME_CHUNKED;
+        } else if (name_len == 10 && !strncasecmp(line, "Connection", 10)) {
+            for (char *v = value; v + 5 <= eol; v++) {
+                if (!strncasecmp(v, "close", 5))
+                    p->keep = false;
+            }
+            continue;
+        }
+        if (is_hop_by_hop(line, name_len))
+            continue;
+        memcpy(p->head + len, line, eol + 1 - line);
+        len += eol + 1 - line;
+    }
+
+    /* responses which never have a body */
+    if (r->method == HTTP_HEAD || status == 204 || status == 304) {
+        p->framing = FRAME_LENGTH;
+        p->left = 0;
+    }
+    if (p->framing == FRAME_CHUNKED && p->http10)
+        return -1;
+
+    /* a body running until the upstream closes only ends for the client
+     * when its connection closes as well
+     */
+    if (p->framing == FRAME_EOF) {
+        p->keep = false;
+        r->keep_alive_timeout = 0;
+    }
+    len += http_connection_fields(r, p->head + len,
+                                  header_len + SHORTLINE - len);
+    len += sprintf(p->head + len, "\r\n");
+
+    ssize_t framed = frame(p, p->buf + header_len, body);
+    if (framed < 0)
+        return -1;
+    body = framed;
+    if (header_len + body < p->buf_len)
+        p->keep = false;
+    memcpy(p->head + len, p->buf + header_len, body);
+
+    r->status = status;
+    p->out = p->head;
+    p->out_len = len + body;
+    p->out_pos = 0;
+    return 0;
+}
+
+/* go on with forwarding r. Returns 0 once the response is sent, EINPROGRESS
+ * when waiting for either socket, HTTP_BAD_GATEWAY if no upstream answered
+ * and -1 on error.
+ */
+int proxy_do_request(http_request_t *r)
+{
+    proxy_t *p = r->proxy;
+    ssize_t n;
+    int rc;
+
+    for (;;) {
+        switch (p->state) {
+        case PROXY_CONNECT:
+            p->state = PROXY_CONNECTING;
+            return wait_for(r, p->fd, EPOLLOUT, PROXY_TIMEOUT);
+
+        case PROXY_CONNECTING: {
+            int err = 0;
+            socklen_t len = sizeof(err);
+            getsockopt(p->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+            if (err) {
+                errno = err;
+                log_err("cannot connect to upstream %s", p->up->name);
+                if ((rc = retry(p)))
+                    return rc;
+                continue;
+            }
+            p->state = PROXY_SEND;
+            continue;
+        }
+
+        case PROXY_SEND:
+            n = send(p->fd, p->req + p->req_pos, p->req_len - p->req_pos,
+                     MSG_NOSIGNAL);
+            if (n < 0 && errno == EAGAIN)
+                return wait_for(r, p->fd, EPOLLOUT, PROXY_TIMEOUT);
+            if (n < 0) {
+                if ((rc = retry(p)))
+                    return rc;
+                continue;
+            }
+            p->req_pos += n;
+            if (p->req_pos == p->req_len)
+                p->state = r->req_body ? PROXY_SEND_BODY : PROXY_HEADER;
+            continue;
+
+        case PROXY_SEND_BODY:
+            /* the body goes through buf, as fast as the upstream takes it */
+            if (p->buf_pos < p->buf_len) {
+                n = send(p->fd, p->buf + p->buf_pos, p->buf_len - p->buf_pos,
+                         MSG_NOSIGNAL);
+                if (n < 0 && errno == EAGAIN)
+                    return wait_for(r, p->fd, EPOLLOUT, PROXY_TIMEOUT);
+                if (n < 0) {
+                    if ((rc = retry(p)))
+                        return rc;
+                    continue;
+                }
+                p->buf_pos += n;
+                continue;
+            }
+            p->buf_pos = p->buf_len = 0;
+            if (p->body_done) {
+                p->state = PROXY_HEADER;
+                continue;
+            }
+
+            p->body_taken = true;
+            rc = http_read_body(r, forward_body);
+            if (rc == EAGAIN && !p->buf_len)
+                return wait_for(r, r->fd, EPOLLIN, TIMEOUT_BODY);
+            if (rc == EAGAIN || rc == EBUSY)
+                continue;
+            if (rc != 0)
+                return -1;
+            if (p->chunked) {
+                memcpy(p->buf + p->buf_len, LAST_CHUNK, strlen(LAST_CHUNK));
+                p->buf_len += strlen(LAST_CHUNK);
+            }
+            p->body_done = true;
+            continue;
+
+        case PROXY_HEADER:
+            n = recv(p->fd, p->buf + p->buf_len, BUF_SIZE - p->buf_len, 0);
+            if (n < 0 && errno == EAGAIN)
+                return wait_for(r, p->fd, EPOLLIN, PROXY_TIMEOUT);
+            if (n <= 0) {
+                if (p->buf_len)
+                    return HTTP_BAD_GATEWAY;
+                if ((rc = retry(p)))
+                    return rc;
+                continue;
+            }
+            p->buf_len += n;
+            rc = parse_response(r, p);
+            if (rc == EAGAIN)
+                continue;
+            if (rc < 0) {
+                log_err("bad response from upstream %s", p->up->name);
+                return HTTP_BAD_GATEWAY;
+            }
+            p->state = PROXY_BODY;
+            continue;
+
+        case PROXY_BODY:
+            while (p->out_pos < p->out_len) {
+                n = http_send(r, p->out + p->out_pos, p->out_len - p->out_pos,
+                              0);
+                if (n < 0 && errno == EAGAIN)
+                    return wait_for(r, r->fd, EPOLLOUT, TIMEOUT_WRITE);
+                if (n < 0)
+                    return -1;
+                p->out_pos += n;
+                r->out_sent += n;
+            }
+            if (p->done) {
+                release_conn(p, p->keep);
+                proxy_release(r);
+                return 0;
+            }
+
+            n = recv(p->fd, p->buf, BUF_SIZE, 0);
+            if (n < 0 && errno == EAGAIN)
+                return wait_for(r, p->fd, EPOLLIN, PROXY_TIMEOUT);
+            if (n < 0)
+                return -1;
+            if (n == 0) {
+                /* a body of unknown length ends here, others are cut */
+                if (p->framing != FRAME_EOF)
+                    return -1;
+                p->done = true;
+            }
+            ssize_t framed = frame(p, p->buf, n);
+            if (framed < 0) {
+                log_err("bad chunk from upstream %s", p->up->name);
+                return -1;
+            }
+            p->out = p->buf;
+            p->out_len = framed;
+            p->out_pos = 0;
+            if ((size_t) n > p->out_len)
+                p->keep = false;
+            continue;
+        }
+    }
+}
+
+/* free what forwarding r holds, once it is done or its client is gone. A
+ * connection still in use is closed, the response on it being unfinished,
+ * and taken out of the epoll set first: it may be armed for r.
+ */
+void proxy_release(http_request_t *r)
+{
+    proxy_t *p = r->proxy;
+
+    if (!p)
+        return;
+    if (p->fd >= 0) {
+        epoll_ctl(r->epfd, EPOLL_CTL_DEL, p->fd, NULL);
+        release_conn(p, false);
+    }
+    if (p->buf)
+        buf_put(p->buf, BUF_SIZE);
+    free(p->req);
+    free(p->head);
+    free(p);
+    r->proxy = NULL;
+}
@@ -0,0 +1,25 @@
+#ifndef PROXY_H
+#define PROXY_H
+
+#include "http.h"
+
+/* requests for URIs starting with this are forwarded to an upstream */
+#define PROXY_PREFIX "/api/"
+
+/* the upstreams, "host:port" or "unix:path". Each request goes to the one
+ * with the fewest requests in flight from this worker.
+ */
+#define PROXY_UPSTREAMS {"127.0.0.1:9000"}
+
+/* idle keep-alive connections kept per upstream and worker */
+#define PROXY_POOL 32
+
+/* to connect, and between reads of the response once the request is sent */
+#define PROXY_TIMEOUT 30000 /* ms */
+
+int proxy_init();
+int proxy_start(http_request_t *r);
+int proxy_do_request(http_request_t *r);
+void proxy_release(http_request_t *r);
+
+#endif
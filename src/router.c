@@ -0,0 +1,360 @@
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "router.h"
+#if (ENABLE_PROXY)
+#include "proxy.h"
+#endif
+#if (ENABLE_UPLOAD)
+#include "upload.h"
+#endif
+
+/* Routes are added to a radix tree, whose edges are labeled with the
+ * bytes paths share. router_compile() lays it out in arrays, children of
+ * a node next to each other and sorted by the first byte of their label,
+ * which a lookup finds with memchr(). A lookup so takes at most one step
+ * per byte of the path, however many routes there are.
+ */
+typedef struct node {
+    char *label; /* bytes from the parent to here */
+    size_t len;
+    struct node **children;
+    size_t nchildren;
+    int exact, prefix; /* routes of the path up to here, -1 if none */
+} node_t;
+
+typedef struct {
+    uint32_t label; /* offset in labels */
+    uint32_t len;
+    uint32_t children; /* index of the first child in nodes */
+    uint32_t nchildren;
+    int exact, prefix;
+} rnode_t;
+
+static route_t *routes;
+static size_t nroutes;
+static node_t *tree;
+
+/* the compiled tree, nodes[0] its root. firsts[i] is the first byte of
+ * the label of nodes[i].
+ */
+static rnode_t *nodes;
+static char *firsts, *labels;
+
+static time_t started;
+
+static node_t *new_node(const char *label, size_t len)
+{
+    node_t *n = calloc(1, sizeof(node_t));
+    if (!n)
+        return NULL;
+    n->label = malloc(len ? len : 1);
+    if (!n->label) {
+        free(n);
+        return NULL;
+    }
+    memcpy(n->label, label, len);
+    n->len = len;
+    n->exact = n->prefix = -1;
+    return n;
+}
+
+static node_t *add_child(node_t *parent, node_t *child)
+{
+    node_t **c = realloc(parent->children,
+                         (parent->nchildren + 1) * sizeof(node_t *));
+    if (!c)
+        return NULL;
+    parent->children = c;
+    parent->children[parent->nchildren++] = child;
+    return child;
+}
+
+/* the node of path, made if need be. An edge the path leaves halfway is
+ * split at that point.
+ */
+static node_t *insert(node_t *n, const char *path, size_t len)
+{
+    while (len) {
+        node_t *c = NULL;
+        size_t i, common = 0;
+
+        for (i = 0; i < n->nchildren; i++) {
+            if (n->children[i]->label[0] == path[0]) {
+                c = n->children[i];
+                break;
+            }
+        }
+        if (!c) {
+            node_t *leaf = new_node(path, len);
+            if (!leaf || !add_child(n, leaf)) {
+                free(leaf);
+                return NULL;
+            }
+            return leaf;
+        }
+
+        while (common < c->len && common < len &&
+               c->label[common] == path[common])
+            common++;
+        if (common < c->len) {
+            node_t *mid = new_node(path, common);
+            if (!mid || !add_child(mid, c)) {
+                free(mid);
+                return NULL;
+            }
+            memmove(c->label, c->label + common, c->len - common);
+            c->len -= common;
+            n->children[i] = mid;
+            c = mid;
+        }
+        n = c;
+        path += common;
+        len -= common;
+    }
+    return n;
+}
+
+/* whether this build can answer the requests of route */
+static bool supported(const route_t *route)
+{
+    switch (route->type) {
+    case ROUTE_STATIC:
+        return route->options;
+    case ROUTE_HANDLER:
+        return route->handler;
+#if (ENABLE_PROXY)
+    case ROUTE_PROXY:
+        return true;
+#endif
+#if (ENABLE_UPLOAD)
+    case ROUTE_UPLOAD:
+        return true;
+#endif
+    }
+    return false;
+}
+
+/* register a route for path, or for every path starting with it if
+ * prefix is set. The longest prefix wins, a path matching exactly goes
+ * first. Only before router_compile().
+ */
+int router_add(const char *path, bool prefix, const route_t *route)
+{
+    if (nodes || path[0] != '/' || !supported(route)) {
+        log_err("cannot add a route for %s", path);
+        return -1;
+    }
+    if (!tree && !(tree = new_node("", 0)))
+        return -1;
+
+    node_t *n = insert(tree, path, strlen(path));
+    if (!n)
+        return -1;
+    int *slot = prefix ? &n->prefix : &n->exact;
+    if (*slot >= 0) {
+        log_err("route %s added twice", path);
+        return -1;
+    }
+
+    route_t *r = realloc(routes, (nroutes + 1) * sizeof(route_t));
+    if (!r)
+        return -1;
+    routes = r;
+    r = &routes[nroutes];
+    *r = *route;
+    r->root = -1;
+    if (r->type == ROUTE_STATIC) {
+        const route_static_t *o = r->options;
+        r->root = open(o->dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (r->root < 0) {
+            log_err("cannot open %s", o->dir);
+            return -1;
+        }
+    }
+    *slot = nroutes++;
+    return 0;
+}
+
+static size_t count(const node_t *n, size_t *label_bytes)
+{
+    size_t total = 1;
+
+    *label_bytes += n->len;
+    for (size_t i = 0; i < n->nchildren; i++)
+        total += count(n->children[i], label_bytes);
+    return total;
+}
+
+static int by_first(const void *a, const void *b)
+{
+    return (unsigned char) (*(node_t *const *) a)->label[0] -
+           (unsigned char) (*(node_t *const *) b)->label[0];
+}
+
+/* lay out the children of n, which went to nodes[i], from nodes[*next] */
+static void lay_out(node_t *n, size_t i, size_t *next, size_t *label_off)
+{
+    rnode_t *rn = &nodes[i];
+
+    qsort(n->children, n->nchildren, sizeof(node_t *), by_first);
+    rn->children = *next;
+    rn->nchildren = n->nchildren;
+    *next += n->nchildren;
+
+    for (size_t k = 0; k < n->nchildren; k++) {
+        node_t *c = n->children[k];
+        rnode_t *rc = &nodes[rn->children + k];
+
+        memcpy(labels + *label_off, c->label, c->len);
+        rc->label = *label_off;
+        rc->len = c->len;
+        rc->exact = c->exact;
+        rc->prefix = c->prefix;
+        firsts[rn->children + k] = c->label[0];
+        *label_off += c->len;
+    }
+    for (size_t k = 0; k < n->nchildren; k++)
+        lay_out(n->children[k], rn->children + k, next, label_off);
+}
+
+static void free_tree(node_t *n)
+{
+    for (size_t i = 0; i < n->nchildren; i++)
+        free_tree(n->children[i]);
+    free(n->children);
+    free(n->label);
+    free(n);
+}
+
+/* turn the routes added into the arrays router_match() looks them up in */
+int router_compile()
+{
+    size_t label_bytes = 0, next = 1, label_off = 0;
+
+    if (!tree && !(tree = new_node("", 0)))
+        return -1;
+
+    size_t n = count(tree, &label_bytes);
+    nodes = calloc(n, sizeof(rnode_t));
+    firsts = calloc(n, 1);
+    labels = malloc(label_bytes ? label_bytes : 1);
+    if (!nodes || !firsts || !labels) {
+        log_err("no memory for %zu routes", nroutes);
+        return -1;
+    }
+    nodes[0].exact = tree->exact;
+    nodes[0].prefix = tree->prefix;
+    lay_out(tree, 0, &next, &label_off);
+    free_tree(tree);
+    tree = NULL;
+    return 0;
+}
+
+/* the route of the path of uri, its query left out, or NULL. The path is
+ * matched byte for byte, as http_normalize_path() leaves it.
+ */
+const route_t *router_match(const char *uri, size_t len)
+{
+    const char *query = memchr(uri, '?', len);
+    if (query)
+        len = query - uri;
+
+    const rnode_t *n = &nodes[0];
+    int best = -1;
+    size_t i = 0;
+
+    for (;;) {
+        if (n->prefix >= 0)
+            best = n->prefix;
+        if (i == len) {
+            if (n->exact >= 0)
+                best = n->exact;
+            break;
+        }
+
+        const char *c = memchr(firsts + n->children, uri[i], n->nchildren);
+        if (!c)
+            break;
+        n = &nodes[c - firsts];
+        if (len - i < n->len || memcmp(labels + n->label, uri + i, n->len))
+            break;
+        i += n->len;
+    }
+    return best >= 0 ? &routes[best] : NULL;
+}
+
+/* whether route answers the client on fd. Other clients are not told it
+ * exists.
+ */
+bool router_allows(const route_t *route, int fd)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+
+    if (!route->local)
+        return true;
+    if (getpeername(fd, (struct sockaddr *) &addr, &len) < 0 ||
+        addr.sin_family != AF_INET)
+        return false;
+    return ntohl(addr.sin_addr.s_addr) >> 24 == IN_LOOPBACKNET;
+}
+
+static const route_static_t webroot = {.dir = WEBROOT, .pack = true};
+
+/* the routes of the server, before fork() so that worker processes share
+ * them
+ */
+int router_init()
+{
+    started = time(NULL);
+
+    if (router_add("/", true,
+                   &(route_t){.type = ROUTE_STATIC,
+                              .methods = HTTP_GET | HTTP_HEAD,
+                              .options = &webroot}) < 0)
+        return -1;
+    if (router_add(STATS_PATH, false,
+                   &(route_t){.type = ROUTE_HANDLER,
+                              .methods = HTTP_GET | HTTP_HEAD,
+                              .handler = route_stats,
+                              .local = true}) < 0)
+        return -1;
+#if (ENABLE_PROXY)
+    if (router_add(PROXY_PREFIX, true, &(route_t){.type = ROUTE_PROXY}) < 0)
+        return -1;
+#endif
+#if (ENABLE_UPLOAD)
+    if (router_add(UPLOAD_PREFIX, true,
+                   &(route_t){.type = ROUTE_UPLOAD, .methods = HTTP_POST}) < 0)
+        return -1;
+#endif
+    return 0;
+}
+
+/* how the worker process answering is doing, as plain text */
+ssize_t route_stats(http_request_t *r UNUSED,
+                    const void *options UNUSED,
+                    char *body,
+                    size_t size,
+                    const char **type)
+{
+    size_t conns = __atomic_load_n(&http_conns, __ATOMIC_RELAXED);
+    int n = snprintf(body, size,
+                     "pid: %d\nuptime: %ld\nconnections: %zu\n"
+                     "max connections: %d\nroutes: %zu\n",
+                     (int) getpid(), (long) (time(NULL) - started), conns,
+                     MAX_CONNECTIONS, nroutes);
+
+    *type = "text/plain";
+    return n < 0 || (size_t) n >= size ? -1 : n;
+}
@@ -0,0 +1,62 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "http.h"
+
+/* the files served where no other route matches */
+#define WEBROOT "./www"
+
+/* answered with the state of the worker process, to local clients only */
+#define STATS_PATH "/server-status"
+
+/* what answers the requests of a route */
+enum route_type {
+    ROUTE_STATIC,  /* files below a directory, route_static_t */
+    ROUTE_PROXY,   /* forwarded to an upstream, built with ENABLE_PROXY */
+    ROUTE_UPLOAD,  /* bodies kept as files, at UPLOAD_PREFIX only */
+    ROUTE_HANDLER, /* a function makes the response */
+};
+
+/* options of a ROUTE_STATIC. The whole path of a request is looked up
+ * below dir, the part the route matched included.
+ */
+typedef struct {
+    const char *dir;
+    bool pack; /* files in the pack are served from there, ENABLE_PACK */
+} route_static_t;
+
+/* writes the body of the response to r into body, at most size bytes, and
+ * sets its content type. Returns the length of the body, or -1 to answer
+ * 500 Internal Server Error.
+ */
+typedef ssize_t (*route_handler)(http_request_t *r,
+                                 const void *options,
+                                 char *body,
+                                 size_t size,
+                                 const char **type);
+
+typedef struct {
+    int type;              /* enum route_type */
+    int methods;           /* enum http_method allowed, 0 for all */
+    route_handler handler; /* of a ROUTE_HANDLER */
+    const void *options;   /* handed to the handler, route_static_t */
+    int root;              /* of a ROUTE_STATIC, opened by router_add() */
+    bool local;            /* for clients on the loopback interface only */
+} route_t;
+
+int router_init();
+int router_add(const char *path, bool prefix, const route_t *route);
+int router_compile();
+const route_t *router_match(const char *uri, size_t len);
+bool router_allows(const route_t *route, int fd);
+
+ssize_t route_stats(http_request_t *r,
+                    const void *options,
+                    char *body,
+                    size_t size,
+                    const char **type);
+
+#endif
@@ -86,13 +86,13 @@ task_t *thpool_deq(thpool_t *thpool)
     return (thpool->queue->buffer + tmp_offset);
 }
 
-void thpool_enq(thpool_t *thpool, void (*task)(void *), void *arg)
+/* returns -1 if the queue is full and the task was not queued */
+int thpool_enq(thpool_t *thpool, void (*task)(void *), void *arg)
 {
     pthread_mutex_lock(&(thpool->lock));
     if (thpool->queue->task_count >= thpool->queue->size) {
-        perror("queue is full...\n");
         pthread_mutex_unlock(&(thpool->lock));
-        exit(1);
+        return -1;
     }
 
     (thpool->queue->buffer + thpool->queue->in)->function = task;
@@ -103,9 +103,16 @@ void thpool_enq(thpool_t *thpool, void (*task)(void *), void *arg)
         pthread_cond_signal(&(thpool->cond));
 
     pthread_mutex_unlock(&(thpool->lock));
+    return 0;
 }
 
 int thpool_q_empty(thpool_t *thpool)
 {
     return (thpool->queue->task_count == 0) ? 1 : 0;
+}
+
+/* tasks waiting in the queue, read without the lock as a load estimate */
+int thpool_pending(thpool_t *thpool)
+{
+    return __atomic_load_n(&thpool->queue->task_count, __ATOMIC_RELAXED);
 }
\ No newline at end of file
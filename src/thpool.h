@@ -37,7 +37,8 @@ typedef struct {
 thpool_t *thpool_create(int thread_count, int queue_size);
 int thpool_destroy(thpool_t *thpool);
 task_t *thpool_deq(thpool_t *thpool);
-void thpool_enq(thpool_t *thpool, void (*task)(void *), void *arg);
+int thpool_enq(thpool_t *thpool, void (*task)(void *), void *arg);
 int thpool_q_empty(thpool_t *thpool);
+int thpool_pending(thpool_t *thpool);
 
 #endif
\ No newline at end of file
@@ -2,14 +2,13 @@
 #include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/time.h>
+#include <time.h>
 
 #include "logger.h"
 #include "timer.h"
 
 #define TIMER_INFINITE (-1)
 #define PQ_DEFAULT_SIZE 10
-#define INT_MIN -10000000
 
 typedef int (*prio_queue_comparator)(void *pi, void *pj);
 
@@ -124,25 +123,27 @@ static bool prio_queue_delmin(prio_queue_t *ptr)
     return true;
 }
 
-/* decrease the key value of a specific node */
-static bool prio_queue_dec_key(prio_queue_t *ptr, size_t idx, int val)
+/* remove the item at the given index */
+static bool prio_queue_delete(prio_queue_t *ptr, size_t idx)
 {
-    if (prio_queue_is_empty(ptr))
+    if (idx < 1 || idx > ptr->nalloc)
         return false;
 
-    ((timer_node *) ptr->priv[idx])->key += val;
-    swim(ptr, idx);
-    return true;
-}
+    timer_node *node = ptr->priv[idx];
+    swap(ptr, idx, ptr->nalloc);
+    ptr->nalloc--;
 
-/* remove the item of the given key */
-static bool prio_queue_delete(prio_queue_t *ptr, size_t idx)
-{
-    bool ret UNUSED = prio_queue_dec_key(ptr, idx, INT_MIN);
-    timer_node *node = prio_queue_min(ptr);
-    assert(ret && "prio_queue_delete error");
-    prio_queue_delmin(ptr);
+    /* the last item took its place, restore the heap in either direction */
+    if (idx <= ptr->nalloc) {
+        swim(ptr, idx);
+        sink(ptr, idx);
+    }
     free(node);
+
+    if (ptr->nalloc > 0 && ptr->nalloc <= (ptr->size - 1) / 4) {
+        if (!resize(ptr, ptr->size / 2))
+            return false;
+    }
     return true;
 }
 
@@ -168,12 +169,65 @@ static prio_queue_t timer;
 static size_t current_msec;
 pthread_mutex_t timer_lock;
 
-static void time_update()
+/* the Date header only changes once per second. Pool threads may still be
+ * copying an older string while the next one is formatted, so rotate
+ * through a few slots.
+ */
+#define DATE_SLOTS 4
+#define DATE_LEN sizeof("Sun, 06 Nov 1994 08:49:37 GMT")
+
+static char date_slots[DATE_SLOTS][DATE_LEN];
+static const char *cached_date = date_slots[0];
+static time_t cached_sec; /* the wall clock, the second of cached_date */
+static size_t next_date_msec;
+
+static void date_update()
+{
+    static unsigned int slot;
+    struct timespec ts;
+    struct tm tm;
+
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    gmtime_r(&ts.tv_sec, &tm);
+
+    slot = (slot + 1) % DATE_SLOTS;
+    strftime(date_slots[slot], DATE_LEN, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    __atomic_store_n(&cached_date, date_slots[slot], __ATOMIC_RELEASE);
+    __atomic_store_n(&cached_sec, ts.tv_sec, __ATOMIC_RELAXED);
+
+    /* refresh right after the wall clock ticks over to the next second */
+    next_date_msec = current_msec + 1000 - ts.tv_nsec / 1000000;
+}
+
+/* read the clock once per turn of the event loop. The timers use a coarse
+ * monotonic clock, which is not thrown off by the wall clock being set and
+ * is as precise as the millisecond timeouts need.
+ */
+void time_update()
+{
+    struct timespec ts;
+    int rc UNUSED = clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    assert(rc == 0 && "time_update: clock_gettime error");
+    current_msec = ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+    if (current_msec >= next_date_msec)
+        date_update();
+}
+
+size_t time_msec()
+{
+    return current_msec;
+}
+
+const char *time_http_date()
+{
+    return __atomic_load_n(&cached_date, __ATOMIC_ACQUIRE);
+}
+
+/* the wall clock in seconds, as of the last turn of the event loop */
+time_t time_sec()
 {
-    struct timeval tv;
-    int rc UNUSED = gettimeofday(&tv, NULL);
-    assert(rc == 0 && "time_update: gettimeofday error");
-    current_msec = tv.tv_sec * 1000 + tv.tv_usec / 1000;
+    return __atomic_load_n(&cached_sec, __ATOMIC_RELAXED);
 }
 
 int timer_init()
@@ -196,7 +250,6 @@ int find_timer()
     int time = TIMER_INFINITE;
 
     while (!prio_queue_is_empty(&timer)) {
-        time_update();
         timer_node *node = prio_queue_min(&timer);
         assert(node && "prio_queue_min error");
 
@@ -224,7 +277,6 @@ void handle_expired_timers()
             return;
         }
         debug("handle_expired_timers, size = %zu", prio_queue_size(&timer));
-        time_update();
         timer_node *node = prio_queue_min(&timer);
         assert(node && "prio_queue_min error");
 
@@ -234,12 +286,37 @@ void handle_expired_timers()
 #endif
             return;
         }
-        ret = prio_queue_delmin(&timer);
-        assert(ret && "handle_expired_timers: prio_queue_delmin error");
 
-        if (node->callback)
-            node->callback(node->request);
+        /* the deadline of the connection was pushed back since the timer
+         * was armed, so move the timer instead of expiring it. Only the
+         * root changes, hence sinking it is enough.
+         */
+        size_t deadline = node->request ? node->request->deadline : 0;
+        if (deadline > current_msec) {
+            node->key = deadline == TIMER_ACTIVE
+                            ? current_msec + TIMEOUT_DEFAULT
+                            : deadline;
+            sink(&timer, 1);
+#if (ENABLE_THPOOL)
+            pthread_mutex_unlock(&timer_lock);
+#endif
+            continue;
+        }
 
+        /* the callback may keep the connection after all, having pushed
+         * its deadline back
+         */
+        if (node->callback && node->callback(node->request) > 0) {
+            node->key = node->request->deadline;
+            sink(&timer, 1);
+#if (ENABLE_THPOOL)
+            pthread_mutex_unlock(&timer_lock);
+#endif
+            continue;
+        }
+
+        ret = prio_queue_delmin(&timer);
+        assert(ret && "handle_expired_timers: prio_queue_delmin error");
         free(node);
 #if (ENABLE_THPOOL)
         pthread_mutex_unlock(&timer_lock);
@@ -255,9 +332,8 @@ void add_timer(http_request_t *req, size_t timeout, timer_callback cb)
 #if (ENABLE_THPOOL)
     pthread_mutex_lock(&timer_lock);
 #endif
-    time_update();
     req->timer = node;
-    node->key = current_msec + timeout;
+    req->deadline = node->key = current_msec + timeout;
     node->deleted = false;
     node->callback = cb;
     node->request = req;
@@ -275,7 +351,6 @@ void del_timer(http_request_t *req)
 #if (ENABLE_THPOOL)
     pthread_mutex_lock(&timer_lock);
 #endif
-    time_update();
     timer_node *node = req->timer;
     assert(node && "del_timer: req->timer is NULL");
     bool ret UNUSED = prio_queue_delete(&timer, node->idx);
@@ -284,3 +359,25 @@ void del_timer(http_request_t *req)
     pthread_mutex_unlock(&timer_lock);
 #endif
 }
+
+/* move the deadline of a connection. A later deadline is only recorded,
+ * handle_expired_timers() moves the timer once it is due. An earlier one
+ * has to move the timer right away.
+ */
+void timer_set_deadline(http_request_t *req, size_t deadline)
+{
+    timer_node *node = req->timer;
+    assert(node && "timer_set_deadline: req->timer is NULL");
+
+#if (ENABLE_THPOOL)
+    pthread_mutex_lock(&timer_lock);
+#endif
+    req->deadline = deadline; /* handle_expired_timers() reads it locked */
+    if (deadline < node->key) {
+        node->key = deadline;
+        swim(&timer, node->idx);
+    }
+#if (ENABLE_THPOOL)
+    pthread_mutex_unlock(&timer_lock);
+#endif
+}
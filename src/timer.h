@@ -4,8 +4,23 @@
 #include <stdbool.h>
 #include "http.h"
 
-#define TIMEOUT_DEFAULT 500 /* ms */
+#define TIMEOUT_DEFAULT 5000 /* ms, idle keep-alive connection, at most */
+#define TIMEOUT_HEADER 5000 /* ms, to receive a complete request header */
+#define TIMEOUT_WRITE 5000  /* ms, between checks of a response being written */
+#define TIMEOUT_BODY 5000   /* ms, without progress reading a request body */
+#define TIMEOUT_LINGER 2000 /* ms, reading what comes after an error page */
 
+/* once TIMEOUT_WRITE has passed, a client reading a response slower than
+ * this is dropped. Nothing else cuts a response short.
+ */
+#define MIN_SEND_RATE 16384 /* bytes per second */
+
+/* deadline of a connection that is being served, it never times out */
+#define TIMER_ACTIVE ((size_t) -1)
+
+/* called once the deadline of req has passed. Returns 0 when req is gone,
+ * or 1 to keep its timer, having moved req->deadline into the future.
+ */
 typedef int (*timer_callback)(http_request_t *req);
 
 typedef struct {
@@ -17,10 +32,15 @@ typedef struct {
 } timer_node;
 
 int timer_init();
+void time_update();
+size_t time_msec();
+const char *time_http_date();
+time_t time_sec();
 int find_timer();
 void handle_expired_timers();
 
 void add_timer(http_request_t *req, size_t timeout, timer_callback cb);
 void del_timer(http_request_t *req);
+void timer_set_deadline(http_request_t *req, size_t deadline);
 
 #endif
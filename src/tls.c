@@ -0,0 +1,169 @@
+#include <errno.h>
+#include <limits.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "tls.h"
+
+static SSL_CTX *ctx;
+
+/* the context is made before worker processes fork, so that they share the
+ * key tickets are encrypted with, and any of them can resume a session
+ */
+int tls_init(const char *cert, const char *key)
+{
+    ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx)
+        goto error;
+
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+
+    /* once the handshake is done, OpenSSL attaches the "tls" ULP to the
+     * socket with setsockopt(TCP_ULP) and gives the kernel the keys to
+     * encrypt with. Records are then written by plain write(), sendfile()
+     * and splice(). Clients closing without close_notify are just EOF.
+     */
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION |
+                                 SSL_OP_IGNORE_UNEXPECTED_EOF);
+
+    /* responses are written as far as the socket takes them, and resumed
+     * from a copy of the header. Idle connections keep no record buffers.
+     */
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                              SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                              SSL_MODE_RELEASE_BUFFERS);
+
+    /* stateless tickets, no session cache to share between workers */
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+    SSL_CTX_set_num_tickets(ctx, TLS_TICKETS);
+
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) != 1)
+        goto error;
+    return 0;
+
+error:
+    ERR_print_errors_fp(stderr);
+    SSL_CTX_free(ctx);
+    ctx = NULL;
+    return -1;
+}
+
+/* turn the result of an SSL call into that of read(2) or write(2) */
+static ssize_t tls_result(SSL *ssl, int n)
+{
+    if (n > 0)
+        return n;
+
+    switch (SSL_get_error(ssl, n)) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        return -1;
+    case SSL_ERROR_ZERO_RETURN: /* close_notify, or EOF */
+        return 0;
+    case SSL_ERROR_SYSCALL:
+        if (!errno)
+            errno = ECONNRESET;
+        return -1;
+    default:
+        errno = EPROTO;
+        return -1;
+    }
+}
+
+/* go on with the handshake of a new connection. Returns 0 once it is done,
+ * EPOLLIN or EPOLLOUT to wait for and -1 if it failed.
+ */
+int tls_handshake(http_request_t *r)
+{
+    SSL *ssl = r->tls;
+
+    if (!ssl) {
+        ssl = SSL_new(ctx);
+        if (!ssl || SSL_set_fd(ssl, r->fd) != 1) {
+            log_err("SSL_new");
+            SSL_free(ssl);
+            return -1;
+        }
+        r->tls = ssl;
+    }
+
+    ERR_clear_error();
+    int rc = SSL_accept(ssl);
+    if (rc <= 0) {
+        switch (SSL_get_error(ssl, rc)) {
+        case SSL_ERROR_WANT_READ:
+            return EPOLLIN;
+        case SSL_ERROR_WANT_WRITE:
+            return EPOLLOUT;
+        default:
+            debug("TLS handshake failed on fd %d", r->fd);
+            return -1;
+        }
+    }
+
+    r->tls_ready = true;
+    r->ktls_send = BIO_get_ktls_send(SSL_get_wbio(ssl));
+    /* neither kTLS nor OpenSSL sends with MSG_ZEROCOPY */
+    r->zc_off = true;
+    debug("TLS %s on fd %d, kTLS %s", SSL_get_version(ssl), r->fd,
+          r->ktls_send ? "on" : "off");
+    return 0;
+}
+
+ssize_t tls_read(http_request_t *r, void *buf, size_t len)
+{
+    ERR_clear_error();
+    return tls_result(r->tls, SSL_read(r->tls, buf, len > INT_MAX ? INT_MAX
+                                                                  : len));
+}
+
+/* only needed while the kernel does not encrypt for the socket */
+ssize_t tls_write(http_request_t *r, const void *buf, size_t len)
+{
+    ERR_clear_error();
+    return tls_result(r->tls, SSL_write(r->tls, buf, len > INT_MAX ? INT_MAX
+                                                                    : len));
+}
+
+/* the file goes through a buffer of the calling thread. An SSL_write() that
+ * could not complete has to be given the same bytes again, which reading
+ * the same range of the file does.
+ */
+ssize_t tls_send_file(http_request_t *r)
+{
+    static __thread char *chunk;
+    size_t len = r->file_left < TLS_CHUNK ? r->file_left : TLS_CHUNK;
+
+    if (!chunk && !(chunk = malloc(TLS_CHUNK)))
+        return -1;
+
+    ssize_t n = pread(r->file_fd, chunk, len, r->file_off);
+    if (n <= 0)
+        return n;
+    n = tls_write(r, chunk, n);
+    if (n > 0)
+        r->file_off += n;
+    return n;
+}
+
+/* send close_notify if it fits in the socket, the client does not have to
+ * answer it
+ */
+void tls_close(http_request_t *r)
+{
+    if (!r->tls)
+        return;
+    if (r->tls_ready) {
+        ERR_clear_error();
+        SSL_shutdown(r->tls);
+    }
+    SSL_free(r->tls);
+    r->tls = NULL;
+}
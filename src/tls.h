@@ -0,0 +1,27 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <sys/types.h>
+
+#include "http.h"
+
+/* certificate chain and private key in PEM, relative to the working
+ * directory like WEBROOT
+ */
+#define TLS_CERT "./cert.pem"
+#define TLS_KEY "./key.pem"
+
+/* resumption tickets handed to a client after a full handshake */
+#define TLS_TICKETS 1
+
+/* file bytes encrypted per SSL_write() when the kernel does not */
+#define TLS_CHUNK 16384
+
+int tls_init(const char *cert, const char *key);
+int tls_handshake(http_request_t *r);
+ssize_t tls_read(http_request_t *r, void *buf, size_t len);
+ssize_t tls_write(http_request_t *r, const void *buf, size_t len);
+ssize_t tls_send_file(http_request_t *r);
+void tls_close(http_request_t *r);
+
+#endif
@@ -0,0 +1,141 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* for O_TMPFILE */
+#endif
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "timer.h"
+#include "upload.h"
+
+/* a request body being stored. The file has no name until all of it is
+ * there, so that nobody sees half a file, and a failed upload leaves
+ * nothing behind.
+ */
+typedef struct {
+    int fd;
+    size_t room; /* of UPLOAD_MAX, left */
+    char name[NAME_MAX + 1];
+} upload_t;
+
+static int upload_dir = -1;
+
+/* open UPLOAD_DIR, made if need be, before worker processes fork */
+int upload_init()
+{
+    if (mkdir(UPLOAD_DIR, 0755) < 0 && errno != EEXIST)
+        goto error;
+    upload_dir = open(UPLOAD_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (upload_dir < 0)
+        goto error;
+    return 0;
+
+error:
+    log_err("cannot open %s", UPLOAD_DIR);
+    return -1;
+}
+
+/* one path component of letters, digits, '-', '_' and '.', which does not
+ * start with '.'
+ */
+static bool valid_name(const char *name, size_t len)
+{
+    if (!len || len > NAME_MAX || name[0] == '.')
+        return false;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = name[i];
+        if (!isalnum(c) && c != '-' && c != '_' && c != '.')
+            return false;
+    }
+    return true;
+}
+
+/* start storing the body of r, whose path is as http_normalize_path() made
+ * it. Returns 0, or the status to answer with instead: these are found
+ * before the client is told to send the body.
+ */
+int upload_start(http_request_t *r, const char *path, size_t path_len)
+{
+    const char *name = path + sizeof(UPLOAD_PREFIX) - 1;
+    size_t len = path_len - (sizeof(UPLOAD_PREFIX) - 1);
+    struct stat st;
+
+    if (!valid_name(name, len))
+        return HTTP_BAD_REQUEST;
+    if (r->req_body == HTTP_BODY_LENGTH && r->body_left > UPLOAD_MAX)
+        return HTTP_PAYLOAD_TOO_LARGE;
+
+    upload_t *u = malloc(sizeof(upload_t));
+    if (!u)
+        return HTTP_INTERNAL_SERVER_ERROR;
+    memcpy(u->name, name, len);
+    u->name[len] = '\0';
+    u->room = UPLOAD_MAX;
+
+    if (!fstatat(upload_dir, u->name, &st, AT_SYMLINK_NOFOLLOW)) {
+        free(u);
+        return HTTP_CONFLICT;
+    }
+    u->fd = openat(upload_dir, ".", O_TMPFILE | O_WRONLY | O_CLOEXEC, 0644);
+    if (u->fd < 0) {
+        log_err("cannot make a file in %s", UPLOAD_DIR);
+        free(u);
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    r->upload = u;
+    return 0;
+}
+
+/* go on storing the body. Returns HTTP_CREATED once the file is in
+ * UPLOAD_DIR, EINPROGRESS while waiting for the client, the status to
+ * answer with if it cannot be stored or -1 on error.
+ */
+int upload_do_request(http_request_t *r)
+{
+    upload_t *u = r->upload;
+    char path[32];
+
+    int rc = http_read_body_to_file(r, u->fd, &u->room);
+    if (rc == EAGAIN) {
+        struct epoll_event event = {
+            .data.ptr = r,
+            .events = EPOLLIN | EPOLLET | EPOLLONESHOT,
+        };
+        timer_set_deadline(r, time_msec() + TIMEOUT_BODY);
+        epoll_ctl(r->epfd, EPOLL_CTL_MOD, r->fd, &event);
+        return EINPROGRESS;
+    }
+    if (rc != 0)
+        return rc;
+
+    /* the file gets its name only now, unless another upload took it */
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", u->fd);
+    if (linkat(AT_FDCWD, path, upload_dir, u->name, AT_SYMLINK_FOLLOW) < 0) {
+        if (errno == EEXIST)
+            return HTTP_CONFLICT;
+        log_err("cannot store %s in %s", u->name, UPLOAD_DIR);
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    upload_release(r);
+    return HTTP_CREATED;
+}
+
+void upload_release(http_request_t *r)
+{
+    upload_t *u = r->upload;
+
+    if (!u)
+        return;
+    close(u->fd); /* an unnamed file is gone with it */
+    free(u);
+    r->upload = NULL;
+}
@@ -0,0 +1,21 @@
+#ifndef UPLOAD_H
+#define UPLOAD_H
+
+#include "http.h"
+
+/* POST requests for URIs starting with this store their body as a file,
+ * named by the rest of the URI
+ */
+#define UPLOAD_PREFIX "/upload/"
+
+/* where uploaded files go, apart from the files served */
+#define UPLOAD_DIR "./upload"
+
+#define UPLOAD_MAX ((size_t) 1 << 30) /* bytes per file, 1GB */
+
+int upload_init();
+int upload_start(http_request_t *r, const char *path, size_t path_len);
+int upload_do_request(http_request_t *r);
+void upload_release(http_request_t *r);
+
+#endif